@@ -0,0 +1,255 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "checksum.h"
+
+
+/* CRC32C, reflected */
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+	crc = i;
+	for (j = 0; j < 8; j++)
+	    crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+	crc_table[i] = crc;
+    }
+}
+
+
+static uint32_t crc_soft(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+	crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+
+#ifdef HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc, word;
+
+    for ( ; len >= 8; len -= 8, p += 8)
+    {
+	memcpy(&word, p, 8);
+	crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for ( ; len > 0; len--)
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc_update)(uint32_t, const uint8_t *, size_t) = crc_soft;
+
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc_update(~crc, buf, len);
+}
+
+
+/* SHA-256, FIPS 180-4 */
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha_soft(uint32_t *state, const uint8_t *p, size_t blocks)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for ( ; blocks > 0; blocks--, p += 64)
+    {
+	for (i = 0; i < 16; i++)
+	    w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16
+		| (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+	for ( ; i < 64; i++)
+	    w[i] = w[i-16] + w[i-7]
+		+ (ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3))
+		+ (ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10));
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++)
+	{
+	    t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25))
+		+ ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+	    t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+		+ ((a & b) ^ (a & c) ^ (b & c));
+	    h = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+
+#ifdef HAVE_X86
+/* the SHA extensions work on the state as two registers, ABEF and
+   CDGH, four rounds per pair of sha256rnds2; sha256msg1 and msg2 build
+   the message schedule four words at a time, three groups ahead */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha_x86(uint32_t *state, const uint8_t *p, size_t blocks)
+{
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, msg[4], tmp, k;
+    int g;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    for ( ; blocks > 0; blocks--, p += 64)
+    {
+	abef_save = abef;
+	cdgh_save = cdgh;
+
+	for (g = 0; g < 16; g++)
+	{
+	    if (g < 4)
+		msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16*g)), swap);
+	    k = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i*)&sha_k[4*g]));
+	    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+	    if (g >= 3 && g < 15)
+	    {
+		tmp = _mm_alignr_epi8(msg[g & 3], msg[(g - 1) & 3], 4);
+		msg[(g + 1) & 3] = _mm_add_epi32(msg[(g + 1) & 3], tmp);
+		msg[(g + 1) & 3] = _mm_sha256msg2_epu32(msg[(g + 1) & 3], msg[g & 3]);
+	    }
+	    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(k, 0x0e));
+	    if (g >= 1 && g < 13)
+		msg[(g - 1) & 3] = _mm_sha256msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+	}
+
+	abef = _mm_add_epi32(abef, abef_save);
+	cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+static void (*sha_blocks)(uint32_t *, const uint8_t *, size_t) = sha_soft;
+
+
+void sha256_init(struct sha256 *s)
+{
+    static const uint32_t h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(s->state, h0, sizeof(h0));
+    s->used = 0;
+    s->total = 0;
+}
+
+
+/* sha256_update hashes whole blocks where they lie; only the odd bytes at
+   either end of p are copied into s->block */
+void sha256_update(struct sha256 *s, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t n;
+
+    s->total += len;
+    if (s->used > 0)
+    {
+	n = 64 - s->used < len ? 64 - s->used : len;
+	memcpy(s->block + s->used, p, n);
+	s->used += n;
+	p += n;
+	len -= n;
+	if (s->used < 64)
+	    return;
+	sha_blocks(s->state, s->block, 1);
+	s->used = 0;
+    }
+    if (len >= 64)
+    {
+	sha_blocks(s->state, p, len / 64);
+	p += len & ~(size_t)63;
+	len &= 63;
+    }
+    memcpy(s->block, p, len);
+    s->used = len;
+}
+
+
+void sha256_final(struct sha256 *s, uint8_t *digest)
+{
+    uint64_t bits = s->total * 8;
+    int i;
+
+    s->block[s->used++] = 0x80;
+    if (s->used > 56)
+    {
+	memset(s->block + s->used, 0, 64 - s->used);
+	sha_blocks(s->state, s->block, 1);
+	s->used = 0;
+    }
+    memset(s->block + s->used, 0, 56 - s->used);
+    for (i = 0; i < 8; i++)
+	s->block[56 + i] = bits >> (56 - 8*i);
+    sha_blocks(s->state, s->block, 1);
+
+    for (i = 0; i < 32; i++)
+	digest[i] = s->state[i/4] >> (24 - 8*(i % 4));
+}
+
+
+void checksum_init(void)
+{
+#ifdef HAVE_X86
+    unsigned int eax, ebx, ecx, edx;
+    int sse41 = 0;
+#endif
+
+    crc_init();
+#ifdef HAVE_X86
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+	if (ecx & bit_SSE4_2)
+	    crc_update = crc_sse42;
+	sse41 = (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+    }
+    if (sse41 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+	&& (ebx & bit_SHA))
+	sha_blocks = sha_x86;
+#endif
+}
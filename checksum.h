@@ -0,0 +1,31 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+/* CRC32C and SHA-256 over data in memory.  Both use the processor's
+   own instructions for them (SSE4.2 crc32, the SHA extensions) when
+   it has them, and portable C otherwise. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* checksum_init picks the code to use.  Call it once, before any
+   other function here, and before starting threads that use them. */
+void checksum_init(void);
+
+/* crc32c continues a CRC32C (Castagnoli, as iSCSI and ext4 use it);
+   start with crc 0.  crc32c(crc32c(0, a, n), b, m) is the CRC of a
+   followed by b. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+struct sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    uint32_t used;		/* bytes waiting in block */
+    uint64_t total;
+};
+
+void sha256_init(struct sha256 *);
+void sha256_update(struct sha256 *, const void *, size_t);
+void sha256_final(struct sha256 *, uint8_t *digest);	/* 32 bytes */
+
+#endif // __CHECKSUM_H__
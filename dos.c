@@ -6,24 +6,747 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <zlib.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "zimage.h"
 
 
 static int imagesize = 0;
 
+/* how mmap_file() maps the image, from map_option().  With IMAGE_LOAD
+   the image is read into anonymous memory instead of being mapped, and
+   image_fd is kept so changes can be written back.  A second copy of
+   the image as it is on disk tells write_back() which TRACK_SIZE chunks
+   have changed: the tools write to the image with plain stores and
+   read() alike, so there's nothing cheaper to hook. */
+static int map_flags = 0;
+static char *map_names[] = { "populate", "huge", "load", NULL };
+
+#define IMAGE_POPULATE 1
+#define IMAGE_HUGE 2
+#define IMAGE_LOAD 4
+
+#define TRACK_SIZE (64 * 1024)
+#define HUGE_SIZE (2 * 1024 * 1024)
+
+static uint8_t *loaded = NULL;
+static uint8_t *on_disk = NULL;
+static int image_fd = -1;
+static long huge_kb = 0;
+
+/* with --overlay=FILE the image file is only ever read.  It's mapped
+   private, so the tool's stores never reach it, and the sectors that
+   differ from it are kept in FILE (see struct overlay_header in dos.h).
+   mmap_file() lays the sectors FILE holds over the mapping; write_back()
+   compares the mapping with the image file, a TRACK_SIZE chunk at a
+   time, and saves the sectors that differ.  image_fd is the overlay. */
+static char *overlay_name = NULL;
+static int overlay_fd = -1;
+static uint8_t *base = NULL;
+static struct overlay_header overlay;
+static uint8_t *overlay_map = NULL;
+
+#define HELD(s) (overlay_map[(s) / 8] & (1 << ((s) % 8)))
+
+/* a compressed image (see zimage.h) is mapped by zimage_map() and can
+   only be read: none of the above applies to it */
+static int compressed = FALSE;
+
+/* the lowest cluster that might be free; every cluster below it is
+   known to be in use, so alloc_clusters() can start its scan here.
+   set_fat_entry() moves it back down when a cluster is freed. */
+static uint16_t free_hint = CLUST_FIRST;
+
+struct dos_stats dos_stats;
+
+static double phase_time[PHASES];
+static double phase_start = 0;
+static long phase_faults[PHASES];
+static long faults_start = 0;
+static int phase = -1;
+
+static char *phase_names[PHASES] = {
+    "open", "boot sector", "traversal", "data", "repair", "flush"
+};
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static long page_faults(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+
+/* stats_phase charges the time and page faults since the last call to
+   the phase that was running, and starts timing the new one */
+void stats_phase(int new_phase)
+{
+    double t = now();
+    long faults = page_faults();
+
+    if (phase >= 0)
+    {
+	phase_time[phase] += t - phase_start;
+	phase_faults[phase] += faults - faults_start;
+    }
+    phase = new_phase;
+    phase_start = t;
+    faults_start = faults;
+}
+
+
+/* print_stats writes the counters, page faults and phase times to
+   stderr */
+void print_stats(void)
+{
+    struct rusage usage;
+    double total = 0;
+    int i;
+
+    stats_phase(phase);
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stderr, "--- stats ---\n");
+    fprintf(stderr, "FAT entries read:      %llu\n", (unsigned long long)dos_stats.fat_reads);
+    fprintf(stderr, "FAT entries written:   %llu\n", (unsigned long long)dos_stats.fat_writes);
+    fprintf(stderr, "dir entries scanned:   %llu\n", (unsigned long long)dos_stats.dirents_scanned);
+    fprintf(stderr, "clusters touched:      %llu\n", (unsigned long long)dos_stats.clusters_touched);
+    fprintf(stderr, "bytes in:              %llu\n", (unsigned long long)dos_stats.bytes_in);
+    fprintf(stderr, "bytes out:             %llu\n", (unsigned long long)dos_stats.bytes_out);
+    fprintf(stderr, "page faults:           %ld minor, %ld major\n",
+	    usage.ru_minflt, usage.ru_majflt);
+    fprintf(stderr, "image mapping:         %s", map_flags == 0 ? "default" : "");
+    for (i = 0; map_names[i] != NULL; i++)
+    {
+	if (map_flags & (1 << i))
+	    fprintf(stderr, "%s%s", map_names[i],
+		    (map_flags >> (i + 1)) ? "," : "");
+    }
+    fprintf(stderr, "\n");
+    if (map_flags & IMAGE_HUGE)
+	fprintf(stderr, "huge pages mapped:     %ld kB\n", huge_kb);
+    if (zimage_stats.images > 0)
+	fprintf(stderr, "compressed blocks:     %llu inflated, %llu dropped\n",
+		(unsigned long long)zimage_stats.inflated,
+		(unsigned long long)zimage_stats.dropped);
+    if (overlay_name != NULL)
+	fprintf(stderr, "overlay:               %s\n", overlay_name);
+    for (i = 0; i < PHASES; i++)
+    {
+	fprintf(stderr, "time %-16s %.6f s  %ld faults\n", phase_names[i],
+		phase_time[i], phase_faults[i]);
+	total += phase_time[i];
+    }
+    fprintf(stderr, "time total            %.6f s\n", total);
+}
+
+
+/* stats_option takes --stats out of a tool's arguments, and if it was
+   there arranges for the stats to be printed however the tool exits */
+void stats_option(int *argc, char **argv)
+{
+    int i, j, found = FALSE;
+
+    for (i = j = 0; i < *argc; i++)
+    {
+	if (i > 0 && strcmp(argv[i], "--stats") == 0)
+	    found = TRUE;
+	else
+	    argv[j++] = argv[i];
+    }
+    argv[j] = NULL;
+    *argc = j;
+
+    stats_phase(PHASE_OPEN);
+    if (found)
+	atexit(print_stats);
+}
+
+
+/* map_option takes --map=populate,huge,load out of a tool's arguments,
+   like stats_option() does for --stats, and returns -1 if it names a
+   mode we don't know:
+     populate  fault the whole mapping in up front (MAP_POPULATE)
+     huge      ask for transparent huge pages, which anonymous memory
+               always allows and file mappings only on some filesystems
+     load      read the image into anonymous memory, and write back the
+               parts that changed on flush_dirty() and unmmap_file()
+   It takes --overlay=FILE too, which leaves the image file as it is
+   and keeps the changes in FILE instead, making FILE if need be. */
+int map_option(int *argc, char **argv)
+{
+    char *name;
+    int i, j, k, rv = 0;
+
+    for (i = j = 0; i < *argc; i++)
+    {
+	if (i > 0 && strncmp(argv[i], "--overlay=", 10) == 0)
+	{
+	    overlay_name = argv[i] + 10;
+	    if (overlay_name[0] == '\0')
+		rv = -1;
+	    continue;
+	}
+	if (i == 0 || strncmp(argv[i], "--map=", 6) != 0)
+	{
+	    argv[j++] = argv[i];
+	    continue;
+	}
+	for (name = strtok(argv[i] + 6, ","); name != NULL;
+	     name = strtok(NULL, ","))
+	{
+	    for (k = 0; map_names[k] != NULL; k++)
+	    {
+		if (strcmp(name, map_names[k]) == 0)
+		    break;
+	    }
+	    if (map_names[k] == NULL)
+		rv = -1;
+	    else
+		map_flags |= 1 << k;
+	}
+    }
+    argv[j] = NULL;
+    *argc = j;
+    if (overlay_name != NULL && (map_flags & IMAGE_LOAD))
+	rv = -1;
+    return rv;
+}
+
+
+/* huge_aligned reserves size bytes of address space starting on a huge
+   page boundary, so the kernel can back it with huge pages from the
+   first byte.  Returns NULL if it can't. */
+static void *huge_aligned(size_t size)
+{
+    uint8_t *p = mmap(NULL, size + HUGE_SIZE, PROT_NONE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    uint8_t *aligned;
+
+    if (p == MAP_FAILED)
+	return NULL;
+    aligned = (uint8_t*)(((uintptr_t)p + HUGE_SIZE - 1) & ~(uintptr_t)(HUGE_SIZE - 1));
+    if (aligned > p)
+	munmap(p, aligned - p);
+    munmap(aligned + size, p + HUGE_SIZE - aligned);
+    return aligned;
+}
+
+
+/* anon_memory gets size bytes of anonymous memory, at addr if that
+   isn't NULL, asking for huge pages if we're using them.  It isn't
+   prefaulted even with --map=populate: the pread() that fills it
+   faults it in anyway, and faulting it before the madvise() would
+   get it small pages. */
+static uint8_t *anon_memory(void *addr, size_t size)
+{
+    uint8_t *p = mmap(addr, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS
+		      | (addr != NULL ? MAP_FIXED : 0), -1, 0);
+
+    if (p != MAP_FAILED && (map_flags & IMAGE_HUGE))
+	madvise(p, size, MADV_HUGEPAGE);
+    return p;
+}
+
+
+/* load_image reads the image open on fd into anonymous memory, at addr
+   if that isn't NULL, and keeps a second copy to compare against */
+static uint8_t *load_image(int fd, void *addr)
+{
+    uint8_t *image_buf;
+    uint32_t total = 0;
+    ssize_t bytes;
+
+    image_buf = anon_memory(addr, imagesize);
+    if (image_buf == MAP_FAILED)
+	return image_buf;
+
+    while (total < imagesize)
+    {
+	bytes = pread(fd, image_buf + total, imagesize - total, total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	{
+	    fprintf(stderr, "Failed to read disk image: %s\n",
+		    bytes < 0 ? strerror(errno) : "file got shorter");
+	    exit(1);
+	}
+	total += bytes;
+    }
+
+    on_disk = anon_memory((map_flags & IMAGE_HUGE) ? huge_aligned(imagesize)
+			  : NULL, imagesize);
+    if (on_disk == MAP_FAILED)
+    {
+	fprintf(stderr, "Not enough memory to load the disk image\n");
+	exit(1);
+    }
+    memcpy(on_disk, image_buf, imagesize);
+    loaded = image_buf;
+    image_fd = fd;
+    return image_buf;
+}
+
+
+static ssize_t pread_all(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = pread(fd, buf + total, len - total, offset + total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes < 0)
+	    return -1;
+	if (bytes == 0)
+	    break;
+	total += bytes;
+    }
+    return total;
+}
+
+
+static int pwrite_all(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = pwrite(fd, buf + total, len - total, offset + total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    return -1;
+	total += bytes;
+    }
+    return 0;
+}
+
+
+/* read_overlay reads an overlay file's header and its bitmap, which
+   is malloc'd.  Returns -1 if fd isn't an overlay file. */
+int read_overlay(int fd, struct overlay_header *h, uint8_t **bitmap)
+{
+    uint32_t len;
+
+    if (pread_all(fd, (uint8_t*)h, sizeof(*h), 0) != sizeof(*h)
+	|| memcmp(h->magic, OVERLAY_MAGIC, sizeof(h->magic)) != 0
+	|| h->sector_size != OVERLAY_SECTOR
+	|| h->nsectors != (h->base_size + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR
+	|| h->base_len > h->base_size)
+	return -1;
+    len = (h->nsectors + 7) / 8;
+    *bitmap = malloc(len + 1);
+    if (pread_all(fd, *bitmap, len, h->bitmap_offset) != len)
+    {
+	free(*bitmap);
+	return -1;
+    }
+    return 0;
+}
+
+
+/* overlay_matches says whether an overlay was made over the image
+   whose first bytes are at image, size bytes long.  At least the first
+   h->base_len bytes of the image must be there. */
+int overlay_matches(struct overlay_header *h, uint8_t *image, uint64_t size)
+{
+    return h->base_size == size
+	&& memcmp(h->base_boot, image,
+		  size < OVERLAY_SECTOR ? size : OVERLAY_SECTOR) == 0
+	&& crc32(0, image, h->base_len) == h->base_crc;
+}
+
+
+/* overlay_check_mtime warns if the image has been modified since the
+   overlay was made over it.  Only the start of the image is checked
+   by overlay_matches(), so a change to the data area - a file, or a
+   subdirectory - shows up here and nowhere else. */
+void overlay_check_mtime(struct overlay_header *h, struct stat *st,
+			 char *image, char *overlay_file)
+{
+    if (h->base_mtime != st->st_mtim.tv_sec
+	|| h->base_mtime_ns != st->st_mtim.tv_nsec)
+	fprintf(stderr, "Warning: %s has been modified since overlay %s was made over it\n",
+		image, overlay_file);
+}
+
+
+/* overlay_base_len is how much of an image comes before its data area,
+   going by its boot sector, or as much of it as there is */
+static uint32_t overlay_base_len(uint8_t *image, uint64_t size)
+{
+    struct bpb33 bpb;
+    uint64_t len;
+
+    if (size < OVERLAY_SECTOR)
+	return size;
+    read_bpb(image, &bpb);
+    len = ((uint64_t)bpb.bpbResSectors
+	   + (uint64_t)bpb.bpbFATs * bpb.bpbFATsecs) * bpb.bpbBytesPerSec
+	+ (uint64_t)bpb.bpbRootDirEnts * sizeof(struct direntry);
+    return len < size ? len : size;
+}
+
+
+static int save_overlay_map(void)
+{
+    if (pwrite_all(overlay_fd, overlay_map, (overlay.nsectors + 7) / 8,
+		   overlay.bitmap_offset) < 0)
+    {
+	fprintf(stderr, "Failed to write overlay %s: %s\n", overlay_name,
+		strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+
+static void new_overlay(struct stat *image_stat)
+{
+    uint32_t len;
+
+    memset(&overlay, 0, sizeof(overlay));
+    memcpy(overlay.magic, OVERLAY_MAGIC, sizeof(overlay.magic));
+    overlay.sector_size = OVERLAY_SECTOR;
+    overlay.nsectors = (imagesize + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR;
+    overlay.base_size = imagesize;
+    overlay.bitmap_offset = OVERLAY_ALIGN;
+    len = (overlay.nsectors + 7) / 8;
+    overlay.data_offset = (OVERLAY_ALIGN + len + OVERLAY_ALIGN - 1)
+	/ OVERLAY_ALIGN * OVERLAY_ALIGN;
+    memcpy(overlay.base_boot, base,
+	   imagesize < OVERLAY_SECTOR ? imagesize : OVERLAY_SECTOR);
+    overlay.base_len = overlay_base_len(base, imagesize);
+    overlay.base_crc = crc32(0, base, overlay.base_len);
+    overlay.base_mtime = image_stat->st_mtim.tv_sec;
+    overlay.base_mtime_ns = image_stat->st_mtim.tv_nsec;
+    overlay_map = calloc(len + 1, 1);
+    if (pwrite_all(overlay_fd, (uint8_t*)&overlay, sizeof(overlay), 0) < 0
+	|| save_overlay_map() < 0)
+    {
+	fprintf(stderr, "Cannot make overlay %s: %s\n", overlay_name,
+		strerror(errno));
+	exit(1);
+    }
+}
+
+
+/* overlay_image maps the image open on fd private, at addr if that
+   isn't NULL, and lays the sectors held in the overlay over it */
+static uint8_t *overlay_image(char *filename, int fd, void *addr)
+{
+    struct stat statbuf, image_stat;
+    uint8_t *image_buf;
+    uint32_t s, run, offset, len;
+
+    image_buf = mmap(addr, imagesize, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | (addr != NULL ? MAP_FIXED : 0)
+		     | ((map_flags & IMAGE_POPULATE) ? MAP_POPULATE : 0),
+		     fd, 0);
+    if (image_buf == MAP_FAILED)
+	return image_buf;
+    if (map_flags & IMAGE_HUGE)
+	madvise(image_buf, imagesize, MADV_HUGEPAGE);
+    base = mmap(NULL, imagesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+	return base;
+
+    fstat(fd, &image_stat);
+    overlay_fd = open(overlay_name, O_RDWR | O_CREAT, 0666);
+    if (overlay_fd < 0 || fstat(overlay_fd, &statbuf) < 0)
+    {
+	fprintf(stderr, "Cannot open overlay %s: %s\n", overlay_name,
+		strerror(errno));
+	exit(1);
+    }
+    if (statbuf.st_size == 0)
+	new_overlay(&image_stat);
+    else if (read_overlay(overlay_fd, &overlay, &overlay_map) < 0)
+    {
+	fprintf(stderr, "%s is not an overlay file\n", overlay_name);
+	exit(1);
+    }
+    else if (!overlay_matches(&overlay, base, imagesize))
+    {
+	fprintf(stderr, "Overlay %s was made over a different image\n",
+		overlay_name);
+	exit(1);
+    }
+    else
+	overlay_check_mtime(&overlay, &image_stat, filename, overlay_name);
+
+    for (s = 0; s < overlay.nsectors; s += run)
+    {
+	if (!HELD(s))
+	{
+	    run = 1;
+	    continue;
+	}
+	for (run = 1; s + run < overlay.nsectors && HELD(s + run); run++)
+	    ;
+	offset = s * OVERLAY_SECTOR;
+	len = run * OVERLAY_SECTOR;
+	if (len > imagesize - offset)
+	    len = imagesize - offset;
+	if (pread_all(overlay_fd, image_buf + offset, len,
+		      overlay.data_offset + offset) != len)
+	{
+	    fprintf(stderr, "Overlay %s is missing sectors it should have\n",
+		    overlay_name);
+	    exit(1);
+	}
+    }
+    image_fd = overlay_fd;
+    return image_buf;
+}
+
+
+/* save_overlay brings the overlay up to date for len bytes of the image
+   at offset.  Sectors that differ from the image file and from what the
+   overlay holds are written to it; sectors that are the same as the
+   image file again are dropped from the bitmap.  The bitmap is written
+   after the sectors it describes. */
+static int save_overlay(uint8_t *image_buf, uint32_t offset, uint32_t len)
+{
+    static uint8_t held[TRACK_SIZE];
+    uint32_t chunk, first, last, s, run = 0, start = 0, slen, span;
+    uint8_t *p;
+    int any, write, map_changed = FALSE;
+    ssize_t got;
+
+    for (chunk = offset - offset % TRACK_SIZE; chunk < offset + len;
+	 chunk += TRACK_SIZE)
+    {
+	first = (chunk > offset ? chunk : offset) / OVERLAY_SECTOR;
+	last = (chunk + TRACK_SIZE < offset + len ? chunk + TRACK_SIZE
+		: offset + len + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR;
+	span = last * OVERLAY_SECTOR > imagesize ? imagesize
+	    - first * OVERLAY_SECTOR : (last - first) * OVERLAY_SECTOR;
+
+	for (any = FALSE, s = first; s < last && !any; s++)
+	    any = HELD(s) != 0;
+	if (!any && memcmp(image_buf + first * OVERLAY_SECTOR,
+			   base + first * OVERLAY_SECTOR, span) == 0)
+	    continue;
+	if (any)
+	{
+	    got = pread_all(overlay_fd, held, span,
+			    overlay.data_offset + first * OVERLAY_SECTOR);
+	    if (got < 0)
+		got = 0;
+	    memset(held + got, 0, span - got);
+	}
+
+	for (s = first; s <= last; s++)
+	{
+	    write = FALSE;
+	    if (s < last)
+	    {
+		p = image_buf + s * OVERLAY_SECTOR;
+		slen = imagesize - s * OVERLAY_SECTOR < OVERLAY_SECTOR
+		    ? imagesize - s * OVERLAY_SECTOR : OVERLAY_SECTOR;
+		if (memcmp(p, base + s * OVERLAY_SECTOR, slen) != 0)
+		{
+		    write = !HELD(s)
+			|| memcmp(p, held + (s - first) * OVERLAY_SECTOR, slen) != 0;
+		    if (!HELD(s))
+		    {
+			overlay_map[s / 8] |= 1 << (s % 8);
+			map_changed = TRUE;
+		    }
+		}
+		else if (HELD(s))
+		{
+		    overlay_map[s / 8] &= ~(1 << (s % 8));
+		    map_changed = TRUE;
+		}
+	    }
+	    if (write)
+	    {
+		if (run++ == 0)
+		    start = s;
+		continue;
+	    }
+	    if (run == 0)
+		continue;
+	    slen = (start + run) * OVERLAY_SECTOR > imagesize
+		? imagesize - start * OVERLAY_SECTOR : run * OVERLAY_SECTOR;
+	    if (pwrite_all(overlay_fd, image_buf + start * OVERLAY_SECTOR, slen,
+			   overlay.data_offset + start * OVERLAY_SECTOR) < 0)
+	    {
+		fprintf(stderr, "Failed to write overlay %s: %s\n",
+			overlay_name, strerror(errno));
+		return -1;
+	    }
+	    run = 0;
+	}
+    }
+    if (map_changed)
+	return save_overlay_map();
+    return 0;
+}
+
+
+/* image_file_current says whether the image file holds the image as
+   the tool sees it, once write_back() has been called - which it
+   doesn't with --overlay, and the file of a compressed image isn't the
+   image at all.  Tools that read the image file directly check it
+   first. */
+int image_file_current(void)
+{
+    return overlay_fd < 0 && !compressed;
+}
+
+
+/* fwrite_image is fwrite() for len bytes of the image at p.  Those
+   parts of a compressed image that haven't been touched yet aren't
+   there for write() to read, so it goes a chunk at a time, touching
+   each chunk first. */
+size_t fwrite_image(const uint8_t *p, size_t len, FILE *f)
+{
+    size_t done, n;
+
+    if (!compressed)
+	return fwrite(p, 1, len, f);
+    for (done = 0; done < len; done += n)
+    {
+	n = len - done < TRACK_SIZE ? len - done : TRACK_SIZE;
+	zimage_touch(p + done, n);
+	if (fwrite(p + done, 1, n, f) != n)
+	    break;
+    }
+    return done;
+}
+
+
+/* write_range writes len bytes of a loaded image at offset to the
+   image file, and remembers that they're on disk now */
+static int write_range(uint32_t offset, uint32_t len)
+{
+    uint32_t done;
+    ssize_t bytes;
+
+    for (done = 0; done < len; done += bytes)
+    {
+	bytes = pwrite(image_fd, loaded + offset + done, len - done,
+		       offset + done);
+	if (bytes < 0 && errno == EINTR)
+	{
+	    bytes = 0;
+	    continue;
+	}
+	if (bytes <= 0)
+	{
+	    fprintf(stderr, "Failed to write back disk image: %s\n",
+		    strerror(errno));
+	    return -1;
+	}
+    }
+    memcpy(on_disk + offset, loaded + offset, len);
+    return 0;
+}
+
+
+/* write_back writes every chunk of a loaded image that differs from
+   what's on disk to the image file, a run of changed chunks at a time,
+   or with an overlay saves the changed sectors to that.  It does
+   nothing if the image is mapped shared. */
+int write_back(uint8_t *image_buf)
+{
+    uint32_t nchunks = (imagesize + TRACK_SIZE - 1) / TRACK_SIZE;
+    uint32_t first, last, offset, len;
+
+    if (overlay_fd >= 0)
+	return save_overlay(image_buf, 0, imagesize);
+    if (loaded == NULL)
+	return 0;
+
+    for (first = 0; first < nchunks; first = last + 1)
+    {
+	for (last = first; last < nchunks; last++)
+	{
+	    offset = last * TRACK_SIZE;
+	    len = (imagesize - offset < TRACK_SIZE) ? imagesize - offset
+		: TRACK_SIZE;
+	    if (memcmp(loaded + offset, on_disk + offset, len) == 0)
+		break;
+	}
+	if (last == first)
+	    continue;
+
+	offset = first * TRACK_SIZE;
+	len = last * TRACK_SIZE - offset;
+	if (offset + len > imagesize)
+	    len = imagesize - offset;
+	if (write_range(offset, len) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+/* huge_pages_mapped looks the mapping at addr up in /proc/self/smaps
+   and returns how much of it is in huge pages, in kB */
+static long huge_pages_mapped(uint8_t *addr)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    char line[256];
+    unsigned long start, end;
+    long kb, total = 0;
+    int inside = FALSE;
+
+    if (f == NULL)
+	return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	if (sscanf(line, "%lx-%lx", &start, &end) == 2)
+	    inside = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+	else if (inside && (sscanf(line, "AnonHugePages: %ld", &kb) == 1
+			    || sscanf(line, "FilePmdMapped: %ld", &kb) == 1))
+	    total += kb;
+    }
+    fclose(f);
+    return total;
+}
+
+
 /* memory map the FAT-12  disk image file */
 uint8_t *mmap_file(char *filename, int *fd)
 {
     struct stat statbuf;
     uint8_t *image_buf;
     char pathname[MAXPATHLEN+1];
+    uint64_t size;
+    void *addr;
 
+    stats_phase(PHASE_OPEN);
 
     /* If filename isn't an absolute pathname, then we'd better prepend
        the current working directory to it */
@@ -55,11 +778,20 @@ uint8_t *mmap_file(char *filename, int *fd)
 	exit(1);
     }
     imagesize = statbuf.st_size;
+    free_hint = CLUST_FIRST;
 
 
-    /* Step 3: open the file for read/write */
+    /* Step 3: open the file for read/write, or just to read if the
+       changes are going to an overlay or it's a compressed image */
 
-    *fd = open(pathname, O_RDWR);
+    *fd = open(pathname, O_RDONLY);
+    if (*fd >= 0)
+	compressed = zimage_is(*fd);
+    if (*fd >= 0 && !compressed && overlay_name == NULL)
+    {
+	close(*fd);
+	*fd = open(pathname, O_RDWR);
+    }
     if (*fd < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
@@ -67,10 +799,43 @@ uint8_t *mmap_file(char *filename, int *fd)
 	exit(1);
     }
 
+    if (compressed)
+    {
+	if (overlay_name != NULL || (map_flags & IMAGE_LOAD))
+	{
+	    fprintf(stderr, "%s is a compressed image, which the tools can "
+		    "only read; expand it with dos_zimg first\n", filename);
+	    exit(1);
+	}
+	image_buf = zimage_map(*fd, filename, &size,
+			       map_flags & IMAGE_POPULATE);
+	if (image_buf == NULL || size > INT32_MAX)
+	{
+	    fprintf(stderr, "Cannot read compressed image %s: %s\n", filename,
+		    image_buf == NULL ? strerror(errno) : "too big");
+	    exit(1);
+	}
+	imagesize = size;
+	return image_buf;
+    }
+
 
     /* Step 4: we memory map the file */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    addr = (map_flags & IMAGE_HUGE) ? huge_aligned(imagesize) : NULL;
+    if (map_flags & IMAGE_LOAD)
+	image_buf = load_image(*fd, addr);
+    else if (overlay_name != NULL)
+	image_buf = overlay_image(filename, *fd, addr);
+    else
+    {
+	image_buf = mmap(addr, imagesize, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | (addr != NULL ? MAP_FIXED : 0)
+			 | ((map_flags & IMAGE_POPULATE) ? MAP_POPULATE : 0),
+			 *fd, 0);
+	if (image_buf != MAP_FAILED && (map_flags & IMAGE_HUGE))
+	    madvise(image_buf, imagesize, MADV_HUGEPAGE);
+    }
     if (image_buf == MAP_FAILED) 
     {
 	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
@@ -82,11 +847,56 @@ uint8_t *mmap_file(char *filename, int *fd)
 
 void unmmap_file(uint8_t *image, int *fd)
 {
+    if (compressed)
+    {
+	zimage_unmap(image);
+	compressed = FALSE;
+	close(*fd);
+	return;
+    }
+    if (map_flags & IMAGE_HUGE)
+	huge_kb = huge_pages_mapped(image);
+    if (loaded != NULL)
+    {
+	if (write_back(image) < 0)
+	    exit(1);
+	munmap(on_disk, imagesize);
+	loaded = NULL;
+    }
+    if (overlay_fd >= 0)
+    {
+	if (write_back(image) < 0)
+	    exit(1);
+	munmap(base, imagesize);
+	free(overlay_map);
+	close(overlay_fd);
+	overlay_fd = image_fd = -1;
+    }
     munmap(image, imagesize);
     close(*fd);
 }
 
 
+/* read_bpb copies the BIOS parameter block out of the boot sector.
+   The one in the boot sector is a byte-based struct, because this data
+   is unaligned.  This makes it hard to access the multi-byte fields,
+   so we copy it to a slightly larger struct that is word-aligned. */
+void read_bpb(uint8_t *image_buf, struct bpb33 *bpb_aligned)
+{
+    struct bootsector33* bootsect = (struct bootsector33*)image_buf;
+    struct byte_bpb33* bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
+
+    bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
+    bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
+    bpb_aligned->bpbResSectors = getushort(bpb->bpbResSectors);
+    bpb_aligned->bpbFATs = bpb->bpbFATs;
+    bpb_aligned->bpbRootDirEnts = getushort(bpb->bpbRootDirEnts);
+    bpb_aligned->bpbSectors = getushort(bpb->bpbSectors);
+    bpb_aligned->bpbFATsecs = getushort(bpb->bpbFATsecs);
+    bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
+}
+
+
 /* read the bootsector from the disk, and check that it is sane */
 /* define DEBUG to see what the disk parameters actually are */
 
@@ -96,6 +906,7 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     struct byte_bpb33* bpb;  /* BIOS parameter block */
     struct bpb33* bpb_aligned;
 
+    stats_phase(PHASE_BOOT);
 #ifdef DEBUG
     fprintf(stderr, "Size of BPB: %lu\n", sizeof(struct bootsector33));
 #endif
@@ -135,21 +946,9 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     }
 
     bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
-
-    /* bpb is a byte-based struct, because this data is unaligned.
-       This makes it hard to access the multi-byte fields, so we copy
-       it to a slightly larger struct that is word-aligned */
     bpb_aligned = malloc(sizeof(struct bpb33));
+    read_bpb(image_buf, bpb_aligned);
 
-    bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
-    bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
-    bpb_aligned->bpbResSectors = getushort(bpb->bpbResSectors);
-    bpb_aligned->bpbFATs = bpb->bpbFATs;
-    bpb_aligned->bpbRootDirEnts = getushort(bpb->bpbRootDirEnts);
-    bpb_aligned->bpbSectors = getushort(bpb->bpbSectors);
-    bpb_aligned->bpbFATsecs = getushort(bpb->bpbFATsecs);
-    bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
-    
 
 #ifdef DEBUG
     fprintf(stderr, "Bytes per sector: %d\n", bpb_aligned->bpbBytesPerSec);
@@ -162,13 +961,13 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     fprintf(stderr, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
 #endif
 
+    stats_phase(PHASE_TRAVERSE);
     return bpb_aligned;
 }
 
-/* get_fat_entry returns the value from the FAT entry for
-   clusternum. */
-uint16_t get_fat_entry(uint16_t clusternum, 
-		       uint8_t *image_buf, struct bpb33* bpb)
+/* fat12_get returns entry clusternum of the FAT starting at fat.  It
+   touches nothing but the FAT, so it's safe to call from any thread. */
+uint16_t fat12_get(uint8_t *fat, uint16_t clusternum)
 {
     uint32_t offset;
     uint16_t value;
@@ -176,20 +975,19 @@ uint16_t get_fat_entry(uint16_t clusternum,
     
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
+    offset = 3 * (clusternum/2);
     switch(clusternum % 2) 
     {
     case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
+	b1 = *(fat + offset);
+	b2 = *(fat + offset + 1);
 
 	/* mjh: little-endian CPUs are ugly! */
 	value = ((0x0f & b2) << 8) | b1;
 	break;
     case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
+	b1 = *(fat + offset + 1);
+	b2 = *(fat + offset + 2);
 	value = b2 << 4 | ((0xf0 & b1) >> 4);
 	break;
     }
@@ -197,29 +995,25 @@ uint16_t get_fat_entry(uint16_t clusternum,
 }
 
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
-void set_fat_entry(uint16_t clusternum, uint16_t value,
-		   uint8_t *image_buf, struct bpb33* bpb)
+/* fat12_set sets entry clusternum of the FAT starting at fat */
+void fat12_set(uint8_t *fat, uint16_t clusternum, uint16_t value)
 {
     uint32_t offset;
     uint8_t *p1, *p2;
     
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
+    offset = 3 * (clusternum/2);
     switch(clusternum % 2) 
     {
     case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
+	p1 = fat + offset;
+	p2 = fat + offset + 1;
 	/* mjh: little-endian CPUs are really ugly! */
 	*p1 = (uint8_t)(0xff & value);
 	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
 	break;
     case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
+	p1 = fat + offset + 1;
+	p2 = fat + offset + 2;
 	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
 	*p2 = (uint8_t)(0xff & (value >> 4));
 	break;
@@ -227,6 +1021,32 @@ void set_fat_entry(uint16_t clusternum, uint16_t value,
 }
 
 
+/* get_fat_entry returns the value from the FAT entry for
+   clusternum. */
+uint16_t get_fat_entry(uint16_t clusternum, 
+		       uint8_t *image_buf, struct bpb33* bpb)
+{
+    dos_stats.fat_reads++;
+    return fat12_get(image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec,
+		     clusternum);
+}
+
+
+/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
+void set_fat_entry(uint16_t clusternum, uint16_t value,
+		   uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t offset;
+    
+    dos_stats.fat_writes++;
+    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    fat12_set(image_buf + offset, clusternum, value);
+    if ((value & FAT12_MASK) == CLUST_FREE && clusternum < free_hint)
+	free_hint = clusternum;
+    mark_dirty(image_buf, DIRTY_FAT, image_buf + offset + 3 * (clusternum/2), 3);
+}
+
+
 int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 {
     uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
@@ -276,6 +1096,7 @@ uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf,
     p = root_dir_addr(image_buf, bpb);
     if (cluster != MSDOSFSROOT) 
     {
+	dos_stats.clusters_touched++;
 	/* move to the end of the root directory */
 	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
 
@@ -285,3 +1106,941 @@ uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf,
     return p;
 }
 
+
+
+/* num_clusters returns one past the highest cluster number that maps
+   onto the data area of the image.  Note that this is smaller than
+   bpbSectors/bpbSecPerClust, since the reserved sectors, the FATs and
+   the root directory come out of the sector count too. */
+uint16_t num_clusters(struct bpb33* bpb)
+{
+    uint32_t root_secs, data_secs;
+
+    root_secs = (bpb->bpbRootDirEnts * sizeof(struct direntry)
+		 + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec;
+    data_secs = bpb->bpbSectors - bpb->bpbResSectors
+	- (bpb->bpbFATs * bpb->bpbFATsecs) - root_secs;
+    return data_secs / bpb->bpbSecPerClust + CLUST_FIRST;
+}
+
+
+/* get_extents walks the FAT chain starting at cluster, touching only
+   the FAT and never the data clusters, and collapses it into runs of
+   consecutive clusters.  *extents is set to a malloc'd array that the
+   caller must free; the return value is the number of runs.  The walk
+   gives up after num_clusters() steps so a cyclic chain can't hang
+   us. */
+int get_extents(uint16_t cluster, struct extent **extents,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = 0, max = 8;
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    struct extent *ext = malloc(max * sizeof(struct extent));
+
+    while (is_valid_cluster(cluster, bpb) && cluster < limit
+	   && steps++ < limit)
+    {
+	if (n > 0 && ext[n-1].start + ext[n-1].count == cluster)
+	{
+	    ext[n-1].count++;
+	}
+	else
+	{
+	    if (n == max)
+	    {
+		max *= 2;
+		ext = realloc(ext, max * sizeof(struct extent));
+	    }
+	    ext[n].start = cluster;
+	    ext[n].count = 1;
+	    n++;
+	}
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+
+    *extents = ext;
+    return n;
+}
+
+
+/* dirent_filename fills buffer (at least MAXFILENAME bytes) with the
+   8.3 name of a directory entry, with the padding removed and a dot
+   only if there is an extension */
+void dirent_filename(struct direntry *dirent, char *buffer)
+{
+    int i, len = 0;
+
+    for (i = 0; i < 8 && dirent->deName[i] != ' '; i++)
+	buffer[len++] = dirent->deName[i];
+    if (len > 0 && (uint8_t)buffer[0] == SLOT_E5)
+	buffer[0] = (char)SLOT_DELETED;
+
+    if (dirent->deExtension[0] != ' ')
+    {
+	buffer[len++] = '.';
+	for (i = 0; i < 3 && dirent->deExtension[i] != ' '; i++)
+	    buffer[len++] = dirent->deExtension[i];
+    }
+    buffer[len] = '\0';
+}
+
+
+/* sync_fat_copies copies the primary FAT over the other FATs, so that
+   tools that only update the first copy leave the image consistent */
+void sync_fat_copies(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t fat_bytes = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    uint8_t *fat = image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    int i;
+
+    for (i = 1; i < bpb->bpbFATs; i++)
+    {
+	memcpy(fat + i * fat_bytes, fat, fat_bytes);
+	mark_dirty(image_buf, DIRTY_FAT, fat + i * fat_bytes, fat_bytes);
+    }
+}
+
+
+/* msync_range synchronously flushes the pages of the mapped image
+   that cover [offset, offset+len) to disk.  It's used wherever the
+   order in which updates reach the disk matters.  Pages are bigger
+   than sectors, so anything else changed on the same pages goes to
+   disk with the range. */
+int msync_range(uint8_t *image_buf, uint32_t offset, uint32_t len)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uint32_t start = offset - (offset % pagesize);
+
+    if (len == 0)
+	return 0;
+    if (offset + len > imagesize)
+	len = imagesize - offset;
+    if (loaded != NULL || overlay_fd >= 0)
+    {
+	if (loaded != NULL ? write_range(offset, len) < 0
+	    : save_overlay(image_buf, offset, len) < 0)
+	    return -1;
+	if (fdatasync(image_fd) < 0)
+	{
+	    fprintf(stderr, "fdatasync failed: %s\n", strerror(errno));
+	    return -1;
+	}
+	return 0;
+    }
+    if (msync(image_buf + start, offset + len - start, MS_SYNC) < 0)
+    {
+	fprintf(stderr, "msync failed: %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+
+/* alloc_clusters reserves count free clusters and links them into one
+   chain ending in EOF.  If there is a free run big enough we use the
+   first one; otherwise the chain is pieced together from free runs in
+   disk order.  The runs are returned in *extents (malloc'd, the caller
+   frees it) and the return value is how many there are.  If there
+   isn't enough free space the FAT is left alone and -1 is returned. */
+int alloc_clusters(uint32_t count, struct extent **extents,
+		   uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb);
+    struct extent *runs = malloc((total / 2 + 1) * sizeof(struct extent));
+    int nruns = 0, n = 0, i;
+    uint32_t found = 0, need = count;
+    uint16_t c;
+
+    *extents = NULL;
+    if (count == 0)
+    {
+	free(runs);
+	return 0;
+    }
+
+    /* one pass over the FAT to find the free runs, skipping the
+       clusters we already know are in use */
+    for (c = free_hint; c < total; c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) != CLUST_FREE)
+	    continue;
+	if (nruns > 0 && runs[nruns-1].start + runs[nruns-1].count == c)
+	{
+	    runs[nruns-1].count++;
+	}
+	else
+	{
+	    runs[nruns].start = c;
+	    runs[nruns].count = 1;
+	    nruns++;
+	}
+	found++;
+    }
+
+    free_hint = (nruns > 0) ? runs[0].start : total;
+    if (found < count)
+    {
+	free(runs);
+	return -1;
+    }
+
+    for (i = 0; i < nruns; i++)
+    {
+	if (runs[i].count >= count)
+	{
+	    runs[0].start = runs[i].start;
+	    runs[0].count = count;
+	    n = 1;
+	    break;
+	}
+    }
+    if (n == 0)
+    {
+	for (i = 0; need > 0; i++)
+	{
+	    if (runs[i].count > need)
+		runs[i].count = need;
+	    need -= runs[i].count;
+	}
+	n = i;
+    }
+
+    /* link the runs together */
+    for (i = 0; i < n; i++)
+    {
+	for (c = runs[i].start; c < runs[i].start + runs[i].count - 1; c++)
+	    set_fat_entry(c, c + 1, image_buf, bpb);
+	set_fat_entry(c, (i == n - 1) ? (FAT12_MASK & CLUST_EOFS)
+		      : runs[i+1].start, image_buf, bpb);
+    }
+
+    *extents = runs;
+    return n;
+}
+
+
+/* free_chain marks every cluster in the chain starting at cluster as
+   free, and returns the number of clusters freed */
+uint32_t free_chain(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t freed = 0, limit = num_clusters(bpb);
+    uint16_t next;
+
+    while (is_valid_cluster(cluster, bpb) && cluster < limit
+	   && freed < limit)
+    {
+	next = get_fat_entry(cluster, image_buf, bpb);
+	if (next == CLUST_FREE)
+	    break;
+	set_fat_entry(cluster, CLUST_FREE, image_buf, bpb);
+	freed++;
+	cluster = next;
+    }
+    return freed;
+}
+
+
+/* batch_chain adds every cluster in the chain starting at cluster to
+   batch, without touching the FAT yet.  This lets a caller collect
+   many chains and free them all in one pass with apply_free_batch(). */
+void batch_chain(struct free_batch *batch, uint16_t cluster,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t steps = 0, limit = num_clusters(bpb);
+
+    while (is_valid_cluster(cluster, bpb) && cluster < limit
+	   && steps++ < limit)
+    {
+	if (batch->n == batch->max)
+	{
+	    batch->max = batch->max ? batch->max * 2 : 256;
+	    batch->clusters = realloc(batch->clusters,
+				      batch->max * sizeof(uint16_t));
+	}
+	batch->clusters[batch->n++] = cluster;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (cluster == CLUST_FREE)
+	    break;
+    }
+}
+
+
+static int compare_clusters(const void *a, const void *b)
+{
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+
+/* apply_free_batch frees every cluster in batch.  The clusters are
+   sorted first, so the FAT is updated front to back in one pass, and
+   a cluster that was collected twice (from cross-linked chains) is
+   only freed once.  The batch is empty afterwards.  Returns the number
+   of clusters freed. */
+uint32_t apply_free_batch(struct free_batch *batch, uint8_t *image_buf,
+			  struct bpb33* bpb)
+{
+    uint32_t i, freed = 0;
+
+    qsort(batch->clusters, batch->n, sizeof(uint16_t), compare_clusters);
+    for (i = 0; i < batch->n; i++)
+    {
+	if (i > 0 && batch->clusters[i] == batch->clusters[i-1])
+	    continue;
+	if (get_fat_entry(batch->clusters[i], image_buf, bpb) == CLUST_FREE)
+	    continue;
+	set_fat_entry(batch->clusters[i], CLUST_FREE, image_buf, bpb);
+	freed++;
+    }
+    batch->n = 0;
+    return freed;
+}
+
+
+/* the ranges of the image modified since the last flush_dirty(), kept
+   separately for file data, the FATs and directories so that they can
+   be written back in that order */
+struct dirty_set {
+    uint32_t *start;
+    uint32_t *end;
+    int n, max;
+};
+
+static struct dirty_set dirty[DIRTY_KINDS];
+
+
+/* mark_dirty records that len bytes at addr have been modified.  The
+   common case of sequential writes just extends the last range. */
+void mark_dirty(uint8_t *image_buf, int kind, uint8_t *addr, uint32_t len)
+{
+    struct dirty_set *d = &dirty[kind];
+    uint32_t start = addr - image_buf;
+    uint32_t end = start + len;
+
+    if (d->n > 0 && start <= d->end[d->n-1] && end >= d->start[d->n-1])
+    {
+	if (start < d->start[d->n-1])
+	    d->start[d->n-1] = start;
+	if (end > d->end[d->n-1])
+	    d->end[d->n-1] = end;
+	return;
+    }
+    if (d->n == d->max)
+    {
+	d->max = d->max ? d->max * 2 : 64;
+	d->start = realloc(d->start, d->max * sizeof(uint32_t));
+	d->end = realloc(d->end, d->max * sizeof(uint32_t));
+    }
+    d->start[d->n] = start;
+    d->end[d->n] = end;
+    d->n++;
+}
+
+
+static int compare_offsets(const void *a, const void *b)
+{
+    const uint32_t *x = a, *y = b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+
+/* flush one kind of dirty range: sort, merge ranges whose pages touch,
+   and msync each merged range.  Pages in between that nothing marked
+   aren't swept in, since they may hold another kind's changes. */
+static int flush_kind(uint8_t *image_buf, struct dirty_set *d)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uint32_t *pairs, start, end;
+    int i, rv = 0;
+
+    if (d->n == 0)
+	return 0;
+
+    pairs = malloc(d->n * 2 * sizeof(uint32_t));
+    for (i = 0; i < d->n; i++)
+    {
+	pairs[2*i] = d->start[i];
+	pairs[2*i+1] = d->end[i];
+    }
+    qsort(pairs, d->n, 2 * sizeof(uint32_t), compare_offsets);
+
+    start = pairs[0];
+    end = pairs[1];
+    for (i = 1; i <= d->n; i++)
+    {
+	if (i < d->n && pairs[2*i] / pagesize <= (end + pagesize - 1) / pagesize)
+	{
+	    if (pairs[2*i+1] > end)
+		end = pairs[2*i+1];
+	    continue;
+	}
+	if (msync_range(image_buf, start, end - start) < 0)
+	    rv = -1;
+	if (i < d->n)
+	{
+	    start = pairs[2*i];
+	    end = pairs[2*i+1];
+	}
+    }
+
+    free(pairs);
+    d->n = 0;
+    return rv;
+}
+
+
+/* flush_dirty writes back everything marked dirty according to the
+   sync policy:
+     SYNC_NONE     leave it to the kernel (the old behaviour)
+     SYNC_END      one msync of the whole image
+     SYNC_ORDERED  data ranges first, then the FAT ranges, then the
+                   directory ranges, so that a directory entry doesn't
+                   reach the disk before the clusters it points at.
+                   This is best effort: the mapping is written back a
+                   page at a time, and where the end of the FAT or the
+                   root directory shares a page with the next area, or
+                   a directory cluster with file data, they go to disk
+                   together.
+   A loaded image (--map=load) always has its changed chunks written to
+   the file, and an overlay its changed sectors; the policy says whether
+   we then wait for the disk. */
+int flush_dirty(uint8_t *image_buf, int policy)
+{
+    int kind, rv = 0;
+
+    stats_phase(PHASE_FLUSH);
+    switch (policy)
+    {
+    case SYNC_END:
+	if (loaded == NULL && overlay_fd < 0)
+	    rv = msync_range(image_buf, 0, imagesize);
+	break;
+    case SYNC_ORDERED:
+	for (kind = 0; kind < DIRTY_KINDS; kind++)
+	{
+	    if (flush_kind(image_buf, &dirty[kind]) < 0)
+		rv = -1;
+	}
+	break;
+    }
+
+    /* a loaded image's file, or the overlay, is brought up to date
+       whatever the policy */
+    if ((loaded != NULL || overlay_fd >= 0) && (write_back(image_buf) < 0
+			   || (policy != SYNC_NONE && fdatasync(image_fd) < 0)))
+	rv = -1;
+
+    for (kind = 0; kind < DIRTY_KINDS; kind++)
+	dirty[kind].n = 0;
+    return rv;
+}
+
+
+/* parse_sync_policy turns the argument of --sync= into a SYNC_
+   constant, or returns -1 if it isn't one we know */
+int parse_sync_policy(char *name)
+{
+    if (strcmp(name, "none") == 0)
+	return SYNC_NONE;
+    if (strcmp(name, "end") == 0)
+	return SYNC_END;
+    if (strcmp(name, "ordered") == 0)
+	return SYNC_ORDERED;
+    return -1;
+}
+
+
+/* lookup_dirent searches one directory for an entry called name (case
+   insensitively, matching dirent_filename()).  dir_cluster 0 is the
+   fixed-size root directory.  Deleted entries, volume labels and long
+   filename entries are never matched. */
+struct direntry *lookup_dirent(uint16_t dir_cluster, char *name,
+			       uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    char buffer[MAXFILENAME];
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return NULL;
+	    if (dirent->deName[0] == SLOT_DELETED
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    dirent_filename(dirent, buffer);
+	    if (strcasecmp(buffer, name) == 0)
+		return dirent;
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return NULL;
+}
+
+
+/* lookup_path resolves a path from the root directory, with either
+   '/' or '\' between components.  It returns the directory entry of
+   the last component, or NULL if anything along the way is missing.
+   If parent isn't NULL it is set to the cluster of the directory that
+   holds (or would hold) the last component, or to -1 if even that
+   directory doesn't exist.  An empty path names the root directory
+   itself, which has no entry: NULL is returned and *parent is 0. */
+struct direntry *lookup_path(char *path, int *parent,
+			     uint8_t *image_buf, struct bpb33* bpb)
+{
+    char buf[MAXPATHLEN+1];
+    char *component, *next;
+    uint16_t cluster = MSDOSFSROOT;
+    struct direntry *dirent = NULL;
+
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    component = buf;
+    if (parent != NULL)
+	*parent = MSDOSFSROOT;
+
+    while (1)
+    {
+	while (*component == '/' || *component == '\\')
+	    component++;
+	if (*component == '\0')
+	    return dirent;
+
+	next = component + strcspn(component, "/\\");
+	if (*next != '\0')
+	    *next++ = '\0';
+
+	if (dirent != NULL)
+	{
+	    /* the previous component has to be a directory */
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    {
+		if (parent != NULL)
+		    *parent = -1;
+		return NULL;
+	    }
+	    cluster = getushort(dirent->deStartCluster);
+	    if (parent != NULL)
+		*parent = cluster;
+	}
+
+	dirent = lookup_dirent(cluster, component, image_buf, bpb);
+	if (dirent == NULL)
+	{
+	    /* not there - but tell the caller whether it was only the
+	       last component that was missing */
+	    if (parent != NULL)
+	    {
+		while (*next == '/' || *next == '\\')
+		    next++;
+		if (*next != '\0')
+		    *parent = -1;
+	    }
+	    return NULL;
+	}
+	component = next;
+    }
+}
+
+
+/* the first slot of each directory that might be free, so that
+   repeatedly adding entries to a big directory doesn't rescan it from
+   the start every time.  Every slot before the hint is known to be in
+   use.  The table is direct mapped on the directory's first cluster. */
+#define SLOT_HINTS 64
+
+static struct {
+    int valid;
+    uint16_t dir_cluster;
+    uint32_t slot;
+} slot_hint[SLOT_HINTS];
+
+
+/* forget_slot_hint must be called when a slot in a directory is freed,
+   so that the slot can be reused */
+void forget_slot_hint(uint16_t dir_cluster, uint32_t slot)
+{
+    int h = dir_cluster % SLOT_HINTS;
+
+    if (slot_hint[h].valid && slot_hint[h].dir_cluster == dir_cluster
+	&& slot < slot_hint[h].slot)
+	slot_hint[h].slot = slot;
+}
+
+
+/* alloc_dirent finds a free slot in a directory for a new entry.  If a
+   subdirectory is full, a new cluster is allocated, zeroed and linked
+   onto the end of it; the root directory has a fixed size, so if that
+   is full NULL is returned.  The caller is expected to fill in the
+   slot straight away. */
+struct direntry *alloc_dirent(uint16_t dir_cluster, uint8_t *image_buf,
+			      struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t n = clust_size / sizeof(struct direntry);
+    uint32_t slot = 0, idx, skip, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster, next;
+    struct direntry *dirent;
+    struct extent *ext;
+    int h = dir_cluster % SLOT_HINTS;
+
+    if (slot_hint[h].valid && slot_hint[h].dir_cluster == dir_cluster)
+	slot = slot_hint[h].slot;
+
+    if (dir_cluster == MSDOSFSROOT)
+    {
+	dirent = (struct direntry*)root_dir_addr(image_buf, bpb) + slot;
+	for ( ; slot < bpb->bpbRootDirEnts; slot++, dirent++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY
+		|| dirent->deName[0] == SLOT_DELETED)
+		goto found;
+	}
+	return NULL;
+    }
+
+    /* skip to the cluster the hint points into */
+    for (skip = slot / n; skip > 0; skip--)
+    {
+	next = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(next, bpb) || next >= limit)
+	{
+	    slot -= skip * n;
+	    break;
+	}
+	cluster = next;
+    }
+    idx = slot % n;
+
+    while (1)
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb) + idx;
+	for ( ; idx < n; idx++, slot++, dirent++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY
+		|| dirent->deName[0] == SLOT_DELETED)
+		goto found;
+	}
+	next = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(next, bpb) || next >= limit || slot >= limit * n)
+	    break;
+	cluster = next;
+	idx = 0;
+    }
+
+    /* the directory is full - grow it by a cluster */
+    if (alloc_clusters(1, &ext, image_buf, bpb) < 0)
+	return NULL;
+    dirent = (struct direntry*)cluster_to_addr(ext[0].start, image_buf, bpb);
+    memset(dirent, 0, clust_size);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, clust_size);
+    set_fat_entry(cluster, ext[0].start, image_buf, bpb);
+    free(ext);
+
+ found:
+    slot_hint[h].valid = TRUE;
+    slot_hint[h].dir_cluster = dir_cluster;
+    slot_hint[h].slot = slot + 1;
+    return dirent;
+}
+
+
+/* fill_dirent writes a complete directory entry: name is converted to
+   an upper case 8.3 name (anything longer is truncated, and characters
+   DOS doesn't allow are replaced), and the creation and modification
+   times are set to now */
+void fill_dirent(struct direntry *dirent, char *name, uint8_t attributes,
+		 uint16_t start_cluster, uint32_t size)
+{
+    char upper[MAXPATHLEN+1];
+    char *dot;
+    int i, len;
+
+    memset(dirent, 0, sizeof(struct direntry));
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+
+    /* characters DOS doesn't allow in names become underscores, as
+       does a leading dot, which would look like "." or ".." */
+    for (i = 0; name[i] != '\0' && i < MAXPATHLEN; i++)
+    {
+	upper[i] = toupper((unsigned char)name[i]);
+	if ((uint8_t)upper[i] <= ' ' || strchr("\"*+,/:;<=>?[\\]|", upper[i]))
+	    upper[i] = '_';
+    }
+    upper[i] = '\0';
+    if (upper[0] == '.')
+	upper[0] = '_';
+
+    dot = strrchr(upper, '.');
+    if (dot != NULL && dot != upper)
+    {
+	*dot = '\0';
+	len = strlen(dot + 1);
+	memcpy(dirent->deExtension, dot + 1, len > 3 ? 3 : len);
+    }
+    len = strlen(upper);
+    memcpy(dirent->deName, upper, len > 8 ? 8 : len);
+    if (dirent->deName[0] == SLOT_DELETED)
+	dirent->deName[0] = SLOT_E5;
+
+    dirent->deAttributes = attributes;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    set_dirent_time(dirent, time(NULL));
+}
+
+
+/* set_dirent_time sets the creation, modification and access dates of
+   a directory entry from a Unix time, in local time as DOS expects */
+void set_dirent_time(struct direntry *dirent, time_t when)
+{
+    struct tm local, *tm = localtime_r(&when, &local);
+    uint16_t dos_time, dos_date;
+
+    dos_time = (tm->tm_sec / 2) << DT_2SECONDS_SHIFT
+	| tm->tm_min << DT_MINUTES_SHIFT
+	| tm->tm_hour << DT_HOURS_SHIFT;
+    dos_date = tm->tm_mday << DD_DAY_SHIFT
+	| (tm->tm_mon + 1) << DD_MONTH_SHIFT
+	| (tm->tm_year > 80 ? tm->tm_year - 80 : 0) << DD_YEAR_SHIFT;
+    putushort(dirent->deCTime, dos_time);
+    putushort(dirent->deCDate, dos_date);
+    putushort(dirent->deMTime, dos_time);
+    putushort(dirent->deMDate, dos_date);
+    putushort(dirent->deADate, dos_date);
+}
+
+
+/* dirent_time is the reverse of set_dirent_time: the modification
+   time of a directory entry as a Unix time */
+time_t dirent_time(struct direntry *dirent)
+{
+    uint16_t dos_time = getushort(dirent->deMTime);
+    uint16_t dos_date = getushort(dirent->deMDate);
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_sec = ((dos_time & DT_2SECONDS_MASK) >> DT_2SECONDS_SHIFT) * 2;
+    tm.tm_min = (dos_time & DT_MINUTES_MASK) >> DT_MINUTES_SHIFT;
+    tm.tm_hour = (dos_time & DT_HOURS_MASK) >> DT_HOURS_SHIFT;
+    tm.tm_mday = (dos_date & DD_DAY_MASK) >> DD_DAY_SHIFT;
+    tm.tm_mon = ((dos_date & DD_MONTH_MASK) >> DD_MONTH_SHIFT) - 1;
+    tm.tm_year = ((dos_date & DD_YEAR_MASK) >> DD_YEAR_SHIFT) + 80;
+    tm.tm_isdst = -1;
+    if (tm.tm_mday == 0)
+	return 0;		/* never set */
+    return mktime(&tm);
+}
+
+
+/* make_dir creates an empty subdirectory called name in the directory
+   starting at parent (0 for the root), complete with its "." and ".."
+   entries, and returns its directory entry, or NULL if there's no room
+   for it.  The new directory's cluster is written before anything
+   points at it. */
+struct direntry *make_dir(uint16_t parent, char *name,
+			  uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct direntry *dot, *dirent;
+    struct extent *ext;
+    uint16_t cluster;
+
+    if (alloc_clusters(1, &ext, image_buf, bpb) < 0)
+	return NULL;
+    cluster = ext[0].start;
+    free(ext);
+
+    dot = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    memset(dot, 0, clust_size);
+    fill_dirent(&dot[0], "", ATTR_DIRECTORY, cluster, 0);
+    memcpy(dot[0].deName, ".       ", 8);
+    fill_dirent(&dot[1], "", ATTR_DIRECTORY, parent, 0);
+    memcpy(dot[1].deName, "..      ", 8);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dot, clust_size);
+
+    dirent = alloc_dirent(parent, image_buf, bpb);
+    if (dirent == NULL)
+    {
+	set_fat_entry(cluster, CLUST_FREE, image_buf, bpb);
+	return NULL;
+    }
+    fill_dirent(dirent, name, ATTR_DIRECTORY, cluster, 0);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    return dirent;
+}
+
+
+/* format_volume lays down an empty FAT-12 filesystem in the file open
+   on fd, which is truncated to size bytes first.  The file is left
+   sparse: only the boot sector, the first sector of each FAT and the
+   root directory sector holding the volume label are written, so even
+   the biggest image takes a handful of writes.
+
+   sec_per_clust may be 0 to pick the smallest cluster size that keeps
+   the cluster count within FAT-12's limit.  Returns 0 on success, or
+   -1 after printing what went wrong. */
+int format_volume(int fd, uint32_t size, int sec_per_clust,
+		  int root_entries, char *label)
+{
+    uint8_t sector[512];
+    struct bootsector50 *bs = (struct bootsector50*)sector;
+    struct byte_bpb50 *bpb = (struct byte_bpb50*)bs->bsBPB;
+    struct extboot *ext = (struct extboot*)bs->bsExt;
+    struct direntry *dirent = (struct direntry*)sector;
+    uint32_t sectors = size / 512, root_secs, fat_secs = 1, clusters = 0;
+    uint32_t need_fat_secs, volume_id;
+    uint16_t bytes_per_sec = 512, reserved = 1;
+    char volume_label[11];
+    int floppy = (sectors == 2880), spc, i, len;
+    uint8_t media = floppy ? 0xf0 : 0xf8;
+
+    if (size % 512 != 0 || sectors < 64)
+    {
+	fprintf(stderr, "Image size must be a multiple of 512 bytes, and at least 32K\n");
+	return -1;
+    }
+    if (sectors > 0xffff)
+    {
+	fprintf(stderr, "FAT-12 images are limited to %d sectors (%dK)\n",
+		0xffff, 0xffff / 2);
+	return -1;
+    }
+    if (root_entries <= 0 || root_entries % 16 != 0 || root_entries > 4096)
+    {
+	fprintf(stderr, "Root directory entries must be a multiple of 16, up to 4096\n");
+	return -1;
+    }
+    root_secs = root_entries * sizeof(struct direntry) / 512;
+
+    /* find a cluster size that works, and the FAT size that goes with
+       it.  The FAT size depends on the cluster count, which depends on
+       the FAT size, so we grow the FAT until it's big enough. */
+    for (spc = sec_per_clust ? sec_per_clust : 1; spc <= 128; spc *= 2)
+    {
+	fat_secs = 1;
+	while (1)
+	{
+	    clusters = (sectors - 1 - 2 * fat_secs - root_secs) / spc;
+	    /* an entry is a byte and a half, so round an odd count up */
+	    need_fat_secs = (((clusters + 2) * 3 + 1) / 2 + 511) / 512;
+	    if (need_fat_secs <= fat_secs)
+		break;
+	    fat_secs = need_fat_secs;
+	}
+
+	if (clusters <= 4084 || sec_per_clust)
+	    break;
+    }
+    if (spc > 128 || (spc & (spc - 1)) != 0)
+    {
+	fprintf(stderr, "Sectors per cluster must be a power of 2, up to 128\n");
+	return -1;
+    }
+    if (clusters > 4084)
+    {
+	fprintf(stderr, "%u clusters is too many for FAT-12 - use bigger clusters\n",
+		clusters);
+	return -1;
+    }
+    if (clusters < 1)
+    {
+	fprintf(stderr, "No room left for any data clusters\n");
+	return -1;
+    }
+
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)
+    {
+	fprintf(stderr, "Cannot size disk image: %s\n", strerror(errno));
+	return -1;
+    }
+
+    /* the boot sector */
+    memset(sector, 0, sizeof(sector));
+    bs->bsJump[0] = 0xeb;
+    bs->bsJump[1] = 0x3c;
+    bs->bsJump[2] = 0x90;
+    memcpy(bs->bsOemName, "dos_mkfs", 8);
+    putushort(bpb->bpbBytesPerSec, bytes_per_sec);
+    bpb->bpbSecPerClust = spc;
+    putushort(bpb->bpbResSectors, reserved);
+    bpb->bpbFATs = 2;
+    putushort(bpb->bpbRootDirEnts, root_entries);
+    putushort(bpb->bpbSectors, sectors);
+    bpb->bpbMedia = media;
+    putushort(bpb->bpbFATsecs, fat_secs);
+    putushort(bpb->bpbSecPerTrack, floppy ? 18 : 32);
+    putushort(bpb->bpbHeads, floppy ? 2 : 64);
+    ext->exDriveNumber = floppy ? 0x00 : 0x80;
+    ext->exBootSignature = EXBOOTSIG;
+    volume_id = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+    putulong(ext->exVolumeID, volume_id);
+    memset(volume_label, ' ', 11);
+    len = label ? strlen(label) : 0;
+    for (i = 0; i < len && i < 11; i++)
+	volume_label[i] = toupper((unsigned char)label[i]);
+    if (len == 0)
+	memcpy(volume_label, "NO NAME    ", 11);
+    memcpy(ext->exVolumeLabel, volume_label, 11);
+    memcpy(ext->exFileSysType, "FAT12   ", 8);
+    /* not bootable: just halt */
+    bs->bsBootCode[0] = 0xf4;
+    bs->bsBootCode[1] = 0xeb;
+    bs->bsBootCode[2] = 0xfd;
+    bs->bsBootSectSig0 = BOOTSIG0;
+    bs->bsBootSectSig1 = BOOTSIG1;
+    if (pwrite(fd, sector, 512, 0) != 512)
+	goto write_error;
+
+    /* the first sector of each FAT: the media descriptor entry and an
+       end-of-chain marker for reserved cluster 1.  The rest is zero,
+       i.e. free, and stays sparse. */
+    memset(sector, 0, sizeof(sector));
+    sector[0] = media;
+    sector[1] = 0xff;
+    sector[2] = 0xff;
+    for (i = 0; i < 2; i++)
+    {
+	if (pwrite(fd, sector, 512, (1 + i * fat_secs) * 512) != 512)
+	    goto write_error;
+    }
+
+    /* the volume label is the first entry of the root directory */
+    if (len > 0)
+    {
+	memset(sector, 0, sizeof(sector));
+	fill_dirent(dirent, "", ATTR_VOLUME | ATTR_ARCHIVE, 0, 0);
+	memcpy(dirent->deName, volume_label, 8);
+	memcpy(dirent->deExtension, volume_label + 8, 3);
+	if (pwrite(fd, sector, 512, (1 + 2 * fat_secs) * 512) != 512)
+	    goto write_error;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Formatted %u sectors: %d sectors/cluster, %u clusters, %u sectors/FAT\n",
+	    sectors, spc, clusters, fat_secs);
+#endif
+    return 0;
+
+ write_error:
+    fprintf(stderr, "Cannot write disk image: %s\n", strerror(errno));
+    return -1;
+}
@@ -12,11 +12,56 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
 
+int map_option(int *, char **);
 uint8_t *mmap_file(char *, int *);
 void unmmap_file(uint8_t *, int *);
+int write_back(uint8_t *);
+int image_file_current(void);
+size_t fwrite_image(const uint8_t *, size_t, FILE *);
+
+/* an overlay file, made by --overlay=: this header, a bitmap of the
+   sectors it holds at bitmap_offset, and sector n of the image, if
+   it's held, at data_offset + n * OVERLAY_SECTOR.  Sectors it doesn't
+   hold are holes, so the file is only as big as the changes.  The
+   image it goes over is known by its size, its first sector and a crc
+   of everything up to the data area (reserved sectors, FATs and root
+   directory), and an overlay is refused over an image where those
+   differ.  The data area, subdirectories included, isn't checked: a
+   change there only shows as a different mtime, which is warned
+   about. */
+#define OVERLAY_MAGIC "FATOVL03"
+#define OVERLAY_SECTOR 512
+#define OVERLAY_ALIGN 4096
+
+struct overlay_header {
+    char magic[8];
+    uint32_t sector_size;
+    uint32_t nsectors;
+    uint64_t base_size;			/* the image it goes over */
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+    uint32_t base_len;			/* bytes base_crc covers */
+    uint32_t base_crc;			/* zlib crc32 of them; the data area
+					   isn't covered */
+    int64_t base_mtime;			/* the image's mtime, seconds */
+    uint32_t base_mtime_ns;		/* and nanoseconds */
+    uint32_t pad;
+    uint8_t base_boot[OVERLAY_SECTOR];	/* that image's first sector */
+};
+
+int read_overlay(int, struct overlay_header *, uint8_t **);
+int overlay_matches(struct overlay_header *, uint8_t *, uint64_t);
+void overlay_check_mtime(struct overlay_header *, struct stat *, char *, char *);
 
 struct bpb33* check_bootsector(uint8_t *);
+void read_bpb(uint8_t *, struct bpb33 *);
+
+uint16_t fat12_get(uint8_t *, uint16_t);
+void fat12_set(uint8_t *, uint16_t, uint16_t);
 
 uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
 
@@ -29,4 +74,81 @@ uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
 
 uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
 
+uint16_t num_clusters(struct bpb33 *);
+
+/* a run of consecutive clusters in a FAT chain */
+struct extent {
+    uint16_t start;	/* first cluster of the run */
+    uint16_t count;	/* number of clusters in the run */
+};
+
+int get_extents(uint16_t, struct extent **, uint8_t *, struct bpb33 *);
+int alloc_clusters(uint32_t, struct extent **, uint8_t *, struct bpb33 *);
+uint32_t free_chain(uint16_t, uint8_t *, struct bpb33 *);
+
+/* clusters waiting to be freed together by apply_free_batch() */
+struct free_batch {
+    uint16_t *clusters;
+    uint32_t n, max;
+};
+
+void batch_chain(struct free_batch *, uint16_t, uint8_t *, struct bpb33 *);
+uint32_t apply_free_batch(struct free_batch *, uint8_t *, struct bpb33 *);
+
+void dirent_filename(struct direntry *, char *);
+
+void sync_fat_copies(uint8_t *, struct bpb33 *);
+int msync_range(uint8_t *, uint32_t, uint32_t);
+
+/* kinds of dirty range, in the order SYNC_ORDERED flushes them */
+#define DIRTY_DATA 0
+#define DIRTY_FAT 1
+#define DIRTY_DIR 2
+#define DIRTY_KINDS 3
+
+/* sync policies for flush_dirty() */
+#define SYNC_NONE 0
+#define SYNC_END 1
+#define SYNC_ORDERED 2
+
+struct direntry *lookup_dirent(uint16_t, char *, uint8_t *, struct bpb33 *);
+struct direntry *lookup_path(char *, int *, uint8_t *, struct bpb33 *);
+struct direntry *alloc_dirent(uint16_t, uint8_t *, struct bpb33 *);
+void forget_slot_hint(uint16_t, uint32_t);
+void fill_dirent(struct direntry *, char *, uint8_t, uint16_t, uint32_t);
+void set_dirent_time(struct direntry *, time_t);
+time_t dirent_time(struct direntry *);
+struct direntry *make_dir(uint16_t, char *, uint8_t *, struct bpb33 *);
+
+int format_volume(int, uint32_t, int, int, char *);
+
+void mark_dirty(uint8_t *, int, uint8_t *, uint32_t);
+int flush_dirty(uint8_t *, int);
+int parse_sync_policy(char *);
+
+/* counters behind every tool's --stats option */
+struct dos_stats {
+    uint64_t fat_reads;		/* get_fat_entry() calls */
+    uint64_t fat_writes;	/* set_fat_entry() calls */
+    uint64_t dirents_scanned;	/* directory slots looked at */
+    uint64_t clusters_touched;	/* data clusters mapped, whole runs counted */
+    uint64_t bytes_in;		/* bytes read from host files or stdin */
+    uint64_t bytes_out;		/* bytes written to host files or stdout */
+};
+
+extern struct dos_stats dos_stats;
+
+/* the phases wall time is charged to */
+#define PHASE_OPEN 0
+#define PHASE_BOOT 1
+#define PHASE_TRAVERSE 2
+#define PHASE_DATA 3
+#define PHASE_REPAIR 4
+#define PHASE_FLUSH 5
+#define PHASES 6
+
+void stats_option(int *, char **);
+void stats_phase(int);
+void print_stats(void);
+
 #endif // __DOS_H__
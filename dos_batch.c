@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "ioqueue.h"
+
+
+/* dos_batch runs a script of commands against one disk image.  The
+   image is mapped and its boot sector checked once, and everything the
+   tools would otherwise work out again on each run is kept between
+   commands: where directories start (below), the free slot hints and
+   the allocator's idea of where free space starts (in dos.c).  The FAT
+   copies are brought up to date and the image flushed once, at the
+   end, however the script finishes. */
+
+#define MAXARGS 4
+#define MAXLINE 1024
+
+
+/* the starting cluster of recently used directories, by upper case
+   path without leading or trailing slashes.  Entries are replaced
+   round robin, and the whole cache is dropped when a directory is
+   removed. */
+#define DIRCACHE 64
+
+struct {
+    char path[MAXPATHLEN+1];
+    uint16_t cluster;
+} dircache[DIRCACHE];
+int dircache_used = 0, dircache_next = 0;
+
+char *script_name;
+int line_no = 0;
+struct free_batch batch;
+
+/* with --queue-depth, every cp-out shares one I/O queue */
+struct ioqueue queue;
+int image_fd;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-k] [--sync=none|end|ordered] <imagename> [script]\n", progname);
+    fprintf(stderr, "\truns the commands in script (or standard input) against the disk image:\n");
+    fprintf(stderr, "\t  cp-in <filename> <path>: copy a normal file into the image\n");
+    fprintf(stderr, "\t  cp-out <path> <filename>: copy a file out of the image\n");
+    fprintf(stderr, "\t  cat <path>: copy a file to standard output\n");
+    fprintf(stderr, "\t  ls [dir]: list a directory\n");
+    fprintf(stderr, "\t  rm [-r] [-f] <path>: remove a file, or with -r a directory tree\n");
+    fprintf(stderr, "\t  mkdir [-p] <dir>: create a directory\n");
+    fprintf(stderr, "\tblank lines and lines starting with # are ignored\n");
+    fprintf(stderr, "\t-k: carry on after a command fails\n");
+    fprintf(stderr, "\t--sync=none|end|ordered: how changes are flushed to disk (default none)\n");
+    fprintf(stderr, "\t--queue-depth=N: cp-out with up to N reads and writes in flight\n");
+    fprintf(stderr, "\t--io=uring|threads: how to queue them (default io_uring if the kernel has it)\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* complain reports a failed command, with where it came from */
+int complain(char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s:%d: ", script_name, line_no);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+
+/* normalize copies path into buf in the form the directory cache
+   uses: upper case, '/' between components, no empty components */
+void normalize(char *path, char *buf)
+{
+    int i = 0;
+
+    if (strncmp("a:", path, 2) == 0)
+	path += 2;
+    for ( ; *path != '\0' && i < MAXPATHLEN; path++)
+    {
+	if (*path == '/' || *path == '\\')
+	{
+	    if (i > 0 && buf[i-1] != '/')
+		buf[i++] = '/';
+	}
+	else
+	    buf[i++] = toupper((unsigned char)*path);
+    }
+    if (i > 0 && buf[i-1] == '/')
+	i--;
+    buf[i] = '\0';
+}
+
+
+/* split_path cuts a normalized path at its last '/', leaving the
+   directory in path, and returns the last component */
+char *split_path(char *path)
+{
+    char *slash = strrchr(path, '/');
+
+    if (slash == NULL)
+    {
+	memmove(path + 1, path, strlen(path) + 1);
+	path[0] = '\0';
+	return path + 1;
+    }
+    *slash = '\0';
+    return slash + 1;
+}
+
+
+void remember_dir(char *path, uint16_t cluster)
+{
+    strcpy(dircache[dircache_next].path, path);
+    dircache[dircache_next].cluster = cluster;
+    dircache_next = (dircache_next + 1) % DIRCACHE;
+    if (dircache_used < DIRCACHE)
+	dircache_used++;
+}
+
+
+/* find_dir returns the starting cluster of the directory at a
+   normalized path (0 for the root), or -1 if it doesn't exist or isn't
+   a directory.  Parents are found the same way, so a path's prefixes
+   are each only looked up once. */
+int find_dir(char *path, uint8_t *image_buf, struct bpb33* bpb)
+{
+    char parent[MAXPATHLEN+2];
+    struct direntry *dirent;
+    char *name;
+    int i, cluster;
+
+    if (path[0] == '\0')
+	return MSDOSFSROOT;
+    for (i = 0; i < dircache_used; i++)
+    {
+	if (strcmp(dircache[i].path, path) == 0)
+	    return dircache[i].cluster;
+    }
+
+    strcpy(parent, path);
+    name = split_path(parent);
+    cluster = find_dir(parent, image_buf, bpb);
+    if (cluster < 0)
+	return -1;
+    dirent = lookup_dirent(cluster, name, image_buf, bpb);
+    if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	return -1;
+
+    cluster = getushort(dirent->deStartCluster);
+    remember_dir(path, cluster);
+    return cluster;
+}
+
+
+/* find_entry looks up the entry for a path, setting *dir_cluster to
+   the directory holding it.  It returns NULL if it isn't there, with
+   *dir_cluster -1 if even the directory is missing. */
+struct direntry *find_entry(char *path, int *dir_cluster,
+			    uint8_t *image_buf, struct bpb33* bpb)
+{
+    char buf[MAXPATHLEN+2];
+    char *name;
+
+    normalize(path, buf);
+    name = split_path(buf);
+    *dir_cluster = find_dir(buf, image_buf, bpb);
+    if (*dir_cluster < 0 || *name == '\0')
+	return NULL;
+    return lookup_dirent(*dir_cluster, name, image_buf, bpb);
+}
+
+
+/* find_file is find_entry for commands that want a regular file */
+struct direntry *find_file(char *path, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    int dir_cluster;
+
+    dirent = find_entry(path, &dir_cluster, image_buf, bpb);
+    if (dirent == NULL)
+    {
+	complain("No file called %s exists in the disk image", path);
+	return NULL;
+    }
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	complain("%s is a directory", path);
+	return NULL;
+    }
+    return dirent;
+}
+
+
+/* write_file copies a file's contents out of the image a run of
+   clusters at a time */
+int write_file(struct direntry *dirent, FILE *out,
+	       uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t remaining = getulong(dirent->deFileSize), run;
+    struct extent *extents;
+    int nextents, i;
+
+    nextents = get_extents(getushort(dirent->deStartCluster), &extents,
+			   image_buf, bpb);
+    for (i = 0; i < nextents && remaining > 0; i++)
+    {
+	run = extents[i].count * clust_size;
+	if (run > remaining)
+	    run = remaining;
+	dos_stats.clusters_touched += extents[i].count - 1;
+	if (fwrite_image(cluster_to_addr(extents[i].start, image_buf, bpb),
+			 run, out) != run)
+	    break;
+	dos_stats.bytes_out += run;
+	remaining -= run;
+    }
+    free(extents);
+    return remaining == 0 ? 0 : -1;
+}
+
+
+int do_cat(char **args, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent = find_file(args[1], image_buf, bpb);
+
+    if (dirent == NULL)
+	return -1;
+    if (write_file(dirent, stdout, image_buf, bpb) < 0)
+	return complain("%s is shorter than its directory entry says", args[1]);
+    return 0;
+}
+
+
+int do_cp_out(char **args, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent = find_file(args[1], image_buf, bpb);
+    FILE *out;
+    int out_fd, rv;
+
+    if (dirent == NULL)
+	return -1;
+    if (ioq_depth > 0 && image_file_current())
+    {
+	out_fd = open(args[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out_fd < 0)
+	    return complain("Can't open file %s to copy data out", args[2]);
+	/* the queue reads the image file, which has to have this
+	   session's changes in it if the image was loaded */
+	rv = write_back(image_buf);
+	if (rv == 0)
+	    rv = ioq_copy_out(&queue, image_fd,
+			      getushort(dirent->deStartCluster),
+			      getulong(dirent->deFileSize), out_fd, image_buf, bpb);
+	if (close(out_fd) < 0)
+	    rv = -1;
+	if (rv < 0)
+	    return complain("Failed to copy out %s: %s", args[1], strerror(errno));
+	return 0;
+    }
+    out = fopen(args[2], "w");
+    if (out == NULL)
+	return complain("Can't open file %s to copy data out", args[2]);
+    rv = write_file(dirent, out, image_buf, bpb);
+    if (fclose(out) != 0)
+	rv = -1;
+    if (rv < 0)
+	return complain("Failed to copy out %s", args[1]);
+    return 0;
+}
+
+
+/* read_fully reads up to len bytes into buf, retrying short reads,
+   and returns the number of bytes read */
+size_t read_fully(int fd, uint8_t *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = read(fd, buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    break;
+	total += bytes;
+    }
+    dos_stats.bytes_in += total;
+    return total;
+}
+
+
+/* do_cp_in reserves all of a file's clusters at once and reads it
+   straight into them, one read per run, like dos_cp does */
+int do_cp_in(char **args, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t size, remaining, want, run;
+    struct direntry *dirent;
+    struct extent *ext;
+    struct stat statbuf;
+    uint16_t start_cluster;
+    uint8_t *p;
+    char buf[MAXPATHLEN+2];
+    char *name;
+    size_t bytes;
+    int fd, dir_cluster, n, i;
+
+    normalize(args[2], buf);
+    name = split_path(buf);
+    dir_cluster = find_dir(buf, image_buf, bpb);
+    if (dir_cluster < 0)
+	return complain("Directory %s does not exist in the disk image", buf);
+    if (*name == '\0')
+	return complain("No filename given to copy %s to", args[1]);
+    if (lookup_dirent(dir_cluster, name, image_buf, bpb) != NULL)
+	return complain("File %s already exists", args[2]);
+
+    fd = open(args[1], O_RDONLY);
+    if (fd < 0)
+	return complain("Can't open file %s to copy data in", args[1]);
+    if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)
+	|| statbuf.st_size > UINT32_MAX)
+    {
+	close(fd);
+	return complain("%s is not a regular file that fits on a FAT filesystem",
+			args[1]);
+    }
+    size = remaining = statbuf.st_size;
+
+    n = alloc_clusters((size + clust_size - 1) / clust_size, &ext,
+		       image_buf, bpb);
+    if (n < 0)
+    {
+	close(fd);
+	return complain("No more space in filesystem for %s", args[2]);
+    }
+    start_cluster = (n > 0) ? ext[0].start : 0;
+
+    for (i = 0; i < n; i++)
+    {
+	run = ext[i].count * clust_size;
+	want = (run < remaining) ? run : remaining;
+	p = cluster_to_addr(ext[i].start, image_buf, bpb);
+	dos_stats.clusters_touched += ext[i].count - 1;
+	bytes = read_fully(fd, p, want);
+	/* zero the slack at the end of the last cluster */
+	memset(p + bytes, 0, run - bytes);
+	mark_dirty(image_buf, DIRTY_DATA, p, run);
+	remaining -= bytes;
+	if (bytes < want)
+	    break;
+    }
+    free(ext);
+    close(fd);
+    if (remaining > 0)
+    {
+	free_chain(start_cluster, image_buf, bpb);
+	return complain("%s got shorter while it was being copied", args[1]);
+    }
+
+    dirent = alloc_dirent(dir_cluster, image_buf, bpb);
+    if (dirent == NULL)
+    {
+	/* give the clusters back, rather than leave orphans behind */
+	free_chain(start_cluster, image_buf, bpb);
+	return complain("No room in the directory for %s", args[2]);
+    }
+    fill_dirent(dirent, name, ATTR_NORMAL, start_cluster, size);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    return 0;
+}
+
+
+/* the callback run_dir() calls for each entry of a directory */
+typedef void (*entry_func)(struct direntry *, void *arg,
+			   uint8_t *image_buf, struct bpb33* bpb);
+
+
+/* run_dir calls func on every file and subdirectory in the directory
+   starting at dir_cluster, skipping ".", "..", deleted entries, volume
+   labels and long filename pieces */
+void run_dir(uint16_t dir_cluster, entry_func func, void *arg,
+	     uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    func(dirent, arg, image_buf, bpb);
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+void print_entry(struct direntry *dirent, void *arg,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    char name[MAXFILENAME];
+
+    dirent_filename(dirent, name);
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+	printf("%s/ (directory)\n", name);
+    else
+	printf("%s (%u bytes) (starting cluster %d)\n", name,
+	       getulong(dirent->deFileSize), getushort(dirent->deStartCluster));
+}
+
+
+int do_ls(char **args, uint8_t *image_buf, struct bpb33* bpb)
+{
+    char buf[MAXPATHLEN+1];
+    int cluster;
+
+    normalize(args[1] != NULL ? args[1] : "", buf);
+    cluster = find_dir(buf, image_buf, bpb);
+    if (cluster < 0)
+	return complain("Directory %s does not exist in the disk image", buf);
+    run_dir(cluster, print_entry, NULL, image_buf, bpb);
+    return 0;
+}
+
+
+/* forget_tree collects the clusters of everything under a directory
+   that's being removed.  The entries themselves don't need marking,
+   since the directory's own clusters are about to be freed. */
+void forget_tree(struct direntry *dirent, void *arg,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t start = getushort(dirent->deStartCluster);
+
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	run_dir(start, forget_tree, NULL, image_buf, bpb);
+	forget_slot_hint(start, 0);
+    }
+    batch_chain(&batch, start, image_buf, bpb);
+}
+
+
+/* delete_dirent marks an entry deleted, along with the long filename
+   pieces just before it in the same cluster */
+void delete_dirent(struct direntry *dirent, uint16_t dir_cluster,
+		   uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint8_t *data = cluster_to_addr(CLUST_FIRST, image_buf, bpb);
+    uint8_t *first;
+    struct direntry *d;
+
+    if (dir_cluster == MSDOSFSROOT)
+	first = root_dir_addr(image_buf, bpb);
+    else
+	first = data + ((uint8_t*)dirent - data) / clust_size * clust_size;
+
+    dirent->deName[0] = SLOT_DELETED;
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    for (d = dirent - 1; (uint8_t*)d >= first; d--)
+    {
+	if ((d->deAttributes & ATTR_WIN95LFN) != ATTR_WIN95LFN
+	    || d->deName[0] == SLOT_DELETED)
+	    break;
+	d->deName[0] = SLOT_DELETED;
+	mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)d, sizeof(struct direntry));
+    }
+    forget_slot_hint(dir_cluster, 0);
+}
+
+
+int do_rm(char **args, uint8_t *image_buf, struct bpb33* bpb)
+{
+    int recursive = FALSE, force = FALSE, dir_cluster, i;
+    struct direntry *dirent;
+    uint16_t start;
+    char buf[MAXPATHLEN+1];
+
+    for (i = 1; args[i+1] != NULL; i++)
+    {
+	if (strcmp(args[i], "-r") == 0)
+	    recursive = TRUE;
+	else if (strcmp(args[i], "-f") == 0)
+	    force = TRUE;
+	else
+	    return complain("Unknown option %s to rm", args[i]);
+    }
+
+    normalize(args[i], buf);
+    if (buf[0] == '\0')
+	return complain("Can't remove the root directory");
+    dirent = find_entry(args[i], &dir_cluster, image_buf, bpb);
+    if (dirent == NULL)
+    {
+	if (force)
+	    return 0;
+	return complain("No file called %s exists in the disk image", args[i]);
+    }
+
+    start = getushort(dirent->deStartCluster);
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	if (!recursive)
+	    return complain("%s is a directory (use -r to remove it)", args[i]);
+	run_dir(start, forget_tree, NULL, image_buf, bpb);
+	forget_slot_hint(start, 0);
+	/* cheaper than working out which cached paths were under it */
+	dircache_used = dircache_next = 0;
+    }
+    batch_chain(&batch, start, image_buf, bpb);
+    delete_dirent(dirent, dir_cluster, image_buf, bpb);
+    apply_free_batch(&batch, image_buf, bpb);
+    return 0;
+}
+
+
+/* do_mkdir creates a directory, and with -p any missing parents,
+   looking each prefix up through the directory cache */
+int do_mkdir(char **args, uint8_t *image_buf, struct bpb33* bpb)
+{
+    char buf[MAXPATHLEN+1], prefix[MAXPATHLEN+1];
+    struct direntry *dirent;
+    int parents = FALSE, parent = MSDOSFSROOT, cluster, last, len;
+    char *path = args[1], *component, *next, *name;
+
+    if (strcmp(path, "-p") == 0)
+    {
+	parents = TRUE;
+	path = args[2];
+    }
+    if (path == NULL || (args[2] != NULL && !parents))
+	return complain("usage: mkdir [-p] <dir>");
+
+    normalize(path, buf);
+    if (buf[0] == '\0' && !parents)
+	return complain("Directory %s already exists", path);
+
+    for (component = buf; *component != '\0'; component = next)
+    {
+	next = component + strcspn(component, "/");
+	last = (*next == '\0');
+	len = next - buf;
+	memcpy(prefix, buf, len);
+	prefix[len] = '\0';
+	if (!last)
+	    next++;
+
+	cluster = find_dir(prefix, image_buf, bpb);
+	if (cluster >= 0)
+	{
+	    if (last && !parents)
+		return complain("Directory %s already exists", path);
+	    parent = cluster;
+	    continue;
+	}
+
+	/* the end of prefix is this component on its own */
+	name = prefix + (component - buf);
+	if (lookup_dirent(parent, name, image_buf, bpb) != NULL)
+	    return complain("%s is not a directory", prefix);
+	if (!last && !parents)
+	    return complain("Directory %s does not exist in the disk image",
+			    prefix);
+	dirent = make_dir(parent, name, image_buf, bpb);
+	if (dirent == NULL)
+	    return complain("No more space in filesystem for %s", prefix);
+	parent = getushort(dirent->deStartCluster);
+    }
+    return 0;
+}
+
+
+struct command {
+    char *name;
+    int min_args, max_args;
+    int (*func)(char **, uint8_t *, struct bpb33*);
+};
+
+struct command commands[] = {
+    { "cp-in", 2, 2, do_cp_in },
+    { "cp-out", 2, 2, do_cp_out },
+    { "cat", 1, 1, do_cat },
+    { "ls", 0, 1, do_ls },
+    { "rm", 1, 3, do_rm },
+    { "mkdir", 1, 2, do_mkdir },
+    { NULL, 0, 0, NULL }
+};
+
+
+/* run_line splits one line of the script into words and runs it */
+int run_line(char *line, uint8_t *image_buf, struct bpb33* bpb)
+{
+    char *args[MAXARGS+2];
+    struct command *c;
+    int nargs = 0;
+    char *word;
+
+    for (word = strtok(line, " \t\r\n"); word != NULL;
+	 word = strtok(NULL, " \t\r\n"))
+    {
+	if (nargs == MAXARGS + 1)
+	    return complain("Too many arguments to %s", args[0]);
+	args[nargs++] = word;
+    }
+    if (nargs == 0 || args[0][0] == '#')
+	return 0;
+    args[nargs] = NULL;
+
+    for (c = commands; c->name != NULL; c++)
+    {
+	if (strcmp(c->name, args[0]) != 0)
+	    continue;
+	if (nargs - 1 < c->min_args || nargs - 1 > c->max_args)
+	    return complain("Wrong number of arguments to %s", args[0]);
+	return c->func(args, image_buf, bpb);
+    }
+    return complain("Unknown command %s", args[0]);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    struct bpb33* bpb;
+    int keep_going = FALSE, failed = FALSE, sync_policy = SYNC_NONE;
+    char *args[2];
+    char line[MAXLINE];
+    FILE *script = stdin;
+    int nargs = 0, i, len;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0 || ioq_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-k") == 0)
+	    keep_going = TRUE;
+	else if (strncmp(argv[i], "--sync=", 7) == 0)
+	{
+	    sync_policy = parse_sync_policy(argv[i] + 7);
+	    if (sync_policy < 0)
+		usage(argv[0]);
+	}
+	else if ((argv[i][0] == '-' && argv[i][1] != '\0') || nargs == 2)
+	    usage(argv[0]);
+	else
+	    args[nargs++] = argv[i];
+    }
+    if (nargs < 1)
+    {
+	usage(argv[0]);
+    }
+
+    script_name = "stdin";
+    if (nargs == 2 && strcmp(args[1], "-") != 0)
+    {
+	script_name = args[1];
+	script = fopen(script_name, "r");
+	if (script == NULL)
+	{
+	    fprintf(stderr, "Can't open script %s: %s\n", script_name,
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+
+    image_buf = mmap_file(args[0], &image_fd);
+    bpb = check_bootsector(image_buf);
+    if (ioq_depth > 0 && ioq_open(&queue, ioq_depth, ioq_engine) < 0)
+    {
+	fprintf(stderr, "Can't set up the I/O queue: %s\n", strerror(errno));
+	exit(1);
+    }
+    stats_phase(PHASE_DATA);
+
+    while (fgets(line, sizeof(line), script) != NULL)
+    {
+	line_no++;
+	len = strlen(line);
+	if (len == sizeof(line) - 1 && line[len-1] != '\n')
+	{
+	    complain("Line too long");
+	    failed = TRUE;
+	    break;
+	}
+	if (run_line(line, image_buf, bpb) < 0)
+	{
+	    failed = TRUE;
+	    if (!keep_going)
+		break;
+	}
+    }
+    fflush(stdout);
+    if (ioq_depth > 0)
+	ioq_close(&queue);
+
+    /* whatever happened, the image is brought up to date once */
+    sync_fat_copies(image_buf, bpb);
+    if (flush_dirty(image_buf, sync_policy) < 0)
+    {
+	fprintf(stderr, "Failed to flush changes to the disk image\n");
+	exit(1);
+    }
+    unmmap_file(image_buf, &image_fd);
+    free(bpb);
+    free(batch.clusters);
+    if (script != stdin)
+	fclose(script);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_bench times the core operations on a disk image and prints one
+   line per benchmark:
+
+	<name> ops=<n> secs=<t> ops/s=<rate> bytes/s=<rate>
+
+   The in-process benchmarks (FAT access, traversal, lookup) repeat
+   until they've run for at least the minimum time.  Copy-in, copy-out
+   and scandisk run the real programs a fixed number of times.
+   Everything works on a scratch copy of the image, which is removed
+   afterwards. */
+
+char **paths = NULL;
+int npaths = 0, maxpaths = 0;
+uint32_t nfiles = 0, ndirs = 0;
+uint64_t dir_bytes = 0;
+
+double min_time = 0.5;
+char *bindir = ".";
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-t mintime] [-r runs] [-b bindir] <imagename>\n", progname);
+    fprintf(stderr, "\ttimes FAT access, traversal, lookup, copy-in, copy-out and scandisk\n");
+    fprintf(stderr, "\t-t: seconds to repeat each in-process benchmark for (default 0.5)\n");
+    fprintf(stderr, "\t-r: times to run each program (default 5)\n");
+    fprintf(stderr, "\t-b: where to find dos_cp, dos_rm and scandisk (default .)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void report(char *name, uint64_t ops, uint64_t bytes, double secs)
+{
+    printf("%-10s ops=%llu secs=%.3f ops/s=%.0f bytes/s=%.0f\n", name,
+	   (unsigned long long)ops, secs, ops / secs, bytes / secs);
+    fflush(stdout);
+}
+
+
+/* copy_file makes the scratch copy of the image */
+void copy_file(char *from, char *to)
+{
+    char buf[65536];
+    ssize_t bytes;
+    int in, out;
+
+    in = open(from, O_RDONLY);
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0)
+    {
+	fprintf(stderr, "Cannot copy %s to %s: %s\n", from, to, strerror(errno));
+	exit(1);
+    }
+    while ((bytes = read(in, buf, sizeof(buf))) > 0)
+    {
+	if (write(out, buf, bytes) != bytes)
+	{
+	    fprintf(stderr, "Cannot copy %s to %s: %s\n", from, to,
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+    close(in);
+    close(out);
+}
+
+
+/* walk visits every entry under a directory, and counts them.  With
+   record set, it also remembers every path for the lookup benchmark. */
+uint64_t walk(uint16_t dir_cluster, char *prefix, int record,
+	      uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    char name[MAXFILENAME], path[MAXPATHLEN+1];
+    uint64_t visited = 0;
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	if (record)
+	    dir_bytes += n * sizeof(struct direntry);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return visited;
+	    visited++;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    dirent_filename(dirent, name);
+	    snprintf(path, sizeof(path), "%s/%s", prefix, name);
+	    if (record)
+	    {
+		if (npaths == maxpaths)
+		{
+		    maxpaths = maxpaths ? maxpaths * 2 : 256;
+		    paths = realloc(paths, maxpaths * sizeof(char *));
+		}
+		paths[npaths++] = strdup(path);
+	    }
+	    if (dirent->deAttributes & ATTR_DIRECTORY)
+	    {
+		if (record)
+		    ndirs++;
+		visited += walk(getushort(dirent->deStartCluster), path,
+				record, image_buf, bpb);
+	    }
+	    else if (record)
+		nfiles++;
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return visited;
+}
+
+
+void bench_fat_get(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb), c;
+    uint64_t ops = 0, sum = 0;
+    double start = now(), secs;
+
+    do
+    {
+	for (c = CLUST_FIRST; c < total; c++)
+	    sum += get_fat_entry(c, image_buf, bpb);
+	ops += total - CLUST_FIRST;
+    } while ((secs = now() - start) < min_time);
+
+    /* keep the compiler from throwing the loop away */
+    if (sum == 1)
+	fprintf(stderr, "\n");
+    report("fat_get", ops, ops * 3 / 2, secs);
+}
+
+
+void bench_fat_set(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb), c;
+    uint64_t ops = 0;
+    double start = now(), secs;
+
+    /* writing back each entry's own value keeps the image unchanged */
+    do
+    {
+	for (c = CLUST_FIRST; c < total; c++)
+	    set_fat_entry(c, get_fat_entry(c, image_buf, bpb), image_buf, bpb);
+	ops += total - CLUST_FIRST;
+    } while ((secs = now() - start) < min_time);
+
+    report("fat_set", ops, ops * 3 / 2, secs);
+}
+
+
+void bench_traverse(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint64_t ops = 0, bytes = 0;
+    double start = now(), secs;
+
+    do
+    {
+	ops += walk(MSDOSFSROOT, "", FALSE, image_buf, bpb);
+	bytes += dir_bytes;
+    } while ((secs = now() - start) < min_time);
+
+    report("traverse", ops, bytes, secs);
+}
+
+
+void bench_lookup(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint64_t ops = 0;
+    double start = now(), secs;
+    int i;
+
+    if (npaths == 0)
+	return;
+    do
+    {
+	for (i = 0; i < npaths; i++)
+	{
+	    if (lookup_path(paths[i], NULL, image_buf, bpb) == NULL)
+	    {
+		fprintf(stderr, "Lookup of %s failed\n", paths[i]);
+		exit(1);
+	    }
+	}
+	ops += npaths;
+    } while ((secs = now() - start) < min_time);
+
+    report("lookup", ops, 0, secs);
+}
+
+
+/* run_program runs one of the tools with its output thrown away, and
+   returns how long it took */
+double run_program(char *program, char *arg1, char *arg2, char *arg3)
+{
+    char path[MAXPATHLEN+1];
+    double start = now();
+    int status;
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "%s/%s", bindir, program);
+    pid = fork();
+    if (pid < 0)
+    {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0)
+    {
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 1);
+	dup2(devnull, 2);
+	execl(path, program, arg1, arg2, arg3, (char *)NULL);
+	_exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+	|| WEXITSTATUS(status) != 0)
+    {
+	fprintf(stderr, "%s %s %s %s failed\n", path, arg1,
+		arg2 ? arg2 : "", arg3 ? arg3 : "");
+	exit(1);
+    }
+    return now() - start;
+}
+
+
+/* make_host_file writes a file of pseudo-random bytes to copy in */
+void make_host_file(char *name, uint32_t size)
+{
+    uint8_t buf[4096];
+    uint32_t done, i;
+    FILE *f = fopen(name, "w");
+
+    if (f == NULL)
+    {
+	fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+	exit(1);
+    }
+    srandom(1);
+    for (done = 0; done < size; done += sizeof(buf))
+    {
+	for (i = 0; i < sizeof(buf); i++)
+	    buf[i] = random();
+	fwrite(buf, 1, (size - done < sizeof(buf)) ? size - done : sizeof(buf), f);
+    }
+    fclose(f);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    char *image = NULL;
+    char scratch[MAXPATHLEN+1], hostfile[MAXPATHLEN+1];
+    uint32_t free_clusters = 0, clust_size, copy_size, image_size;
+    uint16_t c;
+    double in_secs = 0, out_secs = 0, scan_secs = 0;
+    int runs = 5, i;
+
+    stats_option(&argc, argv);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+	    min_time = atof(argv[++i]);
+	else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+	    runs = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+	    bindir = argv[++i];
+	else if (argv[i][0] == '-' || image != NULL)
+	    usage(argv[0]);
+	else
+	    image = argv[i];
+    }
+    if (image == NULL || runs <= 0 || min_time <= 0)
+    {
+	usage(argv[0]);
+    }
+
+    snprintf(scratch, sizeof(scratch), "%s.scratch", image);
+    snprintf(hostfile, sizeof(hostfile), "%s.hostfile", image);
+    copy_file(image, scratch);
+
+    image_buf = mmap_file(scratch, &fd);
+    bpb = check_bootsector(image_buf);
+    clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    image_size = bpb->bpbSectors * bpb->bpbBytesPerSec;
+
+    stats_phase(PHASE_TRAVERSE);
+    walk(MSDOSFSROOT, "", TRUE, image_buf, bpb);
+    for (c = CLUST_FIRST; c < num_clusters(bpb); c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    free_clusters++;
+    }
+    printf("# image=%s bytes=%u clusters=%u cluster_size=%u files=%u dirs=%u\n",
+	   image, image_size, num_clusters(bpb) - CLUST_FIRST, clust_size,
+	   nfiles, ndirs);
+
+    bench_fat_get(image_buf, bpb);
+    bench_fat_set(image_buf, bpb);
+    bench_traverse(image_buf, bpb);
+    bench_lookup(image_buf, bpb);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    /* copy in a file using at most half the free space (and at most
+       1M), copy it back out, then remove it again */
+    stats_phase(PHASE_DATA);
+    copy_size = free_clusters / 2 * clust_size;
+    if (copy_size > 1024 * 1024)
+	copy_size = 1024 * 1024;
+    if (copy_size > 0)
+    {
+	make_host_file(hostfile, copy_size);
+	for (i = 0; i < runs; i++)
+	{
+	    in_secs += run_program("dos_cp", scratch, hostfile, "a:/BENCHIN.DAT");
+	    out_secs += run_program("dos_cp", scratch, "a:/BENCHIN.DAT", "/dev/null");
+	    run_program("dos_rm", scratch, "a:/BENCHIN.DAT", NULL);
+	}
+	report("copy_in", runs, (uint64_t)runs * copy_size, in_secs);
+	report("copy_out", runs, (uint64_t)runs * copy_size, out_secs);
+	unlink(hostfile);
+    }
+
+    for (i = 0; i < runs; i++)
+	scan_secs += run_program("scandisk", scratch, NULL, NULL);
+    report("scandisk", runs, (uint64_t)runs * image_size, scan_secs);
+
+    unlink(scratch);
+    for (i = 0; i < npaths; i++)
+	free(paths[i]);
+    free(paths);
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -56,7 +57,7 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
     }
 
     /* remove the spaces from extensions */
-    for (i = 3; i > 0; i--) 
+    for (i = 3; i >= 0; i--) 
     {
 	if (extension[i] == ' ') 
 	    extension[i] = '\0';
@@ -99,157 +100,348 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 }
 
 
-struct direntry *follow_dir(char *searchpath, uint16_t cluster, 
-		            uint8_t *image_buf, struct bpb33* bpb)
+/* lookup_entry hunts one directory for an entry called name.  cluster
+   0 is the root directory, which is a fixed-size area rather than a
+   cluster chain. */
+struct direntry *lookup_entry(char *name, uint16_t cluster,
+			      uint8_t *image_buf, struct bpb33* bpb)
 {
-    char *next_path_component = index(searchpath, '/');
-    int entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
+    int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+    uint32_t steps = 0;
+    char buffer[MAXFILENAME];
 
-    struct direntry *rv = NULL;
+    if (cluster == MSDOSFSROOT)
+        numDirEntries = bpb->bpbRootDirEnts;
 
-    while (is_valid_cluster(cluster, bpb))
+    while (cluster == MSDOSFSROOT || is_valid_cluster(cluster, bpb))
     {
         struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
         int i = 0;
-	for ( ; i < numDirEntries; i++)
+	for ( ; i < numDirEntries; i++, dirent++)
 	{
-            char buffer[MAXFILENAME]; 
-            uint16_t followclust = get_dirent(dirent, buffer);
-
-            if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-            {
-                if (next_path_component)
-                {
-                    if (followclust)
-                        rv = follow_dir(buffer, followclust, image_buf, bpb);
-                }
-                else
-                {
-                    rv = dirent; 
-                }
-            }
-
-            if (rv)
-                break;
-
-            dirent++;
+            dos_stats.dirents_scanned++;
+            get_dirent(dirent, buffer);
+            if (buffer[0] != '\0' && strcasecmp(name, buffer) == 0)
+                return dirent;
 	}
 
+        if (cluster == MSDOSFSROOT || ++steps >= num_clusters(bpb))
+            break;
 	cluster = get_fat_entry(cluster, image_buf, bpb);
     }
 
-    return rv;
+    return NULL;
 }
 
 
-struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb33* bpb)
-{
-    uint16_t cluster = 0;
-    struct direntry *rv = NULL;
+/* directories we've already resolved, keyed by their upper-cased path
+   from the root.  When we cat many files that share directories, each
+   directory prefix is only looked up once. */
+#define DIRCACHE_SIZE 1024
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+struct dircache_entry {
+    char *path;
+    uint16_t cluster;
+};
 
-    char *next_path_component = index(searchpath, '/');
-    int root_entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        root_entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
+struct dircache_entry dircache[DIRCACHE_SIZE];
+int dircache_used = 0;
 
-    char buffer[MAXFILENAME];
 
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
-    {
-        uint16_t followclust = get_dirent(dirent, buffer);
+uint32_t hash_path(char *path)
+{
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
 
-        if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-        {
-            if (!next_path_component)
-                rv = dirent;
-            else if (is_valid_cluster(followclust, bpb))
-                rv = follow_dir(next_path_component, followclust, image_buf, bpb);
-        }
 
-        if (rv)
-            break;
+int dircache_lookup(char *path, uint16_t *cluster)
+{
+    uint32_t h = hash_path(path) % DIRCACHE_SIZE;
 
-        dirent++;
+    while (dircache[h].path != NULL)
+    {
+        if (strcmp(dircache[h].path, path) == 0)
+        {
+            *cluster = dircache[h].cluster;
+            return TRUE;
+        }
+        h = (h + 1) % DIRCACHE_SIZE;
     }
+    return FALSE;
+}
+
 
-    return rv;
+void dircache_insert(char *path, uint16_t cluster)
+{
+    uint32_t h = hash_path(path) % DIRCACHE_SIZE;
+
+    /* keep the table at most half full so probes stay short; past
+       that we just stop caching */
+    if (dircache_used >= DIRCACHE_SIZE / 2)
+        return;
+    while (dircache[h].path != NULL)
+        h = (h + 1) % DIRCACHE_SIZE;
+    dircache[h].path = strdup(path);
+    dircache[h].cluster = cluster;
+    dircache_used++;
 }
 
 
+/* find_file resolves searchpath one component at a time.  Every
+   directory prefix we resolve goes in the cache, so only the final
+   component has to be searched for when the directory has been seen
+   before. */
 struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
 {
+    char path[MAXPATHLEN+1];
+    char *component, *slash, *p;
+    uint16_t cluster = MSDOSFSROOT;
+    struct direntry *dirent;
+
     /* strip any leading '/' from search path */
     while (*searchpath == '/' && *searchpath != '\0') searchpath++;
-    return traverse_root(searchpath, image_buf, bpb);
+
+    strncpy(path, searchpath, MAXPATHLEN);
+    path[MAXPATHLEN] = '\0';
+    for (p = path; *p; p++)
+        *p = toupper(*p);
+
+    component = path;
+    while ((slash = index(component, '/')) != NULL)
+    {
+        *slash = '\0';
+        if (!dircache_lookup(path, &cluster))
+        {
+            dirent = lookup_entry(component, cluster, image_buf, bpb);
+            if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+                return NULL;
+            cluster = getushort(dirent->deStartCluster);
+            if (!is_valid_cluster(cluster, bpb))
+                return NULL;
+            dircache_insert(path, cluster);
+        }
+        *slash = '/';
+        component = slash + 1;
+    }
+
+    return lookup_entry(component, cluster, image_buf, bpb);
 }
 
 
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+/* do_cat copies up to length bytes of the file, starting at offset,
+   to stdout.  The extent map comes from a walk over the FAT alone, so
+   finding the starting cluster never touches the data clusters before
+   offset, and each run of consecutive clusters goes out in a single
+   fwrite. */
+void do_cat(struct direntry *dirent, uint32_t offset, uint32_t length,
+	    uint8_t *image_buf, struct bpb33 *bpb)
 {
     uint16_t cluster = getushort(dirent->deStartCluster);
-    uint32_t bytes_remaining = getulong(dirent->deFileSize);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t skip, bytes_remaining;
+    struct extent *extents;
+    int nextents, i;
 
     char buffer[MAXFILENAME];
     get_dirent(dirent, buffer);
 
-    fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
+    if (offset >= size)
+        return;
+    bytes_remaining = size - offset;
+    if (length < bytes_remaining)
+        bytes_remaining = length;
+
+    fprintf(stderr, "doing cat for %s, size %d, offset %u, length %u\n",
+            buffer, size, offset, bytes_remaining);
 
-    while (is_valid_cluster(cluster, bpb))
+    stats_phase(PHASE_DATA);
+    nextents = get_extents(cluster, &extents, image_buf, bpb);
+
+    /* skip whole extents that end before offset */
+    skip = offset;
+    for (i = 0; i < nextents && bytes_remaining > 0; i++)
     {
-        /* map the cluster number to the data location */
-        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+        uint32_t run = extents[i].count * cluster_size;
+        uint32_t nbytes;
+        uint8_t *p;
 
-        uint32_t nbytes = bytes_remaining > cluster_size ? cluster_size : bytes_remaining;
+        if (skip >= run)
+        {
+            skip -= run;
+            continue;
+        }
 
-        fwrite(p, 1, nbytes, stdout);
+        /* map the cluster number to the data location */
+        p = cluster_to_addr(extents[i].start, image_buf, bpb) + skip;
+        dos_stats.clusters_touched += extents[i].count - 1;
+        nbytes = run - skip;
+        if (nbytes > bytes_remaining)
+            nbytes = bytes_remaining;
+
+        fwrite_image(p, nbytes, stdout);
+        dos_stats.bytes_out += nbytes;
         bytes_remaining -= nbytes;
-    
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+        skip = 0;
     }
+
+    if (bytes_remaining > 0)
+        fprintf(stderr, "cluster chain ends %u bytes short of the file size\n",
+                bytes_remaining);
+
+    free(extents);
+    stats_phase(PHASE_TRAVERSE);
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> <filename>\n", progname);
+    fprintf(stderr, "usage: %s [--offset N] [--length N | --tail N] <imagename> <filename>...\n", progname);
+    fprintf(stderr, "       %s [options] --null <imagename> < NUL-separated-filenames\n", progname);
+    fprintf(stderr, "\tconcatenates the files to standard output\n");
+    fprintf(stderr, "\t--offset N: start N bytes into each file\n");
+    fprintf(stderr, "\t--length N: copy at most N bytes of each file\n");
+    fprintf(stderr, "\t--tail N: copy the last N bytes of each file, like tail -c\n");
+    fprintf(stderr, "\t--null: read the list of filenames from stdin, separated by NULs\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
     exit(1);
 }
 
 
+/* parse a numeric option argument, or bail out with the usage message */
+uint32_t parse_count(char *arg, char *progname)
+{
+    char *end;
+    unsigned long v;
+
+    if (arg == NULL)
+        usage(progname);
+    v = strtoul(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0' || v > UINT32_MAX)
+        usage(progname);
+    return v;
+}
+
+
+/* size of the stdio buffer all the output goes through */
+#define OUTBUF_SIZE (1024 * 1024)
+
+/* options that apply to every file we cat */
+uint32_t offset = 0, length = UINT32_MAX, tail = 0;
+int use_tail = FALSE;
+
+
+/* cat_one looks up and copies a single file, returning FALSE if it
+   isn't there */
+int cat_one(char *filename, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t start = offset;
+    struct direntry *dirent = find_file(filename, image_buf, bpb);
+
+    if (dirent == NULL)
+    {
+        fprintf(stderr, "No file called %s exists in the disk image\n", filename);
+        return FALSE;
+    }
+    if (use_tail)
+    {
+        uint32_t size = getulong(dirent->deFileSize);
+        start = tail < size ? size - tail : 0;
+    }
+    do_cat(dirent, start, length, image_buf, bpb);
+    return TRUE;
+}
+
+
+/* read NUL-separated filenames from stdin and cat each of them */
+int cat_from_stdin(uint8_t *image_buf, struct bpb33 *bpb)
+{
+    char name[MAXPATHLEN+1];
+    int len = 0, c, ok = TRUE;
+
+    while ((c = getchar()) != EOF)
+    {
+        if (c != '\0')
+        {
+            if (len < MAXPATHLEN)
+                name[len++] = c;
+            continue;
+        }
+        name[len] = '\0';
+        if (len > 0 && !cat_one(name, image_buf, bpb))
+            ok = FALSE;
+        len = 0;
+    }
+    name[len] = '\0';
+    if (len > 0 && !cat_one(name, image_buf, bpb))
+        ok = FALSE;
+    return ok;
+}
+
+
 int main(int argc, char** argv)
 {
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc != 3)
+    int use_length = FALSE, from_stdin = FALSE, ok = TRUE;
+    char *imagename = NULL;
+    char **files = malloc(argc * sizeof(char *));
+    int nfiles = 0, i;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--offset") == 0)
+            offset = parse_count(argv[++i], argv[0]);
+        else if (strcmp(argv[i], "--length") == 0)
+        {
+            length = parse_count(argv[++i], argv[0]);
+            use_length = TRUE;
+        }
+        else if (strcmp(argv[i], "--tail") == 0)
+        {
+            tail = parse_count(argv[++i], argv[0]);
+            use_tail = TRUE;
+        }
+        else if (strcmp(argv[i], "--null") == 0)
+            from_stdin = TRUE;
+        else if (argv[i][0] == '-')
+            usage(argv[0]);
+        else if (imagename == NULL)
+            imagename = argv[i];
+        else
+            files[nfiles++] = argv[i];
+    }
+    if (imagename == NULL || (nfiles == 0) != from_stdin
+        || (use_tail && (use_length || offset != 0)))
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    /* one big buffer for everything, instead of a write per cluster */
+    setvbuf(stdout, malloc(OUTBUF_SIZE), _IOFBF, OUTBUF_SIZE);
+
+    image_buf = mmap_file(imagename, &fd);
     bpb = check_bootsector(image_buf);
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
-    if (dirent)
-        do_cat(dirent, image_buf, bpb);
+    if (from_stdin)
+        ok = cat_from_stdin(image_buf, bpb);
+    for (i = 0; i < nfiles; i++)
+    {
+        if (!cat_one(files[i], image_buf, bpb))
+            ok = FALSE;
+    }
+    fflush(stdout);
 
     unmmap_file(image_buf, &fd);
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "fatimg.h"
+#include "dos_server.h"
+
+
+/* dos_client asks a running dos_server to do one thing to an image */
+
+#define CHUNK (1024 * 1024)
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-s socket] <command> <imagename> [args]\n", progname);
+    fprintf(stderr, "\tcommands:\n");
+    fprintf(stderr, "\t  ls <imagename> [dir]: list a directory\n");
+    fprintf(stderr, "\t  stat <imagename> <path>: describe one file\n");
+    fprintf(stderr, "\t  cat <imagename> <path> [offset [length]]: copy a file to standard output\n");
+    fprintf(stderr, "\t  put <imagename> <path>: replace a file with standard input\n");
+    fprintf(stderr, "\t  check <imagename>: count the image's problems\n");
+    fprintf(stderr, "\t  sync <imagename>: wait until the image's changes are on disk\n");
+    fprintf(stderr, "\t-s: the server's socket (default %s)\n", SERVER_SOCKET);
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+int read_all(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = read(fd, (uint8_t*)buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    return -1;
+	total += bytes;
+    }
+    return 0;
+}
+
+
+int write_all(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = write(fd, (uint8_t*)buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    return -1;
+	total += bytes;
+    }
+    return 0;
+}
+
+
+/* call sends one request and waits for the answer.  *data is set to a
+   malloc'd copy of whatever came back. */
+int call(int fd, int op, char *image, char *path, uint32_t offset,
+	 void *send, uint32_t len, uint8_t **data, uint32_t *got)
+{
+    struct request req;
+    struct reply reply;
+
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.imagelen = strlen(image);
+    req.pathlen = strlen(path);
+    req.offset = offset;
+    req.len = len;
+    if (write_all(fd, &req, sizeof(req)) < 0
+	|| write_all(fd, image, req.imagelen) < 0
+	|| write_all(fd, path, req.pathlen) < 0
+	|| (op == OP_WRITE && write_all(fd, send, len) < 0)
+	|| read_all(fd, &reply, sizeof(reply)) < 0)
+    {
+	fprintf(stderr, "Lost the connection to the server\n");
+	exit(1);
+    }
+
+    *data = malloc(reply.len + 1);
+    if (read_all(fd, *data, reply.len) < 0)
+    {
+	fprintf(stderr, "Lost the connection to the server\n");
+	exit(1);
+    }
+    if (got != NULL)
+	*got = reply.len;
+    return reply.status;
+}
+
+
+void check_status(int status, char *what)
+{
+    if (status != FATIMG_OK)
+    {
+	fprintf(stderr, "%s: %s\n", what, fatimg_strerror(status));
+	exit(1);
+    }
+}
+
+
+void print_entry(struct wire_entry *e)
+{
+    if (e->attributes & ATTR_DIRECTORY)
+	printf("%s/ (directory)\n", e->name);
+    else
+	printf("%s (%u bytes) (starting cluster %d)\n", e->name, e->size,
+	       e->start_cluster);
+}
+
+
+/* read_stdin slurps standard input, up to what the server accepts */
+uint8_t *read_stdin(uint32_t *len)
+{
+    uint8_t *buf = malloc(CHUNK);
+    uint32_t max = CHUNK;
+    ssize_t bytes;
+
+    *len = 0;
+    while (TRUE)
+    {
+	if (*len == max)
+	{
+	    max *= 2;
+	    if (max > SERVER_MAXDATA)
+	    {
+		fprintf(stderr, "Standard input is too big for a FAT-12 image\n");
+		exit(1);
+	    }
+	    buf = realloc(buf, max);
+	}
+	bytes = read(0, buf + *len, max - *len);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes < 0)
+	{
+	    fprintf(stderr, "Error reading standard input: %s\n", strerror(errno));
+	    exit(1);
+	}
+	if (bytes == 0)
+	    return buf;
+	*len += bytes;
+	dos_stats.bytes_in += bytes;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    char *socket_path = SERVER_SOCKET, *command, *path;
+    char image[PATH_MAX];
+    uint8_t *data, *input;
+    uint32_t got, n, offset = 0, length = UINT32_MAX, len;
+    int fd, status, i = 1;
+
+    stats_option(&argc, argv);
+    if (argc > 2 && strcmp(argv[1], "-s") == 0)
+    {
+	socket_path = argv[2];
+	i = 3;
+    }
+    if (argc - i < 2)
+	usage(argv[0]);
+    command = argv[i];
+    if (realpath(argv[i+1], image) == NULL)
+    {
+	fprintf(stderr, "Cannot find disk image file %s: %s\n", argv[i+1],
+		strerror(errno));
+	exit(1);
+    }
+    path = (argc - i > 2) ? argv[i+2] : "";
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+	fprintf(stderr, "Cannot connect to %s: %s\n", socket_path,
+		strerror(errno));
+	exit(1);
+    }
+    stats_phase(PHASE_DATA);
+
+    if (strcmp(command, "ls") == 0 && argc - i <= 3)
+    {
+	status = call(fd, OP_LIST, image, path, 0, NULL, 0, &data, &got);
+	check_status(status, path);
+	for (n = 0; n < got / sizeof(struct wire_entry); n++)
+	    print_entry((struct wire_entry*)data + n);
+    }
+    else if (strcmp(command, "stat") == 0 && argc - i == 3)
+    {
+	status = call(fd, OP_STAT, image, path, 0, NULL, 0, &data, &got);
+	check_status(status, path);
+	print_entry((struct wire_entry*)data);
+    }
+    else if (strcmp(command, "cat") == 0 && argc - i >= 3 && argc - i <= 5)
+    {
+	if (argc - i > 3)
+	    offset = strtoul(argv[i+3], NULL, 0);
+	if (argc - i > 4)
+	    length = strtoul(argv[i+4], NULL, 0);
+	/* a chunk at a time, so the server never holds much of it */
+	while (length > 0)
+	{
+	    status = call(fd, OP_READ, image, path, offset, NULL,
+			  length < CHUNK ? length : CHUNK, &data, &got);
+	    fwrite(data, 1, got, stdout);
+	    dos_stats.bytes_out += got;
+	    free(data);
+	    check_status(status, path);
+	    if (got == 0)
+		break;
+	    offset += got;
+	    length -= got;
+	}
+	data = NULL;
+    }
+    else if (strcmp(command, "put") == 0 && argc - i == 3)
+    {
+	input = read_stdin(&len);
+	status = call(fd, OP_WRITE, image, path, 0, input, len, &data, NULL);
+	check_status(status, path);
+	free(input);
+    }
+    else if (strcmp(command, "check") == 0 && argc - i == 2)
+    {
+	struct fatimg_report *r;
+
+	status = call(fd, OP_CHECK, image, "", 0, NULL, 0, &data, NULL);
+	check_status(status, image);
+	r = (struct fatimg_report*)data;
+	printf("%u files, %u directories\n", r->files, r->dirs);
+	printf("%u clusters used, %u free\n", r->used_clusters, r->free_clusters);
+	printf("%u orphan clusters, %u cross-links, %u broken chains, %u size mismatches\n",
+	       r->orphans, r->crosslinks, r->broken_chains, r->size_mismatches);
+	if (r->orphans || r->crosslinks || r->broken_chains || r->size_mismatches)
+	    exit(2);
+    }
+    else if (strcmp(command, "sync") == 0 && argc - i == 2)
+    {
+	status = call(fd, OP_SYNC, image, "", 0, NULL, 0, &data, NULL);
+	check_status(status, image);
+    }
+    else
+    {
+	usage(argv[0]);
+    }
+
+    free(data);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_corrupt damages a disk image on purpose, to give scandisk big
+   and nasty inputs: FAT cycles, self-loops, bad clusters, cross-links,
+   chains that run into a free cluster, orphans and directory entries
+   whose size disagrees with the FAT.
+   Everything comes from one seed, so the same options on the same
+   image always do the same damage.
+
+   Each defect goes on a file that hasn't been damaged yet, so the
+   counts asked for are the counts scandisk should find.  Directories
+   are left alone. */
+
+struct victim {
+    struct direntry *dirent;
+    uint16_t start;
+    uint32_t nclusters;
+    int used;
+};
+
+struct victim *victims = NULL;
+int nvictims = 0, maxvictims = 0;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-S seed] [-c cycles] [-l selfloops] [-x crosslinks] [-b bad] [-f freed] [-s sizes] [-o orphans] [-L orphanlength] <imagename>\n", progname);
+    fprintf(stderr, "\tinjects FAT and directory entry defects into the disk image\n");
+    fprintf(stderr, "\t-c: point the last cluster of a file back at its first\n");
+    fprintf(stderr, "\t-l: point a cluster of a file at itself\n");
+    fprintf(stderr, "\t-x: join the end of one file onto the middle of another\n");
+    fprintf(stderr, "\t-b: mark a cluster in the middle of a file bad\n");
+    fprintf(stderr, "\t-f: mark the last cluster of a file free instead of EOF\n");
+    fprintf(stderr, "\t-s: make a file's size too big or too small for its chain\n");
+    fprintf(stderr, "\t-o: allocate chains of free clusters that nothing refers to\n");
+    fprintf(stderr, "\t-L: clusters in each orphan chain (default 1)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* collect_victims walks a directory tree, listing every regular file
+   with the length of its cluster chain */
+void collect_victims(uint16_t dir_cluster, uint8_t *image_buf,
+		     struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster, c;
+    struct direntry *dirent;
+    struct victim *v;
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    if (dirent->deAttributes & ATTR_DIRECTORY)
+	    {
+		collect_victims(getushort(dirent->deStartCluster),
+				image_buf, bpb);
+		continue;
+	    }
+
+	    if (nvictims == maxvictims)
+	    {
+		maxvictims = maxvictims ? maxvictims * 2 : 64;
+		victims = realloc(victims, maxvictims * sizeof(struct victim));
+	    }
+	    v = &victims[nvictims++];
+	    v->dirent = dirent;
+	    v->start = getushort(dirent->deStartCluster);
+	    v->nclusters = 0;
+	    v->used = FALSE;
+	    for (c = v->start;
+		 is_valid_cluster(c, bpb) && c < limit && v->nclusters < limit;
+		 c = get_fat_entry(c, image_buf, bpb))
+	    {
+		v->nclusters++;
+	    }
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+/* pick_victim returns an undamaged file with at least min_clusters
+   clusters, or NULL if there isn't one left */
+struct victim *pick_victim(uint32_t min_clusters)
+{
+    int tries, i, j;
+
+    if (nvictims == 0)
+	return NULL;
+    for (tries = 0; tries < 64; tries++)
+    {
+	i = random() % nvictims;
+	if (!victims[i].used && victims[i].nclusters >= min_clusters)
+	    return &victims[i];
+    }
+    i = random() % nvictims;
+    for (j = 0; j < nvictims; j++)
+    {
+	struct victim *v = &victims[(i + j) % nvictims];
+	if (!v->used && v->nclusters >= min_clusters)
+	    return v;
+    }
+    return NULL;
+}
+
+
+/* longest_victim returns the undamaged file with the longest chain, so
+   that cycles are as long as the image allows */
+struct victim *longest_victim(uint32_t min_clusters)
+{
+    struct victim *best = NULL;
+    int i;
+
+    for (i = 0; i < nvictims; i++)
+    {
+	if (!victims[i].used && victims[i].nclusters >= min_clusters
+	    && (best == NULL || victims[i].nclusters > best->nclusters))
+	    best = &victims[i];
+    }
+    return best;
+}
+
+
+/* chain_cluster returns the k'th cluster (counting from 0) of a chain */
+uint16_t chain_cluster(uint16_t cluster, uint32_t k,
+		       uint8_t *image_buf, struct bpb33* bpb)
+{
+    while (k-- > 0)
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    return cluster;
+}
+
+
+int make_cycles(int count, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct victim *v;
+    int done;
+
+    for (done = 0; done < count && (v = longest_victim(2)) != NULL; done++)
+    {
+	set_fat_entry(chain_cluster(v->start, v->nclusters - 1, image_buf, bpb),
+		      v->start, image_buf, bpb);
+	v->used = TRUE;
+    }
+    return done;
+}
+
+
+int make_selfloops(int count, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct victim *v;
+    uint16_t c;
+    int done;
+
+    for (done = 0; done < count && (v = pick_victim(2)) != NULL; done++)
+    {
+	c = chain_cluster(v->start, random() % (v->nclusters - 1), image_buf, bpb);
+	set_fat_entry(c, c, image_buf, bpb);
+	v->used = TRUE;
+    }
+    return done;
+}
+
+
+int make_crosslinks(int count, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct victim *from, *to;
+    int done;
+
+    for (done = 0; done < count; done++)
+    {
+	if ((from = pick_victim(1)) == NULL)
+	    break;
+	from->used = TRUE;
+	if ((to = pick_victim(2)) == NULL)
+	{
+	    from->used = FALSE;
+	    break;
+	}
+	set_fat_entry(chain_cluster(from->start, from->nclusters - 1,
+				    image_buf, bpb),
+		      chain_cluster(to->start, 1 + random() % (to->nclusters - 1),
+				    image_buf, bpb),
+		      image_buf, bpb);
+	to->used = TRUE;
+    }
+    return done;
+}
+
+
+int make_bad(int count, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct victim *v;
+    int done;
+
+    for (done = 0; done < count && (v = pick_victim(2)) != NULL; done++)
+    {
+	set_fat_entry(chain_cluster(v->start, random() % (v->nclusters - 1),
+				    image_buf, bpb),
+		      FAT12_MASK & CLUST_BAD, image_buf, bpb);
+	v->used = TRUE;
+    }
+    return done;
+}
+
+
+/* make_freed leaves a file's chain running into a free cluster: its
+   last cluster is marked free where the EOF should be */
+int make_freed(int count, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct victim *v;
+    int done;
+
+    for (done = 0; done < count && (v = pick_victim(1)) != NULL; done++)
+    {
+	set_fat_entry(chain_cluster(v->start, v->nclusters - 1, image_buf, bpb),
+		      CLUST_FREE, image_buf, bpb);
+	v->used = TRUE;
+    }
+    return done;
+}
+
+
+/* make_sizes alternates between sizes past the end of the chain and
+   sizes more than a cluster short of it */
+int make_sizes(int count, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct victim *v;
+    uint32_t size;
+    int done;
+
+    for (done = 0; done < count; done++)
+    {
+	if (done % 2 == 0)
+	{
+	    if ((v = pick_victim(0)) == NULL)
+		break;
+	    size = v->nclusters * clust_size + 1 + random() % (4 * clust_size);
+	}
+	else
+	{
+	    if ((v = pick_victim(2)) == NULL)
+		break;
+	    size = random() % ((v->nclusters - 1) * clust_size);
+	}
+	putulong(v->dirent->deFileSize, size);
+	mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)v->dirent,
+		   sizeof(struct direntry));
+	v->used = TRUE;
+    }
+    return done;
+}
+
+
+/* make_orphans links randomly chosen free clusters into chains of
+   length clusters that no directory entry refers to */
+int make_orphans(int count, int length, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb), c, tmp;
+    uint16_t *free_list = malloc(total * sizeof(uint16_t));
+    uint32_t nfree = 0, i, j, used = 0;
+    int done, k;
+
+    for (c = CLUST_FIRST; c < total; c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    free_list[nfree++] = c;
+    }
+
+    for (done = 0; done < count && nfree - used >= (uint32_t)length; done++)
+    {
+	/* draw the chain's clusters from what's left, Fisher-Yates style */
+	for (k = 0; k < length; k++)
+	{
+	    i = used + k;
+	    j = i + random() % (nfree - i);
+	    tmp = free_list[i];
+	    free_list[i] = free_list[j];
+	    free_list[j] = tmp;
+	}
+	for (k = 0; k < length; k++)
+	{
+	    set_fat_entry(free_list[used + k],
+			  (k == length - 1) ? (FAT12_MASK & CLUST_EOFS)
+			  : free_list[used + k + 1],
+			  image_buf, bpb);
+	}
+	used += length;
+    }
+    free(free_list);
+    return done;
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    int seed = 1, cycles = 0, selfloops = 0, crosslinks = 0, bad = 0;
+    int freed = 0, sizes = 0, orphans = 0, orphan_length = 1;
+    int got_cycles, got_selfloops, got_crosslinks, got_bad, got_sizes;
+    int got_freed, got_orphans;
+    char *image = NULL;
+    int i;
+
+    stats_option(&argc, argv);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+	    seed = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+	    cycles = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+	    selfloops = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+	    crosslinks = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+	    bad = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+	    freed = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+	    sizes = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+	    orphans = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+	    orphan_length = atoi(argv[++i]);
+	else if (argv[i][0] == '-' || image != NULL)
+	    usage(argv[0]);
+	else
+	    image = argv[i];
+    }
+    if (image == NULL || cycles < 0 || selfloops < 0 || crosslinks < 0
+	|| bad < 0 || freed < 0 || sizes < 0 || orphans < 0 || orphan_length < 1)
+    {
+	usage(argv[0]);
+    }
+    srandom(seed);
+
+    image_buf = mmap_file(image, &fd);
+    bpb = check_bootsector(image_buf);
+
+    collect_victims(MSDOSFSROOT, image_buf, bpb);
+
+    /* cycles go first, so that they get the longest chains */
+    stats_phase(PHASE_DATA);
+    got_cycles = make_cycles(cycles, image_buf, bpb);
+    got_crosslinks = make_crosslinks(crosslinks, image_buf, bpb);
+    got_selfloops = make_selfloops(selfloops, image_buf, bpb);
+    got_bad = make_bad(bad, image_buf, bpb);
+    got_freed = make_freed(freed, image_buf, bpb);
+    got_sizes = make_sizes(sizes, image_buf, bpb);
+    got_orphans = make_orphans(orphans, orphan_length, image_buf, bpb);
+    sync_fat_copies(image_buf, bpb);
+
+    fprintf(stderr, "%s: %d cycles, %d self-loops, %d cross-links, %d bad clusters, %d freed ends, %d wrong sizes, %d orphan chains\n",
+	    image, got_cycles, got_selfloops, got_crosslinks, got_bad,
+	    got_freed, got_sizes, got_orphans);
+    if (got_cycles < cycles || got_selfloops < selfloops
+	|| got_crosslinks < crosslinks || got_bad < bad || got_freed < freed
+	|| got_sizes < sizes || got_orphans < orphans)
+    {
+	fprintf(stderr, "Not enough files or free space for everything asked for\n");
+    }
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    free(victims);
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "ioqueue.h"
 
 
 /* get_name retrieves the filename from a directory entry */
@@ -51,8 +52,8 @@ void get_name(char *fullname, struct direntry *dirent)
     fullname[0]='\0';
     strcat(fullname, name);
 
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
+    /* append the extension if it's not a directory and there is one */
+    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0 && extension[0] != ' ') 
     {
 	strcat(fullname, ".");
 	strcat(fullname, extension);
@@ -129,6 +130,7 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
 	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
 	     d += sizeof(struct direntry)) 
 	{
+	    dos_stats.dirents_scanned++;
 	    if (dirent->deName[0] == SLOT_EMPTY) 
 	    {
 		/* we failed to find the file */
@@ -222,12 +224,14 @@ void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
     if (bytes_remaining <= clust_size) 
     {
 	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
+	fwrite_image(p, bytes_remaining, fd);
+	dos_stats.bytes_out += bytes_remaining;
     } 
     else 
     {
 	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
+	fwrite_image(p, clust_size, fd);
+	dos_stats.bytes_out += clust_size;
 
 	/* recurse, continuing to copy */
 	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
@@ -239,11 +243,13 @@ void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
 /* copyout copies a file from the FAT-12 memory disk image to a
    regular file in the file system */
 
-void copyout(char *infilename, char* outfilename,
+void copyout(char *infilename, char* outfilename, int image_fd,
 	     uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
+    struct ioqueue queue;
     FILE *fd;
+    int out_fd;
     uint16_t start_cluster;
     uint32_t size;
 
@@ -260,6 +266,44 @@ void copyout(char *infilename, char* outfilename,
 	exit(1);
     }
 
+    start_cluster = getushort(dirent->deStartCluster);
+    size = getulong(dirent->deFileSize);
+
+    /* with --queue-depth, read the image and write the file through
+       the I/O queue, with many clusters in flight at once - unless the
+       image file isn't the whole story, because of an overlay */
+    if (ioq_depth > 0 && image_file_current())
+    {
+	out_fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out_fd < 0)
+	{
+	    fprintf(stderr, "Can't open file %s to copy data out\n",
+		    outfilename);
+	    exit(1);
+	}
+	if (ioq_open(&queue, ioq_depth, ioq_engine) < 0)
+	{
+	    fprintf(stderr, "Can't set up the I/O queue: %s\n", strerror(errno));
+	    exit(1);
+	}
+	stats_phase(PHASE_DATA);
+	if (ioq_copy_out(&queue, image_fd, start_cluster, size, out_fd,
+			 image_buf, bpb) < 0)
+	{
+	    fprintf(stderr, "Failed to copy out %s: %s\n", infilename,
+		    strerror(errno));
+	    exit(1);
+	}
+	ioq_close(&queue);
+	if (close(out_fd) < 0)
+	{
+	    fprintf(stderr, "Failed to write %s: %s\n", outfilename,
+		    strerror(errno));
+	    exit(1);
+	}
+	return;
+    }
+
     /* open the real file for writing */
     fd = fopen(outfilename, "w");
     if (fd == NULL) 
@@ -270,83 +314,174 @@ void copyout(char *infilename, char* outfilename,
     }
 
     /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
-    size = getulong(dirent->deFileSize);
+    stats_phase(PHASE_DATA);
     copy_out_file(fd, start_cluster, size, image_buf, bpb);
     
     fclose(fd);
 }
 
-/* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
+/* read_fully reads up to len bytes into buf, retrying short reads,
+   and returns the number of bytes read */
+size_t read_fully(int fd, uint8_t *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
-		      uint32_t *size)
+    while (total < len)
+    {
+	bytes = read(fd, buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    break;
+	total += bytes;
+    }
+    dos_stats.bytes_in += total;
+    return total;
+}
+
+
+/* truncate_chain cuts the chain starting at start_cluster down to
+   keep clusters, freeing the rest, and returns the (possibly now
+   empty) start cluster */
+uint16_t truncate_chain(uint16_t start_cluster, uint32_t keep,
+			uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t cluster = start_cluster;
+    uint32_t i;
+
+    if (keep == 0)
+    {
+	free_chain(start_cluster, image_buf, bpb);
+	return 0;
+    }
+    for (i = 1; i < keep; i++)
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    free_chain(get_fat_entry(cluster, image_buf, bpb), image_buf, bpb);
+    set_fat_entry(cluster, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+    return start_cluster;
+}
+
+
+/* copy_in_stream handles sources we can't size up front (pipes and
+   the like): each cluster is allocated as we go and read into
+   directly */
+uint16_t copy_in_stream(int fd, uint8_t *image_buf, struct bpb33* bpb,
+			uint32_t *size)
 {
-    uint32_t clust_size, total_clusters, i;
-    uint8_t *buf;
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint16_t start_cluster = 0, prev_cluster = 0;
+    struct extent *ext;
+    uint8_t *p;
     size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
-    
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    buf = malloc(clust_size);
-    while(1) 
+
+    while (1)
     {
-	/* read a block of data, and store it */
-	bytes = fread(buf, 1, clust_size, fd);
-	if (bytes > 0) {
-	    *size += bytes;
+	if (alloc_clusters(1, &ext, image_buf, bpb) < 0)
+	{
+	    /* oops - we ran out of disk space */
+	    fprintf(stderr, "No more space in filesystem\n");
+	    exit(1);
+	}
+	p = cluster_to_addr(ext[0].start, image_buf, bpb);
+	bytes = read_fully(fd, p, clust_size);
+	if (bytes == 0)
+	{
+	    set_fat_entry(ext[0].start, CLUST_FREE, image_buf, bpb);
+	    free(ext);
+	    break;
+	}
+	*size += bytes;
 
-	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) 
-	    {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
-		{
-		    break;
-		}
-	    }
+	/* zero the slack at the end of a partial cluster */
+	memset(p + bytes, 0, clust_size - bytes);
+	mark_dirty(image_buf, DIRTY_DATA, p, clust_size);
 
-	    if (i == total_clusters) 
-	    {
-		/* oops - we ran out of disk space */
-		fprintf(stderr, "No more space in filesystem\n");
-		/* we should clean up here, rather than just exit */ 
-		exit(1);
-	    }
+	if (start_cluster == 0)
+	    start_cluster = ext[0].start;
+	else
+	    set_fat_entry(prev_cluster, ext[0].start, image_buf, bpb);
+	prev_cluster = ext[0].start;
+	free(ext);
 
-	    /* remember the first cluster, as we need to store this in
-	       the dirent */
-	    if (start_cluster == 0) 
-	    {
-		start_cluster = i;
-	    } 
-	    else 
-	    {
-		/* link the previous cluster to this one in the FAT */
-		assert(prev_cluster != 0);
-		set_fat_entry(prev_cluster, i, image_buf, bpb);
-	    }
+	if (bytes < clust_size)
+	    break;
+    }
+    return start_cluster;
+}
 
-	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
 
-	    /* copy the data into the cluster */
-	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
-	}
+/* copy_in_file actually does the copying of the file into the memory
+   image, updates the FAT, and returns the starting cluster of the
+   file.  A regular file is sized with fstat, all of its clusters are
+   reserved at once (contiguously if there's room), and the data is
+   read straight into the mapped clusters with one read() per run of
+   clusters - there's no intermediate buffer. */
+uint16_t copy_in_file(int fd, uint8_t *image_buf, struct bpb33* bpb, 
+		      uint32_t *size)
+{
+    uint32_t clust_size, nclusters, want;
+    uint64_t remaining;
+    struct extent *ext;
+    struct stat statbuf;
+    uint16_t start_cluster;
+    uint8_t *p = NULL;
+    size_t bytes = 0;
+    int n, i;
+
+    if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+	return copy_in_stream(fd, image_buf, bpb, size);
+
+    if (statbuf.st_size > UINT32_MAX)
+    {
+	fprintf(stderr, "File too large for a FAT filesystem\n");
+	exit(1);
+    }
 
-	if (bytes < clust_size) 
+    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    remaining = statbuf.st_size;
+    nclusters = (remaining + clust_size - 1) / clust_size;
+
+    n = alloc_clusters(nclusters, &ext, image_buf, bpb);
+    if (n < 0)
+    {
+	/* oops - we ran out of disk space */
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
+    }
+    if (n == 0)
+	return 0;
+    start_cluster = ext[0].start;
+
+    for (i = 0; i < n && remaining > 0; i++)
+    {
+	want = ext[i].count * clust_size;
+	if (want > remaining)
+	    want = remaining;
+	p = cluster_to_addr(ext[i].start, image_buf, bpb);
+	dos_stats.clusters_touched += ext[i].count - 1;
+	bytes = read_fully(fd, p, want);
+	mark_dirty(image_buf, DIRTY_DATA, p, ext[i].count * clust_size);
+	*size += bytes;
+	remaining -= bytes;
+	if (bytes < want)
 	{
-	    /* We didn't real a full cluster, so we either got a read
-	       error, or reached end of file.  We exit anyway */
+	    /* the file got shorter under us */
 	    break;
 	}
-	prev_cluster = i;
     }
+    free(ext);
 
-    free(buf);
+    /* zero the slack at the end of the last cluster */
+    if (*size % clust_size != 0)
+	memset(p + bytes, 0, clust_size - (*size % clust_size));
+
+    if (remaining > 0)
+    {
+	start_cluster = truncate_chain(start_cluster,
+				       (*size + clust_size - 1) / clust_size,
+				       image_buf, bpb);
+    }
     return start_cluster;
 }
 
@@ -412,71 +547,207 @@ void write_dirent(struct direntry *dirent, char *filename,
 }
 
 
-/* create_dirent finds a free slot in the directory, and write the
+/* create_dirent finds a free slot in the directory starting at
+   dir_cluster, growing the directory if it has to, and writes the
    directory entry */
 
-void create_dirent(struct direntry *dirent, char *filename, 
+void create_dirent(uint16_t dir_cluster, char *filename, 
 		   uint16_t start_cluster, uint32_t size,
 		   uint8_t *image_buf, struct bpb33* bpb)
 {
-    while (1) 
+    struct direntry *dirent = alloc_dirent(dir_cluster, image_buf, bpb);
+
+    if (dirent == NULL)
+    {
+	/* give the clusters back, rather than leave orphans behind */
+	free_chain(start_cluster, image_buf, bpb);
+	fprintf(stderr, "No room in the directory for %s\n", filename);
+	exit(1);
+    }
+
+    write_dirent(dirent, filename, start_cluster, size);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent,
+	       sizeof(struct direntry));
+}
+
+/* update_file overwrites an existing file in the image with the
+   contents of fd, rsync style.  The host file is mapped and compared
+   with the existing chain a cluster at a time, and only clusters whose
+   contents differ are rewritten, so the number of pages we dirty (and
+   that have to be written back) is proportional to the change rather
+   than to the file size.  The chain grows or shrinks at the tail to
+   fit the new size. */
+void update_file(int fd, char *filename, struct direntry *dirent,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t limit = num_clusters(bpb);
+    uint32_t newsize, need, have = 0, rewritten = 0, i, len;
+    uint16_t start_cluster, cluster, last = 0;
+    struct extent *ext = NULL;
+    struct stat statbuf;
+    uint8_t *src = NULL, *p;
+    int n = 0, j, k;
+
+    if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+    {
+	fprintf(stderr, "Can only update from a regular file\n");
+	exit(1);
+    }
+    if (statbuf.st_size > UINT32_MAX)
+    {
+	fprintf(stderr, "File too large for a FAT filesystem\n");
+	exit(1);
+    }
+    newsize = statbuf.st_size;
+    need = (newsize + clust_size - 1) / clust_size;
+
+    if (newsize > 0)
     {
-	if (dirent->deName[0] == SLOT_EMPTY) 
+	src = mmap(NULL, newsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (src == MAP_FAILED)
 	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
+	    fprintf(stderr, "Failed to memory map %s: %s\n", filename,
+		    strerror(errno));
+	    exit(1);
+	}
+	madvise(src, newsize, MADV_SEQUENTIAL);
+	dos_stats.bytes_in += newsize;
+    }
 
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
+    /* count the existing chain, so that if we need more clusters we
+       can find out there's no room before we change anything */
+    start_cluster = getushort(dirent->deStartCluster);
+    for (cluster = start_cluster;
+	 is_valid_cluster(cluster, bpb) && cluster < limit && have < limit;
+	 cluster = get_fat_entry(cluster, image_buf, bpb))
+    {
+	last = cluster;
+	have++;
+    }
+    if (need > have)
+    {
+	n = alloc_clusters(need - have, &ext, image_buf, bpb);
+	if (n < 0)
+	{
+	    fprintf(stderr, "No more space in filesystem\n");
+	    exit(1);
 	}
+    }
 
-	if (dirent->deName[0] == SLOT_DELETED) 
+    /* rewrite the clusters that differ */
+    cluster = start_cluster;
+    for (i = 0; i < need && i < have; i++)
+    {
+	p = cluster_to_addr(cluster, image_buf, bpb);
+	len = newsize - i * clust_size;
+	if (len > clust_size)
+	    len = clust_size;
+	if (memcmp(p, src + i * clust_size, len) != 0)
 	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    memcpy(p, src + i * clust_size, len);
+	    memset(p + len, 0, clust_size - len);
+	    mark_dirty(image_buf, DIRTY_DATA, p, clust_size);
+	    rewritten++;
+	}
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+
+    /* grow: hang the new clusters off the end and fill them */
+    if (n > 0)
+    {
+	if (have == 0)
+	    start_cluster = ext[0].start;
+	else
+	    set_fat_entry(last, ext[0].start, image_buf, bpb);
+	for (j = 0, i = have; j < n; j++)
+	{
+	    for (k = 0; k < ext[j].count; k++, i++)
+	    {
+		p = cluster_to_addr(ext[j].start + k, image_buf, bpb);
+		len = newsize - i * clust_size;
+		if (len > clust_size)
+		    len = clust_size;
+		memcpy(p, src + i * clust_size, len);
+		memset(p + len, 0, clust_size - len);
+		mark_dirty(image_buf, DIRTY_DATA, p, clust_size);
+	    }
 	}
-	dirent++;
+	free(ext);
     }
+
+    /* shrink: free whatever is past the new end */
+    if (need < have)
+	start_cluster = truncate_chain(start_cluster, need, image_buf, bpb);
+
+    if (getushort(dirent->deStartCluster) != start_cluster)
+	putushort(dirent->deStartCluster, start_cluster);
+    if (getulong(dirent->deFileSize) != newsize)
+	putulong(dirent->deFileSize, newsize);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    if (need != have)
+	sync_fat_copies(image_buf, bpb);
+
+    if (src != NULL)
+	munmap(src, newsize);
+
+    fprintf(stderr, "Updated %s: %u of %u clusters rewritten, %u added, %u freed\n",
+	    filename, rewritten, need < have ? need : have,
+	    need > have ? need - have : 0, have > need ? have - need : 0);
 }
 
 /* copyin copies a file from a regular file on the filesystem into a
    file in the FAT-12 memory disk image  */
 
-void copyin(char *infilename, char* outfilename,
+void copyin(char *infilename, char* outfilename, int update,
 	    uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
-    FILE *fd;
+    int fd, dir_cluster;
     uint16_t start_cluster;
     uint32_t size = 0;
 
     assert(strncmp("a:", outfilename, 2)==0);
     outfilename+=2;
 
-    /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
+    /* check that the file doesn't already exist, unless we've been
+       asked to update it.  This is the same case-insensitive lookup
+       that finds the directory to put it in. */
+    dirent = lookup_path(outfilename, &dir_cluster, image_buf, bpb);
+    if (dirent != NULL && (dirent->deAttributes & ATTR_DIRECTORY) != 0)
+    {
+	fprintf(stderr, "%s is a directory\n", outfilename);
+	exit(1);
+    }
+    if (dirent != NULL && update)
+    {
+	fd = open(infilename, O_RDONLY);
+	if (fd < 0)
+	{
+	    fprintf(stderr, "Can't open file %s to copy data in\n",
+		    infilename);
+	    exit(1);
+	}
+	stats_phase(PHASE_DATA);
+	update_file(fd, outfilename, dirent, image_buf, bpb);
+	close(fd);
+	return;
+    }
     if (dirent != NULL) 
     {
 	fprintf(stderr, "File %s already exists\n", outfilename);
 	exit(1);
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) 
+    if (dir_cluster < 0) 
     {
 	fprintf(stderr, "Directory does not exists in the disk image\n");
 	exit(1);
     }
 
     /* open the real file for reading */
-    fd = fopen(infilename, "r");
-    if (fd == NULL) 
+    fd = open(infilename, O_RDONLY);
+    if (fd < 0) 
     {
 	fprintf(stderr, "Can't open file %s to copy data in\n",
 		infilename);
@@ -484,20 +755,31 @@ void copyin(char *infilename, char* outfilename,
     }
 
     /* do the actual copy in*/
+    stats_phase(PHASE_DATA);
     start_cluster = copy_in_file(fd, image_buf, bpb, &size);
 
     /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+    create_dirent(dir_cluster, outfilename, start_cluster, size, image_buf, bpb);
+    sync_fat_copies(image_buf, bpb);
     
-    fclose(fd);
+    close(fd);
 }
 
 void usage(char *progname)
 {
     fprintf(stderr, "usage: %s <imagename> a:<filename1> <filename2>\n", progname);
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
-    fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
+    fprintf(stderr, "usage: %s [-u] <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "\t-u: if filename4 exists, rewrite only the clusters that changed\n");
+    fprintf(stderr, "\t--sync=none|end|ordered: how changes are flushed to disk (default none)\n");
+    fprintf(stderr, "\t\tend: one msync of the whole image when we're done\n");
+    fprintf(stderr, "\t\tordered: flush data, then the FAT, then the directory entry,\n\t\t\ta page at a time, so changes sharing a page go together\n");
+    fprintf(stderr, "\t--queue-depth=N: copy out with up to N reads and writes in flight\n");
+    fprintf(stderr, "\t--io=uring|threads: how to queue them (default io_uring if the kernel has it)\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
     exit(1);
 }
 
@@ -506,30 +788,57 @@ int main(int argc, char** argv)
     int fd;
     uint8_t *image_buf;
     struct bpb33* bpb;
-    if (argc < 4 || argc > 4) 
+    int update = FALSE, sync_policy = SYNC_NONE;
+    char *args[3];
+    int nargs = 0, i;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0 || ioq_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--update") == 0)
+	    update = TRUE;
+	else if (strncmp(argv[i], "--sync=", 7) == 0)
+	{
+	    sync_policy = parse_sync_policy(argv[i] + 7);
+	    if (sync_policy < 0)
+		usage(argv[0]);
+	}
+	else if (nargs == 3)
+	    usage(argv[0]);
+	else
+	    args[nargs++] = argv[i];
+    }
+    if (nargs != 3) 
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(args[0], &fd);
     bpb = check_bootsector(image_buf);
 
     /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) 
+    if (strncmp("a:", args[1], 2)==0) 
     {
 	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
+	copyout(args[1], args[2], fd, image_buf, bpb);
     }
-    else if (strncmp("a:", argv[3], 2)==0) 
+    else if (strncmp("a:", args[2], 2)==0) 
     {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	copyin(args[1], args[2], update, image_buf, bpb);
     } 
     else 
     {
 	usage(argv[0]);
     }
 
+    if (flush_dirty(image_buf, sync_policy) < 0)
+    {
+	fprintf(stderr, "Failed to flush changes to the disk image\n");
+	exit(1);
+    }
     unmmap_file(image_buf, &fd);
     return 0;
 }
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* every file and subdirectory we find in the image, together with
+   the extent map of its cluster chain.  The directory entry is kept as
+   the slot it's in rather than a pointer: relocating the directory
+   holding it moves the entry to another cluster. */
+struct chain {
+    char path[MAXPATHLEN+1];
+    uint16_t parent;		/* first cluster of the directory it's in */
+    uint32_t slot;		/* which entry of that directory it is */
+    int is_dir;
+    int suspect;		/* shares clusters with another chain */
+    uint32_t nclusters;
+    int nextents;
+    struct extent *extents;
+};
+
+struct chain *chains = NULL;
+int nchains = 0;
+int maxchains = 0;
+
+/* owner[c] is the index of the chain that cluster c belongs to, or
+   -1; used[c] is non-zero if the FAT says cluster c is allocated */
+int *owner;
+uint8_t *used;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--plan-only] <imagename>\n", progname);
+    fprintf(stderr, "\treports fragmentation and relocates fragmented chains into contiguous runs\n");
+    fprintf(stderr, "\t--plan-only: print the relocation plan and its benefit without changing the image\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+void add_chain(char *path, uint16_t parent, uint32_t slot,
+	       struct direntry *dirent, int is_dir,
+	       uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct chain *c;
+    int i;
+
+    if (nchains == maxchains)
+    {
+	maxchains = maxchains ? maxchains * 2 : 64;
+	chains = realloc(chains, maxchains * sizeof(struct chain));
+    }
+    c = &chains[nchains++];
+    strncpy(c->path, path, MAXPATHLEN);
+    c->path[MAXPATHLEN] = '\0';
+    c->parent = parent;
+    c->slot = slot;
+    c->is_dir = is_dir;
+    c->suspect = FALSE;
+    c->nextents = get_extents(getushort(dirent->deStartCluster),
+			      &c->extents, image_buf, bpb);
+    c->nclusters = 0;
+    for (i = 0; i < c->nextents; i++)
+	c->nclusters += c->extents[i].count;
+}
+
+
+/* chain_dirent finds a chain's directory entry where it is now.  A
+   directory keeps its first cluster when it's relocated, so the
+   parent cluster is still right; the slot is looked up along the
+   parent's chain as the FAT has it now. */
+struct direntry *chain_dirent(struct chain *c, uint8_t *image_buf,
+			      struct bpb33* bpb)
+{
+    uint32_t n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t slot = c->slot;
+    uint16_t cluster = c->parent;
+
+    if (cluster == MSDOSFSROOT)
+	return (struct direntry*)root_dir_addr(image_buf, bpb) + slot;
+    for (; slot >= n; slot -= n)
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    return (struct direntry*)cluster_to_addr(cluster, image_buf, bpb) + slot;
+}
+
+
+/* collect_dir records every entry of one directory, and recurses into
+   subdirectories.  cluster 0 is the fixed-size root directory. */
+void collect_dir(uint16_t cluster, char *prefix, int depth,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    int entries_per_cluster, n, i;
+    uint32_t steps = 0, slot = 0;
+    uint16_t first = cluster;
+    struct direntry *dirent;
+    char name[MAXFILENAME];
+    char path[MAXPATHLEN+1];
+
+    if (depth > MAXPATHLEN / 2)
+    {
+	/* a directory loop - scandisk's problem, not ours */
+	return;
+    }
+
+    entries_per_cluster = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+
+    while (1)
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	n = (cluster == MSDOSFSROOT) ? bpb->bpbRootDirEnts
+	    : entries_per_cluster;
+
+	for (i = 0; i < n; i++, slot++, dirent++)
+	{
+	    uint8_t name0 = dirent->deName[0];
+	    uint16_t start = getushort(dirent->deStartCluster);
+
+	    dos_stats.dirents_scanned++;
+	    if (name0 == SLOT_EMPTY || name0 == SLOT_DELETED || name0 == 0x2E)
+		continue;
+	    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    dirent_filename(dirent, name);
+	    snprintf(path, sizeof(path), "%s/%s", prefix, name);
+
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	    {
+		add_chain(path, first, slot, dirent, TRUE, image_buf, bpb);
+		if (is_valid_cluster(start, bpb))
+		    collect_dir(start, path, depth + 1, image_buf, bpb);
+	    }
+	    else
+	    {
+		add_chain(path, first, slot, dirent, FALSE, image_buf, bpb);
+	    }
+	}
+
+	if (cluster == MSDOSFSROOT)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(cluster, bpb) || cluster >= num_clusters(bpb)
+	    || ++steps >= num_clusters(bpb))
+	    break;
+    }
+}
+
+
+/* build the owner and used maps, and flag chains that share clusters
+   so that we never move something scandisk ought to look at first */
+void build_maps(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb);
+    int i, j, k;
+
+    owner = malloc(total * sizeof(int));
+    used = malloc(total);
+    for (i = 0; i < total; i++)
+    {
+	owner[i] = -1;
+	used[i] = (i >= CLUST_FIRST
+		   && get_fat_entry(i, image_buf, bpb) != CLUST_FREE);
+    }
+
+    for (i = 0; i < nchains; i++)
+    {
+	for (j = 0; j < chains[i].nextents; j++)
+	{
+	    struct extent *e = &chains[i].extents[j];
+	    for (k = 0; k < e->count; k++)
+	    {
+		uint16_t c = e->start + k;
+		if (owner[c] >= 0)
+		{
+		    chains[i].suspect = TRUE;
+		    chains[owner[c]].suspect = TRUE;
+		}
+		owner[c] = i;
+	    }
+	}
+    }
+}
+
+
+void report(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t files = 0, fragmented = 0, extents = 0, clusters = 0;
+    uint32_t free_clusters = 0, free_runs = 0, largest_free = 0, run = 0;
+    uint16_t total = num_clusters(bpb);
+    int i;
+
+    printf("%8s %8s %8s  %s\n", "EXTENTS", "CLUSTERS", "AVG RUN", "PATH");
+    for (i = 0; i < nchains; i++)
+    {
+	struct chain *c = &chains[i];
+	if (c->nclusters == 0)
+	    continue;
+	printf("%8d %8u %8.1f  %s%s%s\n", c->nextents, c->nclusters,
+	       (double)c->nclusters / c->nextents, c->path,
+	       c->is_dir ? "/" : "", c->suspect ? " (cross-linked)" : "");
+	files++;
+	extents += c->nextents;
+	clusters += c->nclusters;
+	if (c->nextents > 1)
+	    fragmented++;
+    }
+
+    for (i = CLUST_FIRST; i <= total; i++)
+    {
+	if (i < total && !used[i])
+	{
+	    free_clusters++;
+	    run++;
+	    continue;
+	}
+	if (run > 0)
+	{
+	    free_runs++;
+	    if (run > largest_free)
+		largest_free = run;
+	}
+	run = 0;
+    }
+
+    printf("\n");
+    printf("chains:            %u (%u fragmented, %.1f%%)\n", files,
+	   fragmented, files ? 100.0 * fragmented / files : 0.0);
+    printf("extents:           %u for %u clusters\n", extents, clusters);
+    printf("average run:       %.2f clusters\n",
+	   extents ? (double)clusters / extents : 0.0);
+    printf("free space:        %u clusters in %u runs (largest %u)\n",
+	   free_clusters, free_runs, largest_free);
+}
+
+
+/* count how many clusters of chain ci would have to move if the chain
+   were laid out contiguously starting at target, or -1 if that range
+   holds clusters belonging to someone else (or our own clusters in
+   the wrong order) */
+int moves_for_target(int ci, uint16_t *clist, uint16_t target,
+		     struct bpb33* bpb)
+{
+    struct chain *c = &chains[ci];
+    uint32_t i;
+    int moves = 0;
+
+    if (target < CLUST_FIRST || target + c->nclusters > num_clusters(bpb))
+	return -1;
+
+    for (i = 0; i < c->nclusters; i++)
+    {
+	uint16_t t = target + i;
+	if (clist[i] == t)
+	    continue;
+	if (used[t])
+	    return -1;
+	moves++;
+    }
+    return moves;
+}
+
+
+/* pick the target run for a chain that needs the fewest moves.  We
+   try lining the chain up with each of its existing extents, and the
+   first free run that's big enough.  Directories have "." and ".."
+   entries pointing at their first cluster, so for those we only try
+   the layout that keeps the first cluster where it is. */
+int choose_target(int ci, uint16_t *clist, uint16_t *target,
+		  struct bpb33* bpb)
+{
+    struct chain *c = &chains[ci];
+    int best = -1, moves, j;
+    uint32_t pos = 0, run = 0;
+    uint16_t i, total = num_clusters(bpb);
+
+    for (j = 0; j < c->nextents; j++)
+    {
+	if (c->extents[j].start >= pos + CLUST_FIRST
+	    && (!c->is_dir || j == 0))
+	{
+	    uint16_t t = c->extents[j].start - pos;
+	    moves = moves_for_target(ci, clist, t, bpb);
+	    if (moves >= 0 && (best < 0 || moves < best))
+	    {
+		best = moves;
+		*target = t;
+	    }
+	}
+	pos += c->extents[j].count;
+    }
+
+    if (c->is_dir || (best >= 0 && best < c->nclusters))
+	return best;
+
+    /* first fit in free space */
+    for (i = CLUST_FIRST; i < total; i++)
+    {
+	run = used[i] ? 0 : run + 1;
+	if (run == c->nclusters)
+	{
+	    if (best < 0)
+	    {
+		best = c->nclusters;
+		*target = i - run + 1;
+	    }
+	    break;
+	}
+    }
+    return best;
+}
+
+
+/* relocate does the actual moving, in an order that leaves the file
+   readable if we crash at any point: the worst case is some leaked
+   clusters, which scandisk will pick up as orphans.
+
+   1. copy data into the free target clusters - nothing points at
+      them yet.
+   2. link the new clusters to each other - still unreferenced.
+   3. repoint the clusters that stay put, last to first, so that the
+      chain is always an old prefix followed by a complete new suffix.
+   4. commit by pointing the directory entry at the new first cluster.
+   5. free the old clusters.
+
+   Each step is flushed with msync before the next one starts. */
+void relocate(int ci, uint16_t *clist, uint16_t target,
+	      uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct chain *c = &chains[ci];
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t fat_offset = bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    uint32_t fat_bytes = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    uint16_t eof = FAT12_MASK & CLUST_EOFS;
+    uint32_t i, n = c->nclusters;
+    struct direntry *dirent;
+
+    /* step 1 */
+    for (i = 0; i < n; i++)
+    {
+	if (clist[i] != target + i)
+	    memcpy(cluster_to_addr(target + i, image_buf, bpb),
+		   cluster_to_addr(clist[i], image_buf, bpb), clust_size);
+    }
+    msync_range(image_buf, cluster_to_addr(target, image_buf, bpb) - image_buf,
+		n * clust_size);
+
+    /* step 2 */
+    for (i = 0; i < n; i++)
+    {
+	if (clist[i] != target + i)
+	    set_fat_entry(target + i, i == n - 1 ? eof : target + i + 1,
+			  image_buf, bpb);
+    }
+    msync_range(image_buf, fat_offset, fat_bytes);
+
+    /* step 3 */
+    for (i = n; i-- > 0; )
+    {
+	uint16_t next = (i == n - 1) ? eof : target + i + 1;
+	if (clist[i] == target + i
+	    && get_fat_entry(target + i, image_buf, bpb) != next)
+	{
+	    set_fat_entry(target + i, next, image_buf, bpb);
+	    msync_range(image_buf, fat_offset, fat_bytes);
+	}
+    }
+
+    /* step 4 */
+    if (clist[0] != target)
+    {
+	dirent = chain_dirent(c, image_buf, bpb);
+	putushort(dirent->deStartCluster, target);
+	msync_range(image_buf, (uint8_t*)dirent - image_buf,
+		    sizeof(struct direntry));
+    }
+
+    /* step 5 */
+    for (i = 0; i < n; i++)
+    {
+	if (clist[i] != target + i)
+	    set_fat_entry(clist[i], CLUST_FREE, image_buf, bpb);
+    }
+    sync_fat_copies(image_buf, bpb);
+    msync_range(image_buf, fat_offset, bpb->bpbFATs * fat_bytes);
+}
+
+
+void defrag(int plan_only, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t moved_chains = 0, moved_clusters = 0, skipped = 0;
+    int extents_before = 0, extents_after = 0;
+    int ci, j, k, moves;
+    uint32_t i;
+
+    printf("\n%s:\n", plan_only ? "relocation plan" : "relocating");
+
+    for (ci = 0; ci < nchains; ci++)
+    {
+	struct chain *c = &chains[ci];
+	uint16_t *clist, target = 0;
+
+	extents_before += c->nextents;
+	if (c->nextents <= 1)
+	{
+	    extents_after += c->nextents;
+	    continue;
+	}
+	if (c->suspect)
+	{
+	    printf("  skipping %s: cross-linked, run scandisk first\n",
+		   c->path);
+	    extents_after += c->nextents;
+	    skipped++;
+	    continue;
+	}
+
+	/* flatten the extents into the list of clusters in chain order */
+	clist = malloc(c->nclusters * sizeof(uint16_t));
+	for (i = 0, j = 0; j < c->nextents; j++)
+	    for (k = 0; k < c->extents[j].count; k++)
+		clist[i++] = c->extents[j].start + k;
+
+	moves = choose_target(ci, clist, &target, bpb);
+	if (moves < 0)
+	{
+	    printf("  skipping %s: no contiguous run of %u clusters\n",
+		   c->path, c->nclusters);
+	    extents_after += c->nextents;
+	    skipped++;
+	    free(clist);
+	    continue;
+	}
+
+	printf("  %s: %d extents -> clusters %u-%u, moving %d of %u clusters\n",
+	       c->path, c->nextents, target, target + c->nclusters - 1,
+	       moves, c->nclusters);
+
+	if (!plan_only)
+	    relocate(ci, clist, target, image_buf, bpb);
+
+	/* keep our maps up to date so later plans see the new layout */
+	for (i = 0; i < c->nclusters; i++)
+	{
+	    if (clist[i] != target + i)
+	    {
+		used[clist[i]] = FALSE;
+		owner[clist[i]] = -1;
+	    }
+	}
+	for (i = 0; i < c->nclusters; i++)
+	{
+	    used[target + i] = TRUE;
+	    owner[target + i] = ci;
+	}
+	c->nextents = 1;
+	c->extents[0].start = target;
+	c->extents[0].count = c->nclusters;
+
+	extents_after += 1;
+	moved_chains++;
+	moved_clusters += moves;
+	free(clist);
+    }
+
+    printf("\n");
+    printf("chains relocated:  %u (%u left fragmented)\n",
+	   moved_chains, skipped);
+    printf("clusters moved:    %u (%u bytes)\n", moved_clusters,
+	   moved_clusters * clust_size);
+    printf("extents:           %d -> %d\n", extents_before, extents_after);
+    if (plan_only)
+	printf("(plan only - the image was not modified)\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    int plan_only = FALSE;
+    char *imagename = NULL;
+    int i;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "--plan-only") == 0)
+	    plan_only = TRUE;
+	else if (argv[i][0] == '-' || imagename != NULL)
+	    usage(argv[0]);
+	else
+	    imagename = argv[i];
+    }
+    if (imagename == NULL)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(imagename, &fd);
+    bpb = check_bootsector(image_buf);
+
+    collect_dir(MSDOSFSROOT, "", 0, image_buf, bpb);
+    build_maps(image_buf, bpb);
+    report(image_buf, bpb);
+    stats_phase(PHASE_DATA);
+    defrag(plan_only, image_buf, bpb);
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    return 0;
+}
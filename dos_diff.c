@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "checksum.h"
+#include "zimage.h"
+
+
+/* dos_diff compares two images as file systems rather than as bytes:
+   which files were added, removed or resized, whose cluster chains
+   changed, and whose data changed.
+
+   It starts with one pass over both images comparing them a block at
+   a time - a sector at a time in the FAT and root directory, a cluster
+   at a time in the data area - and from then on only decodes what that
+   pass found to differ: the FAT entries in changed FAT sectors, and
+   the contents of changed clusters.  Files whose chains haven't
+   changed are checked against the changed-cluster map instead of being
+   read.  Two images that differ in a handful of clusters cost about as
+   much as reading them both once. */
+
+struct diff_entry {
+    char path[MAXPATHLEN+1];
+    int is_dir;
+    uint8_t attributes;
+    uint16_t start;
+    uint32_t size;
+    time_t mtime;
+};
+
+struct image {
+    char *name;
+    uint8_t *buf;
+    size_t size;
+    int fd;			/* kept open for a compressed image */
+    struct bpb33 *bpb;
+    struct diff_entry *entries;
+    int nentries, maxentries;
+};
+
+struct image a, b;
+
+int same_geometry;
+uint32_t clust_size, fat_size;
+uint16_t total_clusters;
+uint8_t *data_a, *data_b;
+
+uint8_t *cluster_changed;	/* per cluster: its bytes differ */
+uint8_t *fat_changed;		/* per cluster: its FAT entry differs */
+uint8_t *in_a_file, *in_b_file;	/* per cluster: some chain uses it */
+
+int verbose = FALSE;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--stats] [-v] <image1> <image2>\n", progname);
+    fprintf(stderr, "\tlists the files added, removed and changed between two images;\n");
+    fprintf(stderr, "\texits 0 if they're the same, 1 if they differ, 2 on trouble\n");
+    fprintf(stderr, "\t-v: also list each changed cluster of a changed file, with\n\t\tits CRC32C in each image\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(2);
+}
+
+
+/* same_bytes is memcmp() == 0 without the ordering, 64 bytes a go */
+int same_bytes(const uint8_t *p, const uint8_t *q, size_t len)
+{
+#ifdef __SSE2__
+    __m128i x;
+
+    for ( ; len >= 64; len -= 64, p += 64, q += 64)
+    {
+	x = _mm_or_si128(
+	    _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)p),
+				       _mm_loadu_si128((const __m128i*)q)),
+			 _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + 16)),
+				       _mm_loadu_si128((const __m128i*)(q + 16)))),
+	    _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + 32)),
+				       _mm_loadu_si128((const __m128i*)(q + 32))),
+			 _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + 48)),
+				       _mm_loadu_si128((const __m128i*)(q + 48)))));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff)
+	    return FALSE;
+    }
+#endif
+    return len == 0 || memcmp(p, q, len) == 0;
+}
+
+
+/* open_image maps an image read-only; dos_diff never changes either */
+void open_image(struct image *img, char *name)
+{
+    struct stat statbuf;
+    uint64_t size;
+    int fd;
+
+    img->name = name;
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", name,
+		strerror(errno));
+	exit(2);
+    }
+    img->fd = -1;
+    if (zimage_is(fd))
+    {
+	img->buf = zimage_map(fd, name, &size, FALSE);
+	if (img->buf == NULL)
+	{
+	    fprintf(stderr, "Cannot read compressed image %s: %s\n", name,
+		    strerror(errno));
+	    exit(2);
+	}
+	img->size = size;
+	img->fd = fd;
+	img->bpb = check_bootsector(img->buf);
+	return;
+    }
+    img->size = statbuf.st_size;
+    if (img->size < 512)
+    {
+	fprintf(stderr, "%s is too small to be a disk image\n", name);
+	exit(2);
+    }
+    img->buf = mmap(NULL, img->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (img->buf == MAP_FAILED)
+    {
+	fprintf(stderr, "Failed to memory map %s: %s\n", name, strerror(errno));
+	exit(2);
+    }
+    close(fd);
+    madvise(img->buf, img->size, MADV_SEQUENTIAL);
+    img->bpb = check_bootsector(img->buf);
+}
+
+
+void close_image(struct image *img)
+{
+    if (img->fd >= 0)
+    {
+	zimage_unmap(img->buf);
+	close(img->fd);
+    }
+    else
+	munmap(img->buf, img->size);
+    free(img->bpb);
+}
+
+
+void collect(struct image *img, uint16_t dir_cluster, char *prefix)
+{
+    struct bpb33 *bpb = img->bpb;
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    struct diff_entry *e;
+    char name[MAXFILENAME];
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, img->buf, bpb);
+	if ((uint8_t*)(dirent + n) > img->buf + img->size)
+	    return;
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    if (img->nentries == img->maxentries)
+	    {
+		img->maxentries = img->maxentries ? img->maxentries * 2 : 64;
+		img->entries = realloc(img->entries,
+				       img->maxentries * sizeof(struct diff_entry));
+	    }
+	    e = &img->entries[img->nentries];
+	    dirent_filename(dirent, name);
+	    e->is_dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+	    if (snprintf(e->path, sizeof(e->path), "%s%s%s", prefix, name,
+			 e->is_dir ? "/" : "") >= (int)sizeof(e->path))
+	    {
+		fprintf(stderr, "%s: skipping %s%s: path too long\n", img->name,
+			prefix, name);
+		continue;
+	    }
+	    e->attributes = dirent->deAttributes;
+	    e->start = getushort(dirent->deStartCluster);
+	    e->size = e->is_dir ? 0 : getulong(dirent->deFileSize);
+	    e->mtime = dirent_time(dirent);
+	    img->nentries++;
+
+	    if (e->is_dir)
+	    {
+		char path[MAXPATHLEN+1];
+		strcpy(path, e->path);
+		collect(img, getushort(dirent->deStartCluster), path);
+	    }
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, img->buf, bpb);
+    }
+}
+
+
+int compare_entries(const void *x, const void *y)
+{
+    return strcmp(((const struct diff_entry*)x)->path,
+		  ((const struct diff_entry*)y)->path);
+}
+
+
+int check_geometry(void)
+{
+    struct bpb33 *p = a.bpb, *q = b.bpb;
+
+    return p->bpbBytesPerSec == q->bpbBytesPerSec
+	&& p->bpbSecPerClust == q->bpbSecPerClust
+	&& p->bpbResSectors == q->bpbResSectors
+	&& p->bpbFATs == q->bpbFATs
+	&& p->bpbRootDirEnts == q->bpbRootDirEnts
+	&& p->bpbSectors == q->bpbSectors
+	&& p->bpbFATsecs == q->bpbFATsecs;
+}
+
+
+/* in_image says whether len bytes at p lie inside img */
+int in_image(struct image *img, uint8_t *p, size_t len)
+{
+    return p >= img->buf && p + len <= img->buf + img->size;
+}
+
+
+/* scan is the one pass over both images.  It prints what differs
+   outside the files, and returns the number of such differences. */
+int scan(void)
+{
+    struct bpb33 *bpb = a.bpb;
+    uint32_t sector = bpb->bpbBytesPerSec, fat_off, off, len, s, first, last;
+    uint16_t c;
+    int copy, entries, root_sectors = 0, changed = 0, differences = 0;
+    uint8_t *root_a, *root_b;
+
+    fat_off = bpb->bpbResSectors * sector;
+    if (!same_bytes(a.buf, b.buf, fat_off < a.size ? fat_off : 512))
+    {
+	printf("boot sector differs\n");
+	differences++;
+    }
+
+    /* the FAT: decode only the entries in sectors that differ */
+    for (copy = 0; copy < bpb->bpbFATs; copy++)
+    {
+	entries = 0;
+	for (s = 0; s < bpb->bpbFATsecs; s++)
+	{
+	    off = fat_off + copy * fat_size + s * sector;
+	    if (!in_image(&a, a.buf + off, sector)
+		|| !in_image(&b, b.buf + off, sector)
+		|| same_bytes(a.buf + off, b.buf + off, sector))
+		continue;
+	    /* entry n lives in bytes n*3/2 and n*3/2+1 */
+	    first = s * sector * 2 / 3;
+	    last = ((s + 1) * sector * 2 + 2) / 3;
+	    if (last > total_clusters)
+		last = total_clusters;
+	    for (c = first; c < last; c++)
+	    {
+		if (fat12_get(a.buf + fat_off + copy * fat_size, c)
+		    == fat12_get(b.buf + fat_off + copy * fat_size, c))
+		    continue;
+		if (copy == 0)
+		{
+		    fat_changed[c] = TRUE;
+		    dos_stats.fat_reads += 2;
+		}
+		entries++;
+	    }
+	}
+	if (entries > 0)
+	{
+	    printf("FAT copy %d: %d entries differ\n", copy + 1, entries);
+	    differences++;
+	}
+    }
+
+    root_a = root_dir_addr(a.buf, bpb);
+    root_b = root_dir_addr(b.buf, bpb);
+    len = bpb->bpbRootDirEnts * sizeof(struct direntry);
+    for (off = 0; off < len; off += sector)
+    {
+	s = len - off < sector ? len - off : sector;
+	if (in_image(&a, root_a + off, s) && in_image(&b, root_b + off, s)
+	    && !same_bytes(root_a + off, root_b + off, s))
+	    root_sectors++;
+    }
+    if (root_sectors > 0)
+    {
+	printf("root directory: %d sectors differ\n", root_sectors);
+	differences++;
+    }
+
+    /* a cluster either image doesn't have all of counts as changed,
+       unless neither has it */
+    for (c = CLUST_FIRST; c < total_clusters; c++)
+    {
+	uint8_t *p = data_a + (uint32_t)(c - CLUST_FIRST) * clust_size;
+	uint8_t *q = data_b + (uint32_t)(c - CLUST_FIRST) * clust_size;
+	int has_a = in_image(&a, p, clust_size), has_b = in_image(&b, q, clust_size);
+
+	if (has_a && has_b)
+	    cluster_changed[c] = !same_bytes(p, q, clust_size);
+	else
+	    cluster_changed[c] = has_a || has_b;
+	changed += cluster_changed[c];
+    }
+    dos_stats.clusters_touched += 2 * (total_clusters - CLUST_FIRST);
+    if (changed > 0)
+    {
+	printf("data area: %d of %d clusters differ\n", changed,
+	       total_clusters - CLUST_FIRST);
+	differences++;
+    }
+    if (a.size != b.size)
+    {
+	printf("image sizes differ: %llu and %llu bytes\n",
+	       (unsigned long long)a.size, (unsigned long long)b.size);
+	differences++;
+    }
+    return differences;
+}
+
+
+/* mark_chain notes which clusters a chain uses, and returns TRUE if
+   any of them has a FAT entry that differs between the images */
+int mark_chain(struct image *img, uint16_t cluster, uint8_t *used)
+{
+    uint32_t steps = 0, limit = num_clusters(img->bpb);
+    int touched = FALSE;
+
+    while (is_valid_cluster(cluster, img->bpb) && cluster < limit
+	   && steps++ < limit)
+    {
+	used[cluster] = TRUE;
+	if (fat_changed[cluster])
+	    touched = TRUE;
+	cluster = get_fat_entry(cluster, img->buf, img->bpb);
+    }
+    return touched;
+}
+
+
+/* chains_equal follows the chain from cluster in both images */
+int chains_equal(uint16_t cluster)
+{
+    uint32_t steps = 0, limit = total_clusters;
+    uint16_t p = cluster, q = cluster;
+
+    while (p == q && is_valid_cluster(p, a.bpb) && p < limit
+	   && steps++ < limit)
+    {
+	p = get_fat_entry(p, a.buf, a.bpb);
+	q = get_fat_entry(q, b.buf, b.bpb);
+    }
+    return p == q || (is_end_of_file(p) && is_end_of_file(q));
+}
+
+
+uint8_t *file_cluster(struct image *img, uint8_t *data, uint16_t cluster)
+{
+    uint8_t *p = data + (uint32_t)(cluster - CLUST_FIRST) * clust_size;
+
+    return in_image(img, p, clust_size) ? p : NULL;
+}
+
+
+/* compare_data compares the data of a file as seen in each image,
+   following each chain, and returns how many clusters' worth differ.
+   If the chains are the same, clusters that the first pass found
+   unchanged aren't read.  With print, it lists the clusters that
+   differ. */
+uint32_t compare_data(struct diff_entry *x, struct diff_entry *y,
+		      int same_chain, int print)
+{
+    uint16_t p = x->start, q = y->start;
+    uint32_t left = x->size < y->size ? x->size : y->size;
+    uint32_t offset = 0, len, differ = 0;
+    uint8_t *dp, *dq;
+    uint32_t limit = total_clusters;
+
+    while (left > 0)
+    {
+	if (!is_valid_cluster(p, a.bpb) || !is_valid_cluster(q, b.bpb)
+	    || p >= limit || q >= limit)
+	{
+	    differ++;
+	    break;
+	}
+	len = left < clust_size ? left : clust_size;
+	if (!same_chain || !same_geometry || cluster_changed[p])
+	{
+	    dp = file_cluster(&a, data_a, p);
+	    dq = file_cluster(&b, data_b, q);
+	    if (dp == NULL || dq == NULL || !same_bytes(dp, dq, len))
+	    {
+		differ++;
+		if (print && dp != NULL && dq != NULL)
+		    printf("    offset %u: cluster %d crc32c %08x, cluster %d crc32c %08x\n",
+			   offset, p, crc32c(0, dp, len), q, crc32c(0, dq, len));
+	    }
+	}
+	left -= len;
+	offset += len;
+	p = get_fat_entry(p, a.buf, a.bpb);
+	q = get_fat_entry(q, b.buf, b.bpb);
+    }
+    return differ;
+}
+
+
+void describe(char *what, struct diff_entry *e)
+{
+    if (e->is_dir)
+	printf("%-8s %s (directory)\n", what, e->path);
+    else
+	printf("%-8s %s (%u bytes)\n", what, e->path, e->size);
+}
+
+
+/* compare_files merges the two sorted trees, and returns the number of
+   paths that differ */
+int compare_files(void)
+{
+    struct diff_entry *x, *y;
+    char details[200];
+    int i = 0, j = 0, cmp, differences = 0, chain_touched, same_chain;
+    uint32_t differ;
+
+    while (i < a.nentries || j < b.nentries)
+    {
+	x = i < a.nentries ? &a.entries[i] : NULL;
+	y = j < b.nentries ? &b.entries[j] : NULL;
+	cmp = x == NULL ? 1 : y == NULL ? -1 : strcmp(x->path, y->path);
+	if (cmp < 0)
+	{
+	    describe("removed", x);
+	    mark_chain(&a, x->start, in_a_file);
+	    differences++;
+	    i++;
+	    continue;
+	}
+	if (cmp > 0)
+	{
+	    describe("added", y);
+	    mark_chain(&b, y->start, in_b_file);
+	    differences++;
+	    j++;
+	    continue;
+	}
+	i++;
+	j++;
+
+	differ = 0;
+	chain_touched = mark_chain(&a, x->start, in_a_file);
+	chain_touched |= mark_chain(&b, y->start, in_b_file);
+	if (x->is_dir != y->is_dir)
+	{
+	    describe("removed", x);
+	    describe("added", y);
+	    differences++;
+	    continue;
+	}
+
+	details[0] = '\0';
+	if (x->size != y->size)
+	    sprintf(details + strlen(details), ", size %u -> %u", x->size, y->size);
+	same_chain = same_geometry && x->start == y->start
+	    && (!chain_touched || chains_equal(x->start));
+	if (!same_chain)
+	    strcat(details, ", chain changed");
+	if (x->attributes != y->attributes)
+	    sprintf(details + strlen(details), ", attributes %02x -> %02x",
+		    x->attributes, y->attributes);
+	if (x->mtime != y->mtime)
+	    strcat(details, ", time changed");
+	if (!x->is_dir)
+	{
+	    differ = compare_data(x, y, same_chain, FALSE);
+	    if (differ > 0)
+		sprintf(details + strlen(details), ", %u clusters of data differ",
+			differ);
+	    else if (!same_chain)
+		strcat(details, ", data the same");
+	}
+	if (details[0] == '\0')
+	    continue;
+
+	printf("changed  %s: %s\n", x->path, details + 2);
+	if (verbose && differ > 0)
+	    compare_data(x, y, same_chain, TRUE);
+	differences++;
+    }
+    return differences;
+}
+
+
+int main(int argc, char** argv)
+{
+    char *names[2];
+    int nnames = 0, differences, loose = 0, i;
+    uint16_t c;
+
+    stats_option(&argc, argv);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-v") == 0)
+	    verbose = TRUE;
+	else if (argv[i][0] == '-' || nnames == 2)
+	    usage(argv[0]);
+	else
+	    names[nnames++] = argv[i];
+    }
+    if (nnames != 2)
+    {
+	usage(argv[0]);
+    }
+
+    checksum_init();
+    stats_phase(PHASE_OPEN);
+    open_image(&a, names[0]);
+    open_image(&b, names[1]);
+
+    same_geometry = check_geometry();
+    clust_size = a.bpb->bpbBytesPerSec * a.bpb->bpbSecPerClust;
+    fat_size = a.bpb->bpbFATsecs * a.bpb->bpbBytesPerSec;
+    total_clusters = num_clusters(a.bpb);
+    if (num_clusters(b.bpb) > total_clusters)
+	total_clusters = num_clusters(b.bpb);
+    data_a = root_dir_addr(a.buf, a.bpb)
+	+ a.bpb->bpbRootDirEnts * sizeof(struct direntry);
+    data_b = root_dir_addr(b.buf, b.bpb)
+	+ b.bpb->bpbRootDirEnts * sizeof(struct direntry);
+    cluster_changed = calloc(total_clusters, 1);
+    fat_changed = calloc(total_clusters, 1);
+    in_a_file = calloc(total_clusters, 1);
+    in_b_file = calloc(total_clusters, 1);
+
+    printf("--- %s\n+++ %s\n", a.name, b.name);
+    stats_phase(PHASE_DATA);
+    if (same_geometry)
+	differences = scan();
+    else
+    {
+	/* nothing lines up, so every chain counts as changed and every
+	   file's data is compared */
+	printf("geometry differs: the images can only be compared file by file\n");
+	memset(fat_changed, TRUE, total_clusters);
+	differences = 1;
+    }
+
+    stats_phase(PHASE_TRAVERSE);
+    collect(&a, MSDOSFSROOT, "");
+    collect(&b, MSDOSFSROOT, "");
+    qsort(a.entries, a.nentries, sizeof(struct diff_entry), compare_entries);
+    qsort(b.entries, b.nentries, sizeof(struct diff_entry), compare_entries);
+    differences += compare_files();
+
+    if (same_geometry)
+    {
+	for (c = CLUST_FIRST; c < total_clusters; c++)
+	    if (cluster_changed[c] && !in_a_file[c] && !in_b_file[c])
+		loose++;
+	if (loose > 0)
+	    printf("%d changed clusters belong to no file in either image\n",
+		   loose);
+    }
+
+    free(cluster_changed);
+    free(fat_changed);
+    free(in_a_file);
+    free(in_b_file);
+    free(a.entries);
+    free(b.entries);
+    close_image(&a);
+    close_image(&b);
+
+    return differences > 0 ? 1 : 0;
+}
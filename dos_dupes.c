@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "checksum.h"
+
+
+/* dos_dupes measures how much of an image is taken up by copies: data
+   clusters with the same contents as another cluster, and files with
+   the same contents as another file.  It changes nothing.
+
+   Every allocated cluster is hashed in one pass over the data area,
+   front to back, split into as many contiguous stretches as there are
+   threads.  Clusters are then sorted by hash, and clusters whose hashes
+   match are compared byte for byte, so a hash collision can't make two
+   clusters look the same.  Each cluster ends up knowing the first
+   cluster with its contents, and two files are the same if they're the
+   same size and their clusters have the same first clusters, apart
+   from the bytes past the end of the file in the last one. */
+
+#define MAXTHREADS 64
+
+struct dup_file {
+    char path[MAXPATHLEN+1];
+    uint16_t start;
+    uint32_t size;
+    uint16_t *clusters;		/* the chain, in order */
+    uint32_t nclusters;
+};
+
+struct dup_file *files = NULL;
+int nfiles = 0, maxfiles = 0;
+
+uint8_t *data_area;
+uint32_t clust_size;
+uint16_t total_clusters;
+
+uint8_t *allocated;		/* per cluster: in use by something */
+uint32_t *hashes;		/* per cluster */
+uint16_t *same_as;		/* per cluster: first cluster like it */
+
+struct stretch {
+    uint16_t first, end;
+};
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--map=...] [--overlay=FILE] [--stats] [-j threads] [-n groups] <imagename>\n", progname);
+    fprintf(stderr, "\treports duplicated clusters and files, and the space they take\n");
+    fprintf(stderr, "\t-j: how many threads to hash with (default: one per processor)\n");
+    fprintf(stderr, "\t-n: how many groups of identical files to list, biggest first\n\t\t(default 10, 0 for all of them)\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+uint8_t *cluster_data(uint16_t cluster)
+{
+    return data_area + (uint32_t)(cluster - CLUST_FIRST) * clust_size;
+}
+
+
+void collect(uint16_t dir_cluster, char *prefix,
+	     uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    char name[MAXFILENAME], path[MAXPATHLEN+1];
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    struct dup_file *f;
+
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    dirent_filename(dirent, name);
+	    if (snprintf(path, sizeof(path), "%s%s", prefix, name)
+		>= (int)sizeof(path) - 1)
+	    {
+		fprintf(stderr, "Skipping %s%s: path too long\n", prefix, name);
+		continue;
+	    }
+	    if (dirent->deAttributes & ATTR_DIRECTORY)
+	    {
+		strcat(path, "/");
+		collect(getushort(dirent->deStartCluster), path, image_buf, bpb);
+		continue;
+	    }
+
+	    if (nfiles == maxfiles)
+	    {
+		maxfiles = maxfiles ? maxfiles * 2 : 64;
+		files = realloc(files, maxfiles * sizeof(struct dup_file));
+	    }
+	    f = &files[nfiles++];
+	    memset(f, 0, sizeof(*f));
+	    strcpy(f->path, path);
+	    f->start = getushort(dirent->deStartCluster);
+	    f->size = getulong(dirent->deFileSize);
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+/* read_chains fills in each file's clusters.  A file whose chain is
+   shorter than its size, or runs into a cluster that isn't allocated,
+   is left out of the file comparison. */
+void read_chains(uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct extent *extents;
+    uint32_t want, n;
+    int i, j, k, nextents;
+
+    for (i = 0; i < nfiles; i++)
+    {
+	struct dup_file *f = &files[i];
+
+	if (f->size == 0)
+	    continue;
+	want = (f->size + clust_size - 1) / clust_size;
+	nextents = get_extents(f->start, &extents, image_buf, bpb);
+	f->clusters = malloc(want * sizeof(uint16_t));
+	n = 0;
+	for (j = 0; j < nextents && n < want; j++)
+	    for (k = 0; k < extents[j].count && n < want; k++)
+		f->clusters[n++] = extents[j].start + k;
+	free(extents);
+	for (j = 0; j < (int)n; j++)
+	    if (f->clusters[j] >= total_clusters || !allocated[f->clusters[j]])
+		break;
+	if (n < want || j < (int)n)
+	{
+	    fprintf(stderr, "%s: chain is broken, not comparing it\n", f->path);
+	    continue;
+	}
+	f->nclusters = n;
+    }
+}
+
+
+void *hash_stretch(void *arg)
+{
+    struct stretch *s = arg;
+    uint32_t c;
+
+    for (c = s->first; c < s->end; c++)
+	if (allocated[c])
+	    hashes[c] = crc32c(0, cluster_data(c), clust_size);
+    return NULL;
+}
+
+
+/* hash_clusters splits the data area into one stretch per thread */
+void hash_clusters(int nthreads)
+{
+    pthread_t threads[MAXTHREADS];
+    struct stretch stretches[MAXTHREADS];
+    int started[MAXTHREADS];
+    uint32_t first = CLUST_FIRST, span = total_clusters - CLUST_FIRST;
+    int i;
+
+    for (i = 0; i < nthreads; i++)
+    {
+	stretches[i].first = first + span * i / nthreads;
+	stretches[i].end = first + span * (i + 1) / nthreads;
+	started[i] = pthread_create(&threads[i], NULL, hash_stretch,
+				    &stretches[i]) == 0;
+	if (!started[i])
+	    hash_stretch(&stretches[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+	if (started[i])
+	    pthread_join(threads[i], NULL);
+}
+
+
+int compare_hashes(const void *a, const void *b)
+{
+    uint16_t x = *(const uint16_t*)a, y = *(const uint16_t*)b;
+
+    if (hashes[x] != hashes[y])
+	return hashes[x] < hashes[y] ? -1 : 1;
+    return (int)x - (int)y;
+}
+
+
+/* group_clusters sets same_as[] for every allocated cluster.  order
+   holds the allocated clusters, n of them. */
+void group_clusters(uint16_t *order, uint32_t n)
+{
+    uint32_t i, j, k, leader;
+    uint16_t c, other;
+
+    qsort(order, n, sizeof(uint16_t), compare_hashes);
+    for (i = 0; i < n; i = j)
+    {
+	for (j = i + 1; j < n && hashes[order[j]] == hashes[order[i]]; j++)
+	    ;
+	/* order[i..j) share a hash; each is like the first of them it
+	   matches byte for byte, which nearly always is order[i] */
+	for (k = i; k < j; k++)
+	{
+	    c = order[k];
+	    same_as[c] = c;
+	    for (leader = 0; leader < k - i; leader++)
+	    {
+		other = order[i + leader];
+		if (same_as[other] == other
+		    && memcmp(cluster_data(c), cluster_data(other), clust_size) == 0)
+		{
+		    same_as[c] = other;
+		    break;
+		}
+	    }
+	}
+    }
+}
+
+
+int compare_files(const void *a, const void *b)
+{
+    const struct dup_file *x = *(struct dup_file * const *)a;
+    const struct dup_file *y = *(struct dup_file * const *)b;
+    uint32_t i, tail;
+
+    if (x->size != y->size)
+	return x->size < y->size ? -1 : 1;
+    /* the last cluster only up to the end of the file */
+    for (i = 0; i + 1 < x->nclusters; i++)
+	if (same_as[x->clusters[i]] != same_as[y->clusters[i]])
+	    return same_as[x->clusters[i]] < same_as[y->clusters[i]] ? -1 : 1;
+    tail = x->size - (x->nclusters - 1) * clust_size;
+    return memcmp(cluster_data(x->clusters[i]), cluster_data(y->clusters[i]),
+		  tail);
+}
+
+
+struct file_group {
+    struct dup_file **first;
+    int n;
+    uint64_t reclaimable;
+};
+
+
+int compare_groups(const void *a, const void *b)
+{
+    const struct file_group *x = a, *y = b;
+
+    if (x->reclaimable != y->reclaimable)
+	return x->reclaimable > y->reclaimable ? -1 : 1;
+    return strcmp(x->first[0]->path, y->first[0]->path);
+}
+
+
+void report_files(int show)
+{
+    struct dup_file **order = malloc((nfiles + 1) * sizeof(struct dup_file*));
+    struct file_group *groups = NULL;
+    int n = 0, ngroups = 0, dup_files = 0, i, j, k;
+    uint64_t data_bytes = 0, cluster_bytes = 0;
+
+    for (i = 0; i < nfiles; i++)
+	if (files[i].nclusters > 0)
+	    order[n++] = &files[i];
+    qsort(order, n, sizeof(struct dup_file*), compare_files);
+
+    for (i = 0; i < n; i = j)
+    {
+	for (j = i + 1; j < n && compare_files(&order[i], &order[j]) == 0; j++)
+	    ;
+	if (j - i < 2)
+	    continue;
+	groups = realloc(groups, (ngroups + 1) * sizeof(struct file_group));
+	groups[ngroups].first = &order[i];
+	groups[ngroups].n = j - i;
+	groups[ngroups].reclaimable = (uint64_t)(j - i - 1)
+	    * order[i]->nclusters * clust_size;
+	ngroups++;
+	dup_files += j - i - 1;
+	data_bytes += (uint64_t)(j - i - 1) * order[i]->size;
+	cluster_bytes += groups[ngroups-1].reclaimable;
+    }
+
+    printf("files: %d with data, %d groups of identical files hold %d extra copies\n",
+	   n, ngroups, dup_files);
+    printf("       %llu bytes of file data, %llu bytes of clusters reclaimable by keeping one copy\n",
+	   (unsigned long long)data_bytes, (unsigned long long)cluster_bytes);
+
+    qsort(groups, ngroups, sizeof(struct file_group), compare_groups);
+    if (show == 0 || show > ngroups)
+	show = ngroups;
+    for (i = 0; i < show; i++)
+    {
+	printf("\n%d copies of %u bytes (%llu bytes reclaimable):\n",
+	       groups[i].n, groups[i].first[0]->size,
+	       (unsigned long long)groups[i].reclaimable);
+	for (k = 0; k < groups[i].n; k++)
+	    printf("    %s\n", groups[i].first[k]->path);
+    }
+    if (show < ngroups)
+	printf("\n(%d more groups not shown)\n", ngroups - show);
+
+    free(groups);
+    free(order);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    char *image = NULL;
+    int nthreads = 0, show = 10, i;
+    uint16_t *order;
+    uint32_t c, nallocated = 0, distinct = 0, groups = 0, zero_dups = 0;
+    uint32_t *group_size;
+    uint16_t entry;
+    uint8_t *zeros;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+	{
+	    nthreads = atoi(argv[++i]);
+	    if (nthreads < 1)
+		usage(argv[0]);
+	}
+	else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+	{
+	    show = atoi(argv[++i]);
+	    if (show < 0)
+		usage(argv[0]);
+	}
+	else if (argv[i][0] == '-' || image != NULL)
+	    usage(argv[0]);
+	else
+	    image = argv[i];
+    }
+    if (image == NULL)
+    {
+	usage(argv[0]);
+    }
+    if (nthreads == 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > MAXTHREADS)
+	nthreads = MAXTHREADS;
+
+    checksum_init();
+
+    image_buf = mmap_file(image, &fd);
+    bpb = check_bootsector(image_buf);
+    clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    data_area = root_dir_addr(image_buf, bpb)
+	+ bpb->bpbRootDirEnts * sizeof(struct direntry);
+    total_clusters = num_clusters(bpb);
+
+    allocated = calloc(total_clusters, 1);
+    hashes = calloc(total_clusters, sizeof(uint32_t));
+    same_as = calloc(total_clusters, sizeof(uint16_t));
+    order = malloc(total_clusters * sizeof(uint16_t));
+    for (c = CLUST_FIRST; c < total_clusters; c++)
+    {
+	entry = get_fat_entry(c, image_buf, bpb);
+	if (entry != CLUST_FREE && entry != (FAT12_MASK & CLUST_BAD))
+	{
+	    allocated[c] = TRUE;
+	    order[nallocated++] = c;
+	}
+    }
+    collect(MSDOSFSROOT, "", image_buf, bpb);
+    read_chains(image_buf, bpb);
+
+    stats_phase(PHASE_DATA);
+    madvise(image_buf, cluster_data(total_clusters) - image_buf,
+	    MADV_SEQUENTIAL);
+    if (nthreads > (int)(total_clusters - CLUST_FIRST))
+	nthreads = 1;
+    hash_clusters(nthreads);
+    dos_stats.clusters_touched += nallocated;
+    group_clusters(order, nallocated);
+
+    /* how many of each contents there are */
+    group_size = calloc(total_clusters, sizeof(uint32_t));
+    zeros = calloc(1, clust_size);
+    for (i = 0; i < (int)nallocated; i++)
+	group_size[same_as[order[i]]]++;
+    for (c = CLUST_FIRST; c < total_clusters; c++)
+    {
+	if (group_size[c] == 0)
+	    continue;
+	distinct++;
+	if (group_size[c] > 1)
+	{
+	    groups++;
+	    if (memcmp(cluster_data(c), zeros, clust_size) == 0)
+		zero_dups = group_size[c] - 1;
+	}
+    }
+
+    printf("%s: %u clusters of %u bytes, %u allocated\n", image,
+	   total_clusters - CLUST_FIRST, clust_size, nallocated);
+    printf("clusters: %u distinct, %u groups of identical clusters hold %u extra copies\n",
+	   distinct, groups, nallocated - distinct);
+    printf("          %llu bytes reclaimable by sharing clusters, %llu of them zero-filled\n",
+	   (unsigned long long)(nallocated - distinct) * clust_size,
+	   (unsigned long long)zero_dups * clust_size);
+    report_files(show);
+
+    for (i = 0; i < nfiles; i++)
+	free(files[i].clusters);
+    free(files);
+    free(group_size);
+    free(zeros);
+    free(order);
+    free(same_as);
+    free(hashes);
+    free(allocated);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    return 0;
+}
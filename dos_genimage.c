@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_genimage makes synthetic disk images for benchmarking: a fresh
+   volume filled with a tree of directories and files of random size
+   and content.  Everything comes from one seed, so the same options
+   always give the same image.
+
+   Fragmentation is the percentage of clusters that are put somewhere
+   random instead of straight after the previous cluster of the file;
+   0 lays every file out in one run. */
+
+uint32_t dir_clusters[4096];
+int dir_depth[4096];
+int ndirs = 0;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-s size] [-n files] [-d depth] [-f fragmentation%%] [-m maxfilesize] [-S seed] <imagename>\n", progname);
+    fprintf(stderr, "\tcreates a disk image full of generated files, for benchmarks\n");
+    fprintf(stderr, "\tdefaults: -s 16M -n 500 -d 3 -f 0 -m 64K -S 1\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* parse_size understands plain byte counts and K/M suffixes */
+uint32_t parse_size(char *arg, char *progname)
+{
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+    {
+	v *= 1024;
+	end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+	v *= 1024 * 1024;
+	end++;
+    }
+    if (end == arg || *end != '\0' || v > UINT32_MAX)
+	usage(progname);
+    return v;
+}
+
+
+/* make_tree creates about one directory per 20 files, each under a
+   random directory that isn't already at the maximum depth */
+void make_tree(int nfiles, int depth, uint8_t *image_buf, struct bpb33* bpb)
+{
+    int want = (depth > 0) ? nfiles / 20 + 1 : 0;
+    char name[MAXFILENAME];
+    struct direntry *dirent;
+    int parent;
+
+    dir_clusters[0] = MSDOSFSROOT;
+    dir_depth[0] = 0;
+    ndirs = 1;
+
+    while (ndirs <= want && ndirs < 4096)
+    {
+	do
+	    parent = random() % ndirs;
+	while (dir_depth[parent] >= depth);
+
+	sprintf(name, "D%04d", ndirs);
+	dirent = make_dir(dir_clusters[parent], name, image_buf, bpb);
+	if (dirent == NULL)
+	{
+	    fprintf(stderr, "No more space in filesystem for directories\n");
+	    exit(1);
+	}
+	dir_clusters[ndirs] = getushort(dirent->deStartCluster);
+	dir_depth[ndirs] = dir_depth[parent] + 1;
+	ndirs++;
+    }
+}
+
+
+/* next_cluster picks where the next cluster of a file goes: either
+   the first free cluster from the cursor, or with probability frag
+   percent a random free cluster.  Returns 0 when the disk is full. */
+uint16_t next_cluster(uint16_t *cursor, int frag,
+		      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb), c;
+    int tries;
+
+    if (frag > 0 && random() % 100 < frag)
+    {
+	for (tries = 0; tries < 64; tries++)
+	{
+	    c = CLUST_FIRST + random() % (total - CLUST_FIRST);
+	    if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+		return c;
+	}
+    }
+    for (c = *cursor; c < total; c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	{
+	    *cursor = c + 1;
+	    return c;
+	}
+    }
+    for (c = CLUST_FIRST; c < *cursor; c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    return c;
+    }
+    return 0;
+}
+
+
+/* make_file creates one file of size bytes in the given directory,
+   filled with bytes from the random generator */
+int make_file(uint16_t dir, char *name, uint32_t size, int frag,
+	      uint16_t *cursor, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t done, i;
+    uint16_t start = 0, prev = 0, c;
+    struct direntry *dirent;
+    uint8_t *p;
+
+    dirent = alloc_dirent(dir, image_buf, bpb);
+    if (dirent == NULL)
+	return -1;
+
+    for (done = 0; done < size; done += clust_size)
+    {
+	c = next_cluster(cursor, frag, image_buf, bpb);
+	if (c == 0)
+	{
+	    free_chain(start, image_buf, bpb);
+	    return -1;
+	}
+	set_fat_entry(c, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	if (prev != 0)
+	    set_fat_entry(prev, c, image_buf, bpb);
+	else
+	    start = c;
+	prev = c;
+
+	p = cluster_to_addr(c, image_buf, bpb);
+	for (i = 0; i < clust_size; i += sizeof(long))
+	    *(long *)(p + i) = random();
+	if (size - done < clust_size)
+	    memset(p + (size - done), 0, clust_size - (size - done));
+    }
+
+    fill_dirent(dirent, name, ATTR_ARCHIVE, start, size);
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    uint32_t size = 16 * 1024 * 1024, max_file = 64 * 1024;
+    int nfiles = 500, depth = 3, frag = 0, seed = 1;
+    uint16_t cursor = CLUST_FIRST;
+    uint64_t bytes = 0;
+    char *image = NULL, name[MAXFILENAME];
+    int i;
+
+    stats_option(&argc, argv);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+	    size = parse_size(argv[++i], argv[0]);
+	else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+	    nfiles = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+	    depth = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+	    frag = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+	    max_file = parse_size(argv[++i], argv[0]);
+	else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+	    seed = atoi(argv[++i]);
+	else if (argv[i][0] == '-' || image != NULL)
+	    usage(argv[0]);
+	else
+	    image = argv[i];
+    }
+    if (image == NULL || nfiles < 0 || nfiles > 99999 || depth < 0
+	|| frag < 0 || frag > 100 || max_file == 0)
+    {
+	usage(argv[0]);
+    }
+    srandom(seed);
+
+    fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Cannot create disk image file %s:\n%s\n",
+		image, strerror(errno));
+	exit(1);
+    }
+    if (format_volume(fd, size, 0, (size == 1440 * 1024) ? 224 : 512,
+		      "BENCH") < 0)
+	exit(1);
+    close(fd);
+
+    image_buf = mmap_file(image, &fd);
+    bpb = check_bootsector(image_buf);
+
+    make_tree(nfiles, depth, image_buf, bpb);
+    for (i = 0; i < nfiles; i++)
+    {
+	uint32_t file_size = random() % (max_file + 1);
+	int dir = random() % ndirs;
+
+	sprintf(name, "F%05d.DAT", i % 100000);
+	if (make_file(dir_clusters[dir], name, file_size, frag, &cursor,
+		      image_buf, bpb) < 0)
+	{
+	    fprintf(stderr, "The image filled up after %d files\n", i);
+	    break;
+	}
+	bytes += file_size;
+    }
+    sync_fat_copies(image_buf, bpb);
+
+    fprintf(stderr, "%s: %d directories, %d files, %llu bytes, %d%% fragmented\n",
+	    image, ndirs - 1, i, (unsigned long long)bytes, frag);
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return 0;
+}
@@ -130,7 +130,7 @@ void follow_dir(uint16_t cluster, int indent,
         int i = 0;
 		for ( ; i < numDirEntries; i++)
 		{
-		        
+			dos_stats.dirents_scanned++;
 			uint16_t followclust = print_dirent(dirent, indent);
 			if (followclust)
 			follow_dir(followclust, indent+1, image_buf, bpb);
@@ -150,6 +150,7 @@ void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
     int i = 0;
     for ( ; i < bpb->bpbRootDirEnts; i++)
     {
+        dos_stats.dirents_scanned++;
         uint16_t followclust = print_dirent(dirent, 0);
         if (is_valid_cluster(followclust, bpb))
             follow_dir(followclust, 1, image_buf, bpb);
@@ -161,7 +162,10 @@ void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--map=...] [--overlay=FILE] [--stats] <imagename>\n", progname);
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
     exit(1);
 }
 
@@ -171,6 +175,10 @@ int main(int argc, char** argv)
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
     if (argc != 2)
     {
 	usage(argv[0]);
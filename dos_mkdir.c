@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-p] [--sync=none|end|ordered] <imagename> a:<dirname>\n", progname);
+    fprintf(stderr, "\tcreates a directory in the disk image\n");
+    fprintf(stderr, "\t-p: create any missing parent directories too, and don't complain if it exists\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* mkdir_path creates the directory named by path.  With parents set,
+   every missing component is created on the way down; otherwise only
+   the last one may be missing. */
+void mkdir_path(char *path, int parents, uint8_t *image_buf, struct bpb33* bpb)
+{
+    char buf[MAXPATHLEN+1];
+    char *component, *next;
+    uint16_t cluster = MSDOSFSROOT;
+    struct direntry *dirent;
+
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    component = buf;
+
+    while (1)
+    {
+	while (*component == '/' || *component == '\\')
+	    component++;
+	if (*component == '\0')
+	    return;
+
+	next = component + strcspn(component, "/\\");
+	if (*next != '\0')
+	    *next++ = '\0';
+	while (*next == '/' || *next == '\\')
+	    next++;
+
+	dirent = lookup_dirent(cluster, component, image_buf, bpb);
+	if (dirent != NULL)
+	{
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    {
+		fprintf(stderr, "%s is not a directory\n", component);
+		exit(1);
+	    }
+	    if (*next == '\0' && !parents)
+	    {
+		fprintf(stderr, "Directory %s already exists\n", path);
+		exit(1);
+	    }
+	}
+	else if (*next != '\0' && !parents)
+	{
+	    fprintf(stderr, "Directory %s does not exist in the disk image\n",
+		    component);
+	    exit(1);
+	}
+	else
+	{
+	    dirent = make_dir(cluster, component, image_buf, bpb);
+	    if (dirent == NULL)
+	    {
+		fprintf(stderr, "No more space in filesystem for %s\n",
+			component);
+		exit(1);
+	    }
+	}
+
+	cluster = getushort(dirent->deStartCluster);
+	component = next;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    int parents = FALSE, sync_policy = SYNC_NONE;
+    char *args[2];
+    int nargs = 0, i;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-p") == 0)
+	    parents = TRUE;
+	else if (strncmp(argv[i], "--sync=", 7) == 0)
+	{
+	    sync_policy = parse_sync_policy(argv[i] + 7);
+	    if (sync_policy < 0)
+		usage(argv[0]);
+	}
+	else if (argv[i][0] == '-' || nargs == 2)
+	    usage(argv[0]);
+	else
+	    args[nargs++] = argv[i];
+    }
+    if (nargs != 2)
+    {
+	usage(argv[0]);
+    }
+
+    /* the "a:" is optional here - there's only one side to name */
+    if (strncmp("a:", args[1], 2) == 0)
+	args[1] += 2;
+
+    image_buf = mmap_file(args[0], &fd);
+    bpb = check_bootsector(image_buf);
+
+    mkdir_path(args[1], parents, image_buf, bpb);
+    sync_fat_copies(image_buf, bpb);
+
+    if (flush_dirty(image_buf, sync_policy) < 0)
+    {
+	fprintf(stderr, "Failed to flush changes to the disk image\n");
+	exit(1);
+    }
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-c sectors-per-cluster] [-r root-entries] [-L label] <imagename> <size>\n", progname);
+    fprintf(stderr, "\tcreates an empty FAT-12 disk image of the given size\n");
+    fprintf(stderr, "\tsize is in bytes, or with a K or M suffix (1440K is a 1.44MB floppy)\n");
+    fprintf(stderr, "\t-c: cluster size in sectors (default: the smallest that fits)\n");
+    fprintf(stderr, "\t-r: root directory entries (default 224 for a floppy, 512 otherwise)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* parse_size understands plain byte counts and K/M suffixes */
+uint32_t parse_size(char *arg, char *progname)
+{
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+    {
+	v *= 1024;
+	end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+	v *= 1024 * 1024;
+	end++;
+    }
+    if (end == arg || *end != '\0' || v > UINT32_MAX)
+	usage(progname);
+    return v;
+}
+
+
+int main(int argc, char** argv)
+{
+    int fd, i, nargs = 0, created;
+    int sec_per_clust = 0, root_entries = 0;
+    char *label = NULL;
+    char *args[2];
+    uint32_t size;
+
+    stats_option(&argc, argv);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+	    sec_per_clust = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+	    root_entries = atoi(argv[++i]);
+	else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+	    label = argv[++i];
+	else if (argv[i][0] == '-' || nargs == 2)
+	    usage(argv[0]);
+	else
+	    args[nargs++] = argv[i];
+    }
+    if (nargs != 2 || sec_per_clust < 0)
+    {
+	usage(argv[0]);
+    }
+
+    size = parse_size(args[1], argv[0]);
+    if (root_entries == 0)
+	root_entries = (size == 1440 * 1024) ? 224 : 512;
+
+    /* remember whether the file is ours, so a failure doesn't leave an
+       empty one behind */
+    fd = open(args[0], O_RDWR | O_CREAT | O_EXCL, 0644);
+    created = fd >= 0;
+    if (fd < 0 && errno == EEXIST)
+	fd = open(args[0], O_RDWR);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Cannot create disk image file %s:\n%s\n",
+		args[0], strerror(errno));
+	exit(1);
+    }
+
+    if (format_volume(fd, size, sec_per_clust, root_entries, label) < 0)
+    {
+	close(fd);
+	if (created)
+	    unlink(args[0]);
+	exit(1);
+    }
+
+    close(fd);
+    return 0;
+}
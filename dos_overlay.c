@@ -0,0 +1,250 @@
+#define _GNU_SOURCE		/* copy_file_range() */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_overlay deals with the overlay files the tools keep their
+   changes in when given --overlay=FILE: it can fold one into a new
+   image, throw one away, or say what's in one. */
+
+#define COPY_CHUNK (1024 * 1024)
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s commit <imagename> <overlay> <newimage>\n", progname);
+    fprintf(stderr, "\twrites a new image: imagename with the overlay's changes in it\n");
+    fprintf(stderr, "\tonly imagename's reserved sectors, FATs and root directory are\n");
+    fprintf(stderr, "\t\tchecked against the overlay; a changed mtime is only warned about\n");
+    fprintf(stderr, "       %s discard <overlay>\n", progname);
+    fprintf(stderr, "\tthrows the overlay's changes away\n");
+    fprintf(stderr, "       %s info <overlay>\n", progname);
+    fprintf(stderr, "\tsays how much the overlay holds\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+int open_overlay(char *name, struct overlay_header *h, uint8_t **bitmap)
+{
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0)
+    {
+	fprintf(stderr, "Cannot open overlay %s: %s\n", name, strerror(errno));
+	exit(1);
+    }
+    if (read_overlay(fd, h, bitmap) < 0)
+    {
+	fprintf(stderr, "%s is not an overlay file\n", name);
+	exit(1);
+    }
+    return fd;
+}
+
+
+uint32_t count_held(struct overlay_header *h, uint8_t *bitmap)
+{
+    uint32_t s, n = 0;
+
+    for (s = 0; s < h->nsectors; s++)
+	if (bitmap[s / 8] & (1 << (s % 8)))
+	    n++;
+    return n;
+}
+
+
+/* copy copies len bytes at offset from one file to the same place in
+   another, in the kernel where it can */
+int copy(int from, int to, uint64_t offset, uint64_t len, uint8_t *buf)
+{
+    loff_t in = offset, out = offset;
+    ssize_t bytes, done;
+    size_t n;
+
+    while (len > 0)
+    {
+	n = len < COPY_CHUNK ? len : COPY_CHUNK;
+	bytes = copy_file_range(from, &in, to, &out, n, 0);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+			  || errno == EOPNOTSUPP))
+	{
+	    bytes = pread(from, buf, n, in);
+	    if (bytes > 0)
+	    {
+		for (done = 0; done < bytes; )
+		{
+		    ssize_t w = pwrite(to, buf + done, bytes - done, out + done);
+		    if (w < 0 && errno == EINTR)
+			continue;
+		    if (w <= 0)
+			return -1;
+		    done += w;
+		}
+		in += bytes;
+		out += bytes;
+	    }
+	}
+	if (bytes < 0)
+	    return -1;
+	if (bytes == 0)
+	{
+	    errno = EIO;	/* the file got shorter */
+	    return -1;
+	}
+	dos_stats.bytes_in += bytes;
+	dos_stats.bytes_out += bytes;
+	len -= bytes;
+    }
+    return 0;
+}
+
+
+void commit(char *image, char *overlay_name, char *new_image)
+{
+    struct overlay_header h;
+    struct stat statbuf;
+    uint8_t *bitmap, *buf, *start;
+    uint32_t s, run, held = 0;
+    uint64_t offset, len;
+    int image_fd, overlay_fd, out_fd;
+
+    overlay_fd = open_overlay(overlay_name, &h, &bitmap);
+    image_fd = open(image, O_RDONLY);
+    if (image_fd < 0 || fstat(image_fd, &statbuf) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", image,
+		strerror(errno));
+	exit(1);
+    }
+    /* the image's start up to its data area, which the overlay knows */
+    len = h.base_len > OVERLAY_SECTOR ? h.base_len : OVERLAY_SECTOR;
+    start = calloc(len, 1);
+    if (pread(image_fd, start, len, 0) < 0
+	|| !overlay_matches(&h, start, statbuf.st_size))
+    {
+	fprintf(stderr, "Overlay %s was made over a different image than %s\n",
+		overlay_name, image);
+	exit(1);
+    }
+    free(start);
+    overlay_check_mtime(&h, &statbuf, image, overlay_name);
+
+    out_fd = open(new_image, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (out_fd < 0)
+    {
+	fprintf(stderr, "Cannot make %s: %s\n", new_image, strerror(errno));
+	exit(1);
+    }
+    buf = malloc(COPY_CHUNK);
+
+    /* the image as it is, then the overlay's sectors over it, a run at
+       a time */
+    stats_phase(PHASE_DATA);
+    if (copy(image_fd, out_fd, 0, statbuf.st_size, buf) < 0)
+	goto failed;
+    for (s = 0; s < h.nsectors; s += run)
+    {
+	if (!(bitmap[s / 8] & (1 << (s % 8))))
+	{
+	    run = 1;
+	    continue;
+	}
+	for (run = 1; s + run < h.nsectors && run < COPY_CHUNK / OVERLAY_SECTOR
+		 && (bitmap[(s + run) / 8] & (1 << ((s + run) % 8))); run++)
+	    ;
+	offset = (uint64_t)s * OVERLAY_SECTOR;
+	len = (uint64_t)run * OVERLAY_SECTOR;
+	if (offset + len > h.base_size)
+	    len = h.base_size - offset;
+	if (pread(overlay_fd, buf, len, h.data_offset + offset) != (ssize_t)len
+	    || pwrite(out_fd, buf, len, offset) != (ssize_t)len)
+	    goto failed;
+	dos_stats.bytes_in += len;
+	dos_stats.bytes_out += len;
+	held += run;
+    }
+    stats_phase(PHASE_FLUSH);
+    if (fsync(out_fd) < 0 || close(out_fd) < 0)
+	goto failed;
+
+    printf("Wrote %s: %s with %u changed sectors from %s\n", new_image,
+	   image, held, overlay_name);
+    free(buf);
+    free(bitmap);
+    close(image_fd);
+    close(overlay_fd);
+    return;
+
+failed:
+    fprintf(stderr, "Failed to write %s: %s\n", new_image, strerror(errno));
+    unlink(new_image);
+    exit(1);
+}
+
+
+void discard(char *overlay_name)
+{
+    struct overlay_header h;
+    uint8_t *bitmap;
+
+    /* make sure it's an overlay before removing it */
+    close(open_overlay(overlay_name, &h, &bitmap));
+    if (unlink(overlay_name) < 0)
+    {
+	fprintf(stderr, "Cannot remove %s: %s\n", overlay_name, strerror(errno));
+	exit(1);
+    }
+    printf("Discarded %u changed sectors\n", count_held(&h, bitmap));
+    free(bitmap);
+}
+
+
+void info(char *overlay_name)
+{
+    struct overlay_header h;
+    struct stat statbuf;
+    uint8_t *bitmap;
+    uint32_t held;
+    int fd;
+
+    fd = open_overlay(overlay_name, &h, &bitmap);
+    fstat(fd, &statbuf);
+    held = count_held(&h, bitmap);
+    printf("%s: over a %llu byte image\n", overlay_name,
+	   (unsigned long long)h.base_size);
+    printf("%u of %u sectors changed (%llu bytes)\n", held, h.nsectors,
+	   (unsigned long long)held * OVERLAY_SECTOR);
+    printf("%llu bytes on disk\n", (unsigned long long)statbuf.st_blocks * 512);
+    free(bitmap);
+    close(fd);
+}
+
+
+int main(int argc, char** argv)
+{
+    stats_option(&argc, argv);
+    if (argc == 5 && strcmp(argv[1], "commit") == 0)
+	commit(argv[2], argv[3], argv[4]);
+    else if (argc == 3 && strcmp(argv[1], "discard") == 0)
+	discard(argv[2]);
+    else if (argc == 3 && strcmp(argv[1], "info") == 0)
+	info(argv[2]);
+    else
+	usage(argv[0]);
+    return 0;
+}
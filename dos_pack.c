@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_pack works in two passes.  The plan pass walks the host tree,
+   converts names, and assigns every directory and file its clusters
+   in path order, so that each chain is contiguous and the chains
+   follow each other across the disk.  The write pass then fills in
+   the image in that same order, so the data area is written front to
+   back in one stream. */
+
+struct node {
+    char hostpath[MAXPATHLEN+1];
+    struct direntry entry;	/* the entry we'll write in the parent */
+    int is_dir;
+    uint32_t size;
+    time_t mtime;
+    uint32_t nclusters;
+    int nextents;
+    struct extent *extents;
+    struct node *children;
+    int nchildren;
+};
+
+/* the next cluster the planner will hand out */
+uint16_t cursor = CLUST_FIRST;
+uint32_t planned_files = 0, planned_dirs = 0, planned_clusters = 0;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--sync=none|end|ordered] <imagename> <directory>\n", progname);
+    fprintf(stderr, "\tcopies the whole directory tree into the root of the disk image;\n\t\tsymbolic links are skipped\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/* take_clusters hands out the next count free clusters after the
+   cursor.  On an empty image they're always one contiguous run. */
+int take_clusters(uint32_t count, struct extent **extents,
+		  uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb);
+    struct extent *ext = NULL;
+    int n = 0, max = 0;
+
+    while (count > 0)
+    {
+	if (cursor >= total)
+	{
+	    fprintf(stderr, "Not enough space in the disk image\n");
+	    exit(1);
+	}
+	if (get_fat_entry(cursor, image_buf, bpb) != CLUST_FREE)
+	{
+	    cursor++;
+	    continue;
+	}
+	if (n > 0 && ext[n-1].start + ext[n-1].count == cursor)
+	{
+	    ext[n-1].count++;
+	}
+	else
+	{
+	    if (n == max)
+	    {
+		max = max ? max * 2 : 1;
+		ext = realloc(ext, max * sizeof(struct extent));
+	    }
+	    ext[n].start = cursor;
+	    ext[n].count = 1;
+	    n++;
+	}
+	cursor++;
+	count--;
+    }
+    *extents = ext;
+    return n;
+}
+
+
+/* plan_dir reads one host directory and lays it out: first the
+   directory's own clusters (sized for all its entries), then in name
+   order each file's data and each subdirectory's tree */
+void plan_dir(struct node *dir, int is_root, int root_slots,
+	      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    DIR *d;
+    struct dirent *de;
+    struct stat statbuf;
+    char **names = NULL;
+    int nnames = 0, maxnames = 0, i, j;
+
+    d = opendir(dir->hostpath);
+    if (d == NULL)
+    {
+	fprintf(stderr, "Cannot read directory %s: %s\n", dir->hostpath,
+		strerror(errno));
+	exit(1);
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	if (nnames == maxnames)
+	{
+	    maxnames = maxnames ? maxnames * 2 : 16;
+	    names = realloc(names, maxnames * sizeof(char *));
+	}
+	names[nnames++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, nnames, sizeof(char *), compare_names);
+
+    dir->children = calloc(nnames ? nnames : 1, sizeof(struct node));
+    dir->nchildren = 0;
+    for (i = 0; i < nnames; i++)
+    {
+	struct node *child = &dir->children[dir->nchildren];
+
+	if (snprintf(child->hostpath, sizeof(child->hostpath), "%s/%s",
+		     dir->hostpath, names[i]) >= (int)sizeof(child->hostpath))
+	{
+	    fprintf(stderr, "Skipping %s/%s: path too long\n", dir->hostpath,
+		    names[i]);
+	    continue;
+	}
+	/* lstat, so that a link back up the tree isn't followed forever */
+	if (lstat(child->hostpath, &statbuf) < 0)
+	{
+	    fprintf(stderr, "Skipping %s: %s\n", child->hostpath,
+		    strerror(errno));
+	    continue;
+	}
+	if (S_ISLNK(statbuf.st_mode))
+	{
+	    fprintf(stderr, "Skipping %s: symbolic link\n", child->hostpath);
+	    continue;
+	}
+	if (!S_ISREG(statbuf.st_mode) && !S_ISDIR(statbuf.st_mode))
+	{
+	    fprintf(stderr, "Skipping %s: not a file or directory\n",
+		    child->hostpath);
+	    continue;
+	}
+	if (statbuf.st_size > UINT32_MAX)
+	{
+	    fprintf(stderr, "Skipping %s: too large for FAT\n", child->hostpath);
+	    continue;
+	}
+
+	child->is_dir = S_ISDIR(statbuf.st_mode);
+	child->size = child->is_dir ? 0 : statbuf.st_size;
+	child->mtime = statbuf.st_mtime;
+	fill_dirent(&child->entry, names[i],
+		    child->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE, 0,
+		    child->size);
+
+	/* long names can collapse onto the same 8.3 name */
+	for (j = 0; j < dir->nchildren; j++)
+	{
+	    if (memcmp(dir->children[j].entry.deName, child->entry.deName, 11) == 0)
+		break;
+	}
+	if (j < dir->nchildren)
+	{
+	    fprintf(stderr, "Skipping %s: its 8.3 name clashes with %s\n",
+		    child->hostpath, dir->children[j].hostpath);
+	    continue;
+	}
+
+	/* the root directory may already have things in it */
+	if (is_root)
+	{
+	    struct direntry *dirent = (struct direntry*)root_dir_addr(image_buf, bpb);
+	    for (j = 0; j < bpb->bpbRootDirEnts; j++, dirent++)
+	    {
+		if (dirent->deName[0] != SLOT_DELETED &&
+		    memcmp(dirent->deName, child->entry.deName, 11) == 0)
+		    break;
+	    }
+	    if (j < bpb->bpbRootDirEnts)
+	    {
+		fprintf(stderr, "Skipping %s: already exists in the disk image\n",
+			child->hostpath);
+		continue;
+	    }
+	}
+	dir->nchildren++;
+    }
+    for (i = 0; i < nnames; i++)
+	free(names[i]);
+    free(names);
+
+    if (is_root && dir->nchildren > root_slots)
+    {
+	fprintf(stderr, "Too many entries for the root directory (%d, room for %d)\n",
+		dir->nchildren, root_slots);
+	exit(1);
+    }
+
+    if (!is_root)
+    {
+	/* enough room for every entry, plus "." and ".." */
+	uint32_t bytes = (dir->nchildren + 2) * sizeof(struct direntry);
+	dir->nclusters = (bytes + clust_size - 1) / clust_size;
+	dir->nextents = take_clusters(dir->nclusters, &dir->extents,
+				      image_buf, bpb);
+	putushort(dir->entry.deStartCluster, dir->extents[0].start);
+	planned_dirs++;
+	planned_clusters += dir->nclusters;
+    }
+
+    /* now lay out the children, in order */
+    for (i = 0; i < dir->nchildren; i++)
+    {
+	struct node *child = &dir->children[i];
+
+	if (child->is_dir)
+	{
+	    plan_dir(child, FALSE, 0, image_buf, bpb);
+	}
+	else
+	{
+	    child->nclusters = (child->size + clust_size - 1) / clust_size;
+	    child->nextents = take_clusters(child->nclusters, &child->extents,
+					    image_buf, bpb);
+	    if (child->nclusters > 0)
+		putushort(child->entry.deStartCluster, child->extents[0].start);
+	    planned_files++;
+	    planned_clusters += child->nclusters;
+	}
+    }
+}
+
+
+/* link_chain writes the FAT entries for a planned chain */
+void link_chain(struct node *n, uint8_t *image_buf, struct bpb33* bpb)
+{
+    int i;
+    uint16_t c;
+
+    for (i = 0; i < n->nextents; i++)
+    {
+	for (c = n->extents[i].start;
+	     c < n->extents[i].start + n->extents[i].count - 1; c++)
+	    set_fat_entry(c, c + 1, image_buf, bpb);
+	set_fat_entry(c, (i == n->nextents - 1) ? (FAT12_MASK & CLUST_EOFS)
+		      : n->extents[i+1].start, image_buf, bpb);
+    }
+}
+
+
+/* write_file copies a host file straight into its planned clusters */
+void write_file(struct node *n, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t remaining = n->size, want, got = 0;
+    ssize_t bytes;
+    uint8_t *p;
+    int fd, i;
+
+    fd = open(n->hostpath, O_RDONLY);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Can't open file %s to copy data in\n", n->hostpath);
+	exit(1);
+    }
+
+    for (i = 0; i < n->nextents; i++)
+    {
+	p = cluster_to_addr(n->extents[i].start, image_buf, bpb);
+	dos_stats.clusters_touched += n->extents[i].count - 1;
+	want = n->extents[i].count * clust_size;
+	if (want > remaining)
+	    want = remaining;
+	for (got = 0; got < want; got += bytes)
+	{
+	    bytes = read(fd, p + got, want - got);
+	    if (bytes < 0 && errno == EINTR)
+	    {
+		bytes = 0;
+		continue;
+	    }
+	    if (bytes <= 0)
+		break;
+	}
+	dos_stats.bytes_in += got;
+	if (got < want)
+	{
+	    /* the file shrank since we planned - keep the planned size,
+	       padded with zeros, rather than redo the layout */
+	    fprintf(stderr, "%s got shorter while packing; padding with zeros\n",
+		    n->hostpath);
+	    memset(p + got, 0, want - got);
+	}
+	memset(p + want, 0, n->extents[i].count * clust_size - want);
+	mark_dirty(image_buf, DIRTY_DATA, p, n->extents[i].count * clust_size);
+	remaining -= want;
+    }
+    close(fd);
+    link_chain(n, image_buf, bpb);
+}
+
+
+/* write_dir writes a directory's entries into its own clusters (or
+   into the root directory, for the top level), then its children in
+   the order they were planned */
+void write_dir(struct node *dir, uint16_t parent_cluster, int is_root,
+	       uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t per_cluster = clust_size / sizeof(struct direntry);
+    struct direntry *dirent = NULL;
+    uint32_t slot = 0;
+    int i, e = 0, k = 0;
+
+    if (!is_root)
+    {
+	uint16_t self = dir->extents[0].start;
+
+	for (e = 0; e < dir->nextents; e++)
+	{
+	    dirent = (struct direntry*)cluster_to_addr(dir->extents[e].start,
+						       image_buf, bpb);
+	    memset(dirent, 0, dir->extents[e].count * clust_size);
+	    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent,
+		       dir->extents[e].count * clust_size);
+	}
+	link_chain(dir, image_buf, bpb);
+
+	dirent = (struct direntry*)cluster_to_addr(self, image_buf, bpb);
+	fill_dirent(&dirent[0], "", ATTR_DIRECTORY, self, 0);
+	memcpy(dirent[0].deName, ".       ", 8);
+	fill_dirent(&dirent[1], "", ATTR_DIRECTORY, parent_cluster, 0);
+	memcpy(dirent[1].deName, "..      ", 8);
+	set_dirent_time(&dirent[0], dir->mtime);
+	set_dirent_time(&dirent[1], dir->mtime);
+	slot = 2;
+	e = 0;
+    }
+
+    for (i = 0; i < dir->nchildren; i++)
+    {
+	struct node *child = &dir->children[i];
+
+	if (is_root)
+	{
+	    dirent = alloc_dirent(MSDOSFSROOT, image_buf, bpb);
+	}
+	else
+	{
+	    /* next slot of our own clusters */
+	    uint32_t in_extent = slot - k;
+	    if (in_extent >= dir->extents[e].count * per_cluster)
+	    {
+		k += dir->extents[e].count * per_cluster;
+		e++;
+		in_extent = 0;
+	    }
+	    dirent = (struct direntry*)cluster_to_addr(dir->extents[e].start,
+						       image_buf, bpb)
+		+ in_extent;
+	    slot++;
+	}
+	*dirent = child->entry;
+	set_dirent_time(dirent, child->mtime);
+	mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    }
+
+    /* the children follow the directory's first cluster on disk */
+    for (i = 0; i < dir->nchildren; i++)
+    {
+	struct node *child = &dir->children[i];
+	if (child->is_dir)
+	    write_dir(child, is_root ? MSDOSFSROOT : dir->extents[0].start,
+		      FALSE, image_buf, bpb);
+	else
+	    write_file(child, image_buf, bpb);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    int sync_policy = SYNC_NONE, root_slots = 0;
+    char *args[2];
+    int nargs = 0, i;
+    struct node root;
+    struct direntry *dirent;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strncmp(argv[i], "--sync=", 7) == 0)
+	{
+	    sync_policy = parse_sync_policy(argv[i] + 7);
+	    if (sync_policy < 0)
+		usage(argv[0]);
+	}
+	else if (argv[i][0] == '-' || nargs == 2)
+	    usage(argv[0]);
+	else
+	    args[nargs++] = argv[i];
+    }
+    if (nargs != 2)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(args[0], &fd);
+    bpb = check_bootsector(image_buf);
+
+    /* how much room is left in the root directory? */
+    dirent = (struct direntry*)root_dir_addr(image_buf, bpb);
+    for (i = 0; i < bpb->bpbRootDirEnts; i++, dirent++)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY || dirent->deName[0] == SLOT_DELETED)
+	    root_slots++;
+    }
+
+    /* pass 1: plan the whole layout before touching the image */
+    memset(&root, 0, sizeof(root));
+    strncpy(root.hostpath, args[1], MAXPATHLEN);
+    root.is_dir = TRUE;
+    plan_dir(&root, TRUE, root_slots, image_buf, bpb);
+    fprintf(stderr, "Packing %u files and %u directories into %u clusters\n",
+	    planned_files, planned_dirs, planned_clusters);
+
+    /* pass 2: write it all out in cluster order */
+    madvise(image_buf, cluster_to_addr(cursor, image_buf, bpb) - image_buf,
+	    MADV_SEQUENTIAL);
+    stats_phase(PHASE_DATA);
+    write_dir(&root, MSDOSFSROOT, TRUE, image_buf, bpb);
+    sync_fat_copies(image_buf, bpb);
+
+    if (flush_dirty(image_buf, sync_policy) < 0)
+    {
+	fprintf(stderr, "Failed to flush changes to the disk image\n");
+	exit(1);
+    }
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    return 0;
+}
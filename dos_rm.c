@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_rm marks the entries it removes deleted straight away, but only
+   collects the clusters they used.  Once every path has been handled,
+   all of those clusters are freed in one sorted pass over the FAT. */
+
+int recursive = FALSE, force = FALSE;
+struct free_batch batch;
+uint32_t removed_files = 0, removed_dirs = 0;
+int failed = FALSE;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-r] [-f] [--sync=none|end|ordered] <imagename> a:<filename>...\n", progname);
+    fprintf(stderr, "\tremoves files from the disk image; names may contain * ? and [...] wildcards\n");
+    fprintf(stderr, "\t-r: remove directories and everything in them\n");
+    fprintf(stderr, "\t-f: don't complain about names that don't exist\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* is_live_entry says whether a directory slot holds a real file or
+   directory, as opposed to a free slot, ".", "..", a volume label or a
+   long filename piece */
+int is_live_entry(struct direntry *dirent)
+{
+    if (dirent->deName[0] == SLOT_EMPTY || dirent->deName[0] == SLOT_DELETED
+	|| dirent->deName[0] == '.')
+	return FALSE;
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+	|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+	return FALSE;
+    return TRUE;
+}
+
+
+/* the long filename pieces stored just before the entry we're looking
+   at; they have to go when the entry does */
+#define MAX_LFN 20
+struct direntry *lfn[MAX_LFN];
+int nlfn = 0;
+
+
+void delete_entry(struct direntry *dirent, uint16_t dir_cluster,
+		  uint32_t slot, uint8_t *image_buf)
+{
+    int i;
+
+    forget_slot_hint(dir_cluster, slot - nlfn);
+    dirent->deName[0] = SLOT_DELETED;
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    for (i = 0; i < nlfn; i++)
+    {
+	lfn[i]->deName[0] = SLOT_DELETED;
+	mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)lfn[i], sizeof(struct direntry));
+    }
+    nlfn = 0;
+}
+
+
+/* the callback run_dir() calls for each live entry of a directory */
+typedef void (*entry_func)(struct direntry *, uint16_t dir_cluster,
+			   uint32_t slot, void *arg,
+			   uint8_t *image_buf, struct bpb33* bpb);
+
+
+/* run_dir calls func on every live entry of the directory starting at
+   dir_cluster (0 for the root directory), in slot order */
+void run_dir(uint16_t dir_cluster, entry_func func, void *arg,
+	     uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, slot = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    nlfn = 0;
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++, slot++)
+	{
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		&& dirent->deName[0] != SLOT_DELETED)
+	    {
+		if (nlfn < MAX_LFN)
+		    lfn[nlfn++] = dirent;
+		continue;
+	    }
+	    if (is_live_entry(dirent))
+		func(dirent, dir_cluster, slot, arg, image_buf, bpb);
+	    nlfn = 0;
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+/* forget_tree collects the clusters of everything under a directory
+   that's being removed.  The entries themselves don't need marking,
+   since the directory's own clusters are about to be freed. */
+void forget_tree(struct direntry *dirent, uint16_t dir_cluster,
+		 uint32_t slot, void *arg,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t start = getushort(dirent->deStartCluster);
+
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	run_dir(start, forget_tree, NULL, image_buf, bpb);
+	forget_slot_hint(start, 0);
+	removed_dirs++;
+    }
+    else
+	removed_files++;
+    batch_chain(&batch, start, image_buf, bpb);
+}
+
+
+/* remove_entry removes one file, or with -r one directory tree */
+void remove_entry(struct direntry *dirent, uint16_t dir_cluster,
+		  uint32_t slot, char *path,
+		  uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t start = getushort(dirent->deStartCluster);
+
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	if (!recursive)
+	{
+	    fprintf(stderr, "%s is a directory (use -r to remove it)\n", path);
+	    failed = TRUE;
+	    return;
+	}
+	/* run_dir() reuses the long filename list, so save ours */
+	{
+	    struct direntry *saved[MAX_LFN];
+	    int nsaved = nlfn;
+	    memcpy(saved, lfn, nlfn * sizeof(struct direntry *));
+	    run_dir(start, forget_tree, NULL, image_buf, bpb);
+	    memcpy(lfn, saved, nsaved * sizeof(struct direntry *));
+	    nlfn = nsaved;
+	}
+	forget_slot_hint(start, 0);
+	removed_dirs++;
+    }
+    else
+	removed_files++;
+
+    batch_chain(&batch, start, image_buf, bpb);
+    delete_entry(dirent, dir_cluster, slot, image_buf);
+}
+
+
+/* what's left of a path being matched, one component at a time */
+struct match_state {
+    char **components;
+    int ncomponents;
+    char *path;
+    int matched;
+};
+
+
+void upcase(char *s)
+{
+    for ( ; *s != '\0'; s++)
+	*s = toupper((unsigned char)*s);
+}
+
+
+void match_entry(struct direntry *dirent, uint16_t dir_cluster,
+		 uint32_t slot, void *arg,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct match_state *state = arg;
+    char name[MAXFILENAME];
+
+    dirent_filename(dirent, name);
+    upcase(name);
+    if (fnmatch(state->components[0], name, 0) != 0)
+	return;
+
+    if (state->ncomponents == 1)
+    {
+	state->matched++;
+	remove_entry(dirent, dir_cluster, slot, state->path, image_buf, bpb);
+    }
+    else if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	struct match_state inner = *state;
+	inner.components++;
+	inner.ncomponents--;
+	inner.matched = 0;
+	run_dir(getushort(dirent->deStartCluster), match_entry, &inner,
+		image_buf, bpb);
+	state->matched += inner.matched;
+    }
+}
+
+
+/* remove_path removes everything that matches path, which may have
+   wildcards in any of its components */
+void remove_path(char *path, uint8_t *image_buf, struct bpb33* bpb)
+{
+    char buf[MAXPATHLEN+1];
+    char *components[MAXPATHLEN/2+1];
+    struct match_state state;
+    char *p;
+
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    upcase(buf);
+
+    state.ncomponents = 0;
+    for (p = strtok(buf, "/\\"); p != NULL; p = strtok(NULL, "/\\"))
+	components[state.ncomponents++] = p;
+    if (state.ncomponents == 0)
+    {
+	fprintf(stderr, "Can't remove the root directory\n");
+	failed = TRUE;
+	return;
+    }
+    state.components = components;
+    state.path = path;
+    state.matched = 0;
+
+    run_dir(MSDOSFSROOT, match_entry, &state, image_buf, bpb);
+    if (state.matched == 0 && !force)
+    {
+	fprintf(stderr, "No file called %s exists in the disk image\n", path);
+	failed = TRUE;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    int sync_policy = SYNC_NONE;
+    char **paths;
+    int npaths = 0, i;
+    uint32_t freed;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    paths = malloc(argc * sizeof(char *));
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-r") == 0)
+	    recursive = TRUE;
+	else if (strcmp(argv[i], "-f") == 0)
+	    force = TRUE;
+	else if (strncmp(argv[i], "--sync=", 7) == 0)
+	{
+	    sync_policy = parse_sync_policy(argv[i] + 7);
+	    if (sync_policy < 0)
+		usage(argv[0]);
+	}
+	else if (argv[i][0] == '-')
+	    usage(argv[0]);
+	else
+	    paths[npaths++] = argv[i];
+    }
+    if (npaths < 2)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(paths[0], &fd);
+    bpb = check_bootsector(image_buf);
+
+    for (i = 1; i < npaths; i++)
+    {
+	/* the "a:" is optional here - there's only one side to name */
+	if (strncmp("a:", paths[i], 2) == 0)
+	    paths[i] += 2;
+	remove_path(paths[i], image_buf, bpb);
+    }
+
+    /* the entries are gone; make sure that's on disk before their
+       clusters can be handed out again */
+    if (sync_policy == SYNC_ORDERED && flush_dirty(image_buf, sync_policy) < 0)
+    {
+	fprintf(stderr, "Failed to flush changes to the disk image\n");
+	exit(1);
+    }
+
+    freed = apply_free_batch(&batch, image_buf, bpb);
+    sync_fat_copies(image_buf, bpb);
+    fprintf(stderr, "Removed %u files and %u directories, freeing %u clusters\n",
+	    removed_files, removed_dirs, freed);
+
+    if (flush_dirty(image_buf, sync_policy) < 0)
+    {
+	fprintf(stderr, "Failed to flush changes to the disk image\n");
+	exit(1);
+    }
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    free(batch.clusters);
+    free(paths);
+
+    return failed ? 1 : 0;
+}
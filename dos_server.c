@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "fatimg.h"
+#include "dos_server.h"
+
+
+/* dos_server keeps disk images open between requests, so that a
+   program asking lots of small questions about the same images doesn't
+   pay for mapping the image and decoding its FAT each time.  Clients
+   connect over a Unix socket; see dos_server.h for the protocol.
+
+   Open images live in a fixed number of slots.  When a new image is
+   wanted and every slot is full, the one used least recently is closed,
+   waiting if need be until nobody is using it.  Each connection gets a
+   thread; libfatimg lets them share an image safely.
+
+   A handle caches the FAT and directory locations, so it goes stale if
+   another program changes the image.  Each request stats the image
+   file, and a slot whose file has a different inode, size or mtime
+   than when it was opened is reopened before it's used.  Opening and
+   closing happen outside slots_lock, with the slot marked busy, so a
+   slow open only holds up requests for that image. */
+
+struct slot {
+    char path[PATH_MAX];
+    struct fatimg img;
+    int open;
+    int busy;			/* being opened or closed */
+    int users;
+    uint64_t last_used;
+    struct stat st;		/* the file as it was when we last knew it */
+};
+
+struct slot *slots;
+int nslots = 8;
+uint64_t ticks = 0;
+pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slot_released = PTHREAD_COND_INITIALIZER;
+
+char *socket_path = SERVER_SOCKET;
+volatile sig_atomic_t stopping = FALSE;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-n images]\n", progname);
+    fprintf(stderr, "\tserves disk images to dos_client over a Unix socket\n");
+    fprintf(stderr, "\t-s: the socket to listen on (default %s)\n", SERVER_SOCKET);
+    fprintf(stderr, "\t-n: how many images to keep open at once (default 8)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when shut down\n");
+    exit(1);
+}
+
+
+/* same_file says whether st still describes the file a slot opened */
+int same_file(struct slot *s, struct stat *st)
+{
+    return s->st.st_dev == st->st_dev && s->st.st_ino == st->st_ino
+	&& s->st.st_size == st->st_size
+	&& s->st.st_mtim.tv_sec == st->st_mtim.tv_sec
+	&& s->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/* get_image returns the slot holding the image at path, opening it if
+   it isn't open already, or reopening it if the file has changed since.
+   The caller must put_image() it when done. */
+struct slot *get_image(char *path, int *status)
+{
+    struct slot *s, *victim;
+    struct stat st;
+    int i, wait, was_open;
+
+    if (stat(path, &st) < 0)
+    {
+	*status = FATIMG_ERR_IO;
+	return NULL;
+    }
+
+    pthread_mutex_lock(&slots_lock);
+    while (TRUE)
+    {
+	victim = NULL;
+	wait = FALSE;
+	for (i = 0; i < nslots; i++)
+	{
+	    s = &slots[i];
+	    if ((s->open || s->busy) && strcmp(s->path, path) == 0)
+	    {
+		if (s->open && !s->busy && same_file(s, &st))
+		{
+		    s->users++;
+		    s->last_used = ++ticks;
+		    pthread_mutex_unlock(&slots_lock);
+		    *status = FATIMG_OK;
+		    return s;
+		}
+		/* being opened, or stale: reopen it once nobody's using it */
+		if (s->busy || s->users > 0)
+		    wait = TRUE;
+		else
+		    victim = s;
+		break;
+	    }
+	    if (s->busy)
+		continue;
+	    if (!s->open)
+	    {
+		if (victim == NULL || victim->open)
+		    victim = s;
+	    }
+	    else if (s->users == 0
+		     && (victim == NULL
+			 || (victim->open && s->last_used < victim->last_used)))
+		victim = s;
+	}
+	if (victim != NULL && !wait)
+	    break;
+	pthread_cond_wait(&slot_released, &slots_lock);
+    }
+
+    /* the slot is ours until busy is cleared */
+    was_open = victim->open;
+    victim->open = FALSE;
+    victim->busy = TRUE;
+    strcpy(victim->path, path);
+    pthread_mutex_unlock(&slots_lock);
+
+    if (was_open)
+	fatimg_close(&victim->img);
+    *status = fatimg_open(&victim->img, path, FATIMG_RDWR);
+    if (*status == FATIMG_ERR_IO && (errno == EACCES || errno == EROFS))
+	*status = fatimg_open(&victim->img, path, FATIMG_RDONLY);
+    if (*status == FATIMG_OK)
+	fstat(victim->img.fd, &victim->st);
+
+    pthread_mutex_lock(&slots_lock);
+    victim->busy = FALSE;
+    if (*status == FATIMG_OK)
+    {
+	victim->open = TRUE;
+	victim->users = 1;
+	victim->last_used = ++ticks;
+    }
+    pthread_cond_broadcast(&slot_released);
+    pthread_mutex_unlock(&slots_lock);
+    return *status == FATIMG_OK ? victim : NULL;
+}
+
+
+/* written notes that we changed the image ourselves, so that the new
+   mtime isn't taken for someone else's change */
+void written(struct slot *s)
+{
+    struct stat st;
+
+    if (fstat(s->img.fd, &st) < 0)
+	return;
+    pthread_mutex_lock(&slots_lock);
+    s->st = st;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+
+void put_image(struct slot *s)
+{
+    pthread_mutex_lock(&slots_lock);
+    s->users--;
+    pthread_cond_broadcast(&slot_released);
+    pthread_mutex_unlock(&slots_lock);
+}
+
+
+int read_all(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = read(fd, (uint8_t*)buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    return -1;
+	total += bytes;
+    }
+    return 0;
+}
+
+
+int write_all(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = write(fd, (uint8_t*)buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    return -1;
+	total += bytes;
+    }
+    return 0;
+}
+
+
+int send_reply(int fd, int status, void *data, uint32_t len)
+{
+    struct reply reply;
+
+    reply.status = status;
+    reply.len = len;
+    if (write_all(fd, &reply, sizeof(reply)) < 0)
+	return -1;
+    __atomic_fetch_add(&dos_stats.bytes_out, len, __ATOMIC_RELAXED);
+    return write_all(fd, data, len);
+}
+
+
+void to_wire(struct fatimg_entry *entry, struct wire_entry *wire)
+{
+    memset(wire, 0, sizeof(*wire));
+    memcpy(wire->name, entry->name, sizeof(wire->name));
+    wire->attributes = entry->attributes;
+    wire->start_cluster = entry->start_cluster;
+    wire->size = entry->size;
+    wire->mtime = entry->mtime;
+}
+
+
+/* do_list gathers a whole directory into one reply */
+int do_list(int fd, struct fatimg *img, char *path)
+{
+    struct fatimg_entry entries[64];
+    struct wire_entry *wire = NULL;
+    uint32_t cookie = 0, count, n = 0, max = 0, i;
+    int status, rv;
+
+    do
+    {
+	status = fatimg_list(img, path, &cookie, entries, 64, &count);
+	if (n + count > max)
+	{
+	    max = n + count + 64;
+	    wire = realloc(wire, max * sizeof(struct wire_entry));
+	}
+	for (i = 0; i < count; i++)
+	    to_wire(&entries[i], &wire[n++]);
+    } while (status == FATIMG_OK && count == 64);
+
+    rv = send_reply(fd, status, wire, n * sizeof(struct wire_entry));
+    free(wire);
+    return rv;
+}
+
+
+int do_read(int fd, struct fatimg *img, char *path, uint32_t offset,
+	    uint32_t len)
+{
+    struct fatimg_entry entry;
+    uint8_t *buf;
+    uint32_t got = 0;
+    int status, rv;
+
+    status = fatimg_lookup(img, path, &entry);
+    if (status != FATIMG_OK)
+	return send_reply(fd, status, NULL, 0);
+
+    /* no bigger a buffer than the answer needs */
+    if (offset >= entry.size)
+	len = 0;
+    else if (len > entry.size - offset)
+	len = entry.size - offset;
+    buf = malloc(len + 1);
+    status = fatimg_read(img, path, offset, buf, len, &got);
+    rv = send_reply(fd, status, buf, got);
+    free(buf);
+    return rv;
+}
+
+
+/* serve handles one request; it returns -1 when the connection should
+   be dropped */
+int serve(int fd, struct request *req)
+{
+    char image[PATH_MAX], path[FATIMG_MAXPATH+1];
+    struct fatimg_entry entry;
+    struct wire_entry wire;
+    struct fatimg_report report;
+    struct slot *s;
+    uint8_t *data = NULL;
+    int status, rv = 0;
+
+    if (req->imagelen == 0 || req->imagelen >= PATH_MAX
+	|| req->pathlen > FATIMG_MAXPATH
+	|| (req->op == OP_WRITE && req->len > SERVER_MAXDATA))
+	return -1;
+    if (read_all(fd, image, req->imagelen) < 0
+	|| read_all(fd, path, req->pathlen) < 0)
+	return -1;
+    image[req->imagelen] = '\0';
+    path[req->pathlen] = '\0';
+    if (req->op == OP_WRITE)
+    {
+	data = malloc(req->len + 1);
+	if (read_all(fd, data, req->len) < 0)
+	{
+	    free(data);
+	    return -1;
+	}
+	__atomic_fetch_add(&dos_stats.bytes_in, req->len, __ATOMIC_RELAXED);
+    }
+
+    s = get_image(image, &status);
+    if (s == NULL)
+    {
+	free(data);
+	return send_reply(fd, status, NULL, 0);
+    }
+
+    switch (req->op)
+    {
+    case OP_LIST:
+	rv = do_list(fd, &s->img, path);
+	break;
+    case OP_STAT:
+	status = fatimg_lookup(&s->img, path, &entry);
+	if (status == FATIMG_OK)
+	    to_wire(&entry, &wire);
+	rv = send_reply(fd, status, &wire,
+			status == FATIMG_OK ? sizeof(wire) : 0);
+	break;
+    case OP_READ:
+	rv = do_read(fd, &s->img, path, req->offset,
+		     req->len < SERVER_MAXDATA ? req->len : SERVER_MAXDATA);
+	break;
+    case OP_WRITE:
+	status = fatimg_write(&s->img, path, data, req->len);
+	if (status == FATIMG_OK)
+	    written(s);
+	rv = send_reply(fd, status, NULL, 0);
+	break;
+    case OP_CHECK:
+	status = fatimg_check(&s->img, &report);
+	rv = send_reply(fd, status, &report,
+			status == FATIMG_OK ? sizeof(report) : 0);
+	break;
+    case OP_SYNC:
+	rv = send_reply(fd, fatimg_sync(&s->img), NULL, 0);
+	break;
+    default:
+	rv = send_reply(fd, FATIMG_ERR_INVAL, NULL, 0);
+	break;
+    }
+
+    put_image(s);
+    free(data);
+    return rv;
+}
+
+
+void *connection(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    struct request req;
+
+    while (read_all(fd, &req, sizeof(req)) == 0)
+    {
+	if (serve(fd, &req) < 0)
+	    break;
+    }
+    close(fd);
+    return NULL;
+}
+
+
+/* shut_down only asks the accept loop to stop, so that the socket is
+   removed and --stats printed on the way out by exit() */
+void shut_down(int sig)
+{
+    stopping = TRUE;
+}
+
+
+/* clear_socket removes a socket left behind by a server that's gone.
+   Anything else at the path, including a socket a live server is
+   listening on, is left alone and reported. */
+void clear_socket(char *path, struct sockaddr_un *addr)
+{
+    struct stat statbuf;
+    int fd;
+
+    if (lstat(path, &statbuf) < 0)
+	return;
+    if (!S_ISSOCK(statbuf.st_mode))
+    {
+	fprintf(stderr, "%s exists and isn't a socket\n", path);
+	exit(1);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+	exit(1);
+    }
+    if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) == 0)
+    {
+	fprintf(stderr, "A server is already listening on %s\n", path);
+	exit(1);
+    }
+    if (errno != ECONNREFUSED)
+    {
+	fprintf(stderr, "Cannot check %s: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    close(fd);
+    unlink(path);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    pthread_attr_t attr;
+    struct sigaction action;
+    pthread_t thread;
+    int listener, fd, i;
+    mode_t mask;
+
+    stats_option(&argc, argv);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+	    socket_path = argv[++i];
+	else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+	    nslots = atoi(argv[++i]);
+	else
+	    usage(argv[0]);
+    }
+    if (nslots < 1 || strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+	usage(argv[0]);
+    }
+    slots = calloc(nslots, sizeof(struct slot));
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+	fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+	exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    clear_socket(socket_path, &addr);
+
+    /* only this user may connect, from the moment the socket exists */
+    mask = umask(0077);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+	fprintf(stderr, "Cannot listen on %s: %s\n", socket_path,
+		strerror(errno));
+	exit(1);
+    }
+    umask(mask);
+    if (listen(listener, 64) < 0)
+    {
+	fprintf(stderr, "Cannot listen on %s: %s\n", socket_path,
+		strerror(errno));
+	unlink(socket_path);
+	exit(1);
+    }
+
+    /* no SA_RESTART, so a signal gets us out of accept() */
+    signal(SIGPIPE, SIG_IGN);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = shut_down;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    stats_phase(PHASE_DATA);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (!stopping)
+    {
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+	{
+	    if (errno != EINTR && errno != ECONNABORTED)
+		fprintf(stderr, "accept: %s\n", strerror(errno));
+	    continue;
+	}
+	if (pthread_create(&thread, &attr, connection, (void*)(intptr_t)fd) != 0)
+	    close(fd);
+    }
+    unlink(socket_path);
+    exit(0);
+}
@@ -0,0 +1,47 @@
+#ifndef __DOS_SERVER_H__
+#define __DOS_SERVER_H__
+
+/* The protocol between dos_server and dos_client.  Both ends are on
+   the same machine, so integers go in host byte order.
+
+   A client sends a struct request, the image's path, the path inside
+   the image and, for OP_WRITE, len bytes of data.  The server answers
+   with a struct reply and len bytes of data, and then waits for the
+   next request on the same connection. */
+
+#include <stdint.h>
+
+#define SERVER_SOCKET "/tmp/dos_server.sock"
+#define SERVER_MAXDATA (32 * 1024 * 1024)	/* more than any FAT-12 image */
+
+#define OP_LIST 1	/* replies with a struct wire_entry per entry */
+#define OP_STAT 2	/* replies with one struct wire_entry */
+#define OP_READ 3	/* replies with up to len bytes from offset */
+#define OP_WRITE 4	/* replaces the file with the data sent */
+#define OP_CHECK 5	/* replies with a struct fatimg_report */
+#define OP_SYNC 6	/* waits until the image's changes are on disk */
+
+struct request {
+    uint8_t op;
+    uint8_t pad;
+    uint16_t imagelen;	/* bytes in the image's path */
+    uint16_t pathlen;	/* bytes in the path inside the image */
+    uint16_t pad2;
+    uint32_t offset;	/* OP_READ only */
+    uint32_t len;	/* bytes wanted by OP_READ, or sent by OP_WRITE */
+};
+
+struct reply {
+    int32_t status;	/* a FATIMG_ status code */
+    uint32_t len;	/* bytes of data that follow */
+};
+
+struct wire_entry {
+    char name[13];
+    uint8_t attributes;
+    uint16_t start_cluster;
+    uint32_t size;
+    uint32_t mtime;
+};
+
+#endif // __DOS_SERVER_H__
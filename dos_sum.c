@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "checksum.h"
+
+
+/* dos_sum prints a SHA-256 (or, with -a crc32c, a CRC32C) checksum for
+   every file in an image, in the format sha256sum uses, or with --check
+   reads such a list back and says which files still match.
+
+   The checksums are taken straight from the mapped image, an extent at
+   a time, without copying anything out.  Files are shared out among a
+   number of threads; the FAT and the directories are all read before
+   the threads start, so the threads only ever read file data. */
+
+#define ALG_SHA256 1
+#define ALG_CRC32C 2
+
+#define MAXTHREADS 64
+
+struct sum_file {
+    char path[MAXPATHLEN+1];
+    uint16_t start;
+    uint32_t size;
+    struct extent *extents;
+    int nextents;
+    int want;				/* ALG_ bits to compute */
+    int short_chain;			/* chain ends before size bytes */
+    uint8_t sha[32];
+    uint32_t crc;
+};
+
+struct sum_file *files = NULL;
+int nfiles = 0, maxfiles = 0;
+
+/* the threads take files in order from next_file */
+int next_file = 0;
+pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint8_t *data_area;
+uint32_t clust_size;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--map=...] [--overlay=FILE] [--stats] [-j threads] [-a sha256|crc32c] <imagename>\n", progname);
+    fprintf(stderr, "       %s [--map=...] [--overlay=FILE] [--stats] [-j threads] [--quiet] --check <manifest> <imagename>\n", progname);
+    fprintf(stderr, "\tprints a checksum for every file in the image, like sha256sum\n");
+    fprintf(stderr, "\t-j: how many threads to hash with (default: one per processor)\n");
+    fprintf(stderr, "\t-a: the checksum to print (default sha256)\n");
+    fprintf(stderr, "\t--check: check the files listed in manifest (- for stdin) instead\n");
+    fprintf(stderr, "\t--quiet: with --check, don't print OK for files that match\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+void collect(uint16_t dir_cluster, char *prefix,
+	     uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    char name[MAXFILENAME], path[MAXPATHLEN+1];
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    struct sum_file *f;
+
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    dirent_filename(dirent, name);
+	    if (snprintf(path, sizeof(path), "%s%s", prefix, name)
+		>= (int)sizeof(path) - 1)
+	    {
+		fprintf(stderr, "Skipping %s%s: path too long\n", prefix, name);
+		continue;
+	    }
+	    if (dirent->deAttributes & ATTR_DIRECTORY)
+	    {
+		strcat(path, "/");
+		collect(getushort(dirent->deStartCluster), path, image_buf, bpb);
+		continue;
+	    }
+
+	    if (nfiles == maxfiles)
+	    {
+		maxfiles = maxfiles ? maxfiles * 2 : 64;
+		files = realloc(files, maxfiles * sizeof(struct sum_file));
+	    }
+	    f = &files[nfiles++];
+	    memset(f, 0, sizeof(*f));
+	    strcpy(f->path, path);
+	    f->start = getushort(dirent->deStartCluster);
+	    f->size = getulong(dirent->deFileSize);
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+/* find_extents reads the chain of each file that's going to be summed.
+   It's done here, before the threads start, because the FAT code keeps
+   counters that aren't safe to share. */
+void find_extents(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint64_t have;
+    int i, j;
+
+    for (i = 0; i < nfiles; i++)
+    {
+	struct sum_file *f = &files[i];
+
+	if (f->want == 0 || f->size == 0)
+	    continue;
+	f->nextents = get_extents(f->start, &f->extents, image_buf, bpb);
+	have = 0;
+	for (j = 0; j < f->nextents; j++)
+	{
+	    have += (uint64_t)f->extents[j].count * clust_size;
+	    dos_stats.clusters_touched += f->extents[j].count;
+	}
+	f->short_chain = have < f->size;
+    }
+}
+
+
+void sum_file(struct sum_file *f)
+{
+    struct sha256 sha;
+    uint32_t crc = 0, left = f->size, len;
+    const uint8_t *p;
+    int i;
+
+    sha256_init(&sha);
+    for (i = 0; i < f->nextents && left > 0; i++)
+    {
+	p = data_area + (uint32_t)(f->extents[i].start - CLUST_FIRST) * clust_size;
+	len = f->extents[i].count * clust_size;
+	if (len > left)
+	    len = left;
+	if (f->want & ALG_SHA256)
+	    sha256_update(&sha, p, len);
+	if (f->want & ALG_CRC32C)
+	    crc = crc32c(crc, p, len);
+	left -= len;
+    }
+    if (f->want & ALG_SHA256)
+	sha256_final(&sha, f->sha);
+    f->crc = crc;
+}
+
+
+void *worker(void *arg)
+{
+    int i;
+
+    while (TRUE)
+    {
+	pthread_mutex_lock(&next_lock);
+	i = next_file++;
+	pthread_mutex_unlock(&next_lock);
+	if (i >= nfiles)
+	    return NULL;
+	if (files[i].want != 0 && !files[i].short_chain)
+	    sum_file(&files[i]);
+    }
+}
+
+
+void sum_all(int nthreads)
+{
+    pthread_t threads[MAXTHREADS];
+    int i, started = 0;
+
+    for (i = 0; i < nthreads; i++)
+    {
+	if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+	    break;
+	started++;
+    }
+    /* if no thread could be started, do it all here */
+    if (started == 0)
+	worker(NULL);
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+}
+
+
+void format_sum(struct sum_file *f, int alg, char *buffer)
+{
+    int i;
+
+    if (alg == ALG_CRC32C)
+	sprintf(buffer, "%08x", f->crc);
+    else
+	for (i = 0; i < 32; i++)
+	    sprintf(buffer + 2*i, "%02x", f->sha[i]);
+}
+
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(((const struct sum_file*)a)->path,
+		  ((const struct sum_file*)b)->path);
+}
+
+
+/* check reads a manifest of "<checksum>  <path>" lines, as sha256sum
+   writes them, and reports on each file listed.  The checksum's length
+   says which kind it is.  Returns the exit status. */
+int check(char *manifest, int nthreads, int quiet,
+	  uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct line {
+	int file;			/* -1 if not in the image */
+	int alg;
+	char sum[65];
+	char path[MAXPATHLEN+1];
+    } *lines = NULL;
+    struct sum_file key, *found;
+    int nlines = 0, maxlines = 0, bad_lines = 0, failed = 0, unreadable = 0;
+    int lineno = 0, i, len;
+    char buf[MAXPATHLEN + 80], sum[65], *p;
+    FILE *in;
+
+    in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (in == NULL)
+    {
+	fprintf(stderr, "Cannot open %s: %s\n", manifest, strerror(errno));
+	exit(1);
+    }
+
+    qsort(files, nfiles, sizeof(struct sum_file), compare_paths);
+    while (fgets(buf, sizeof(buf), in) != NULL)
+    {
+	lineno++;
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if (buf[0] == '#' || buf[0] == '\0')
+	    continue;
+
+	/* "<hex>  <path>", or "<hex> *<path>" for binary mode */
+	len = strspn(buf, "0123456789abcdefABCDEF");
+	p = buf + len;
+	if ((len != 64 && len != 8) || p[0] != ' '
+	    || (p[1] != ' ' && p[1] != '*') || p[2] == '\0'
+	    || strlen(p + 2) > MAXPATHLEN)
+	{
+	    bad_lines++;
+	    continue;
+	}
+	for (i = 0; i < len; i++)
+	    sum[i] = tolower((unsigned char)buf[i]);
+	sum[len] = '\0';
+
+	if (nlines == maxlines)
+	{
+	    maxlines = maxlines ? maxlines * 2 : 64;
+	    lines = realloc(lines, maxlines * sizeof(struct line));
+	}
+	strcpy(lines[nlines].sum, sum);
+	strcpy(lines[nlines].path, p + 2);
+	lines[nlines].alg = len == 64 ? ALG_SHA256 : ALG_CRC32C;
+
+	/* image paths are upper case, and may be given with a leading / */
+	strcpy(key.path, p[2] == '/' ? p + 3 : p + 2);
+	for (i = 0; key.path[i] != '\0'; i++)
+	    key.path[i] = toupper((unsigned char)key.path[i]);
+	found = bsearch(&key, files, nfiles, sizeof(struct sum_file),
+			compare_paths);
+	lines[nlines].file = found ? found - files : -1;
+	if (found)
+	    found->want |= lines[nlines].alg;
+	nlines++;
+    }
+    if (ferror(in))
+    {
+	fprintf(stderr, "Error reading %s: %s\n", manifest, strerror(errno));
+	exit(1);
+    }
+    if (in != stdin)
+	fclose(in);
+    if (nlines == 0)
+    {
+	fprintf(stderr, "%s: no properly formatted checksum lines found\n",
+		manifest);
+	exit(1);
+    }
+
+    find_extents(image_buf, bpb);
+    stats_phase(PHASE_DATA);
+    sum_all(nthreads);
+
+    for (i = 0; i < nlines; i++)
+    {
+	struct line *l = &lines[i];
+
+	if (l->file < 0 || files[l->file].short_chain)
+	{
+	    printf("%s: FAILED open or read\n", l->path);
+	    unreadable++;
+	    continue;
+	}
+	format_sum(&files[l->file], l->alg, sum);
+	if (strcmp(sum, l->sum) != 0)
+	{
+	    printf("%s: FAILED\n", l->path);
+	    failed++;
+	}
+	else if (!quiet)
+	    printf("%s: OK\n", l->path);
+    }
+
+    if (bad_lines)
+	fprintf(stderr, "WARNING: %d line%s improperly formatted\n",
+		bad_lines, bad_lines == 1 ? " is" : "s are");
+    if (unreadable)
+	fprintf(stderr, "WARNING: %d listed file%s could not be read\n",
+		unreadable, unreadable == 1 ? "" : "s");
+    if (failed)
+	fprintf(stderr, "WARNING: %d computed checksum%s did NOT match\n",
+		failed, failed == 1 ? "" : "s");
+    free(lines);
+    return (failed || unreadable) ? 1 : 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    char *image = NULL, *manifest = NULL, sum[65];
+    int alg = ALG_SHA256, nthreads = 0, quiet = FALSE, status = 0;
+    int i;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+	{
+	    nthreads = atoi(argv[++i]);
+	    if (nthreads < 1)
+		usage(argv[0]);
+	}
+	else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+	{
+	    i++;
+	    if (strcmp(argv[i], "sha256") == 0)
+		alg = ALG_SHA256;
+	    else if (strcmp(argv[i], "crc32c") == 0)
+		alg = ALG_CRC32C;
+	    else
+		usage(argv[0]);
+	}
+	else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc)
+	    manifest = argv[++i];
+	else if (strcmp(argv[i], "--quiet") == 0)
+	    quiet = TRUE;
+	else if (argv[i][0] == '-' || image != NULL)
+	    usage(argv[0]);
+	else
+	    image = argv[i];
+    }
+    if (image == NULL)
+    {
+	usage(argv[0]);
+    }
+    if (nthreads == 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > MAXTHREADS)
+	nthreads = MAXTHREADS;
+
+    checksum_init();
+
+    image_buf = mmap_file(image, &fd);
+    bpb = check_bootsector(image_buf);
+    clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    data_area = root_dir_addr(image_buf, bpb)
+	+ bpb->bpbRootDirEnts * sizeof(struct direntry);
+
+    collect(MSDOSFSROOT, "", image_buf, bpb);
+    if (nthreads > nfiles)
+	nthreads = nfiles > 0 ? nfiles : 1;
+
+    if (manifest != NULL)
+	status = check(manifest, nthreads, quiet, image_buf, bpb);
+    else
+    {
+	for (i = 0; i < nfiles; i++)
+	    files[i].want = alg;
+	find_extents(image_buf, bpb);
+	stats_phase(PHASE_DATA);
+	sum_all(nthreads);
+
+	for (i = 0; i < nfiles; i++)
+	{
+	    if (files[i].short_chain)
+	    {
+		fprintf(stderr, "%s: %s: cluster chain is shorter than the file\n",
+			argv[0], files[i].path);
+		status = 1;
+		continue;
+	    }
+	    format_sum(&files[i], alg, sum);
+	    printf("%s  %s\n", sum, files[i].path);
+	}
+    }
+    if (fflush(stdout) != 0)
+    {
+	fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    for (i = 0; i < nfiles; i++)
+	free(files[i].extents);
+    free(files);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    return status;
+}
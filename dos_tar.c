@@ -0,0 +1,1006 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_tar writes the whole image out as a POSIX (ustar) tar stream,
+   or with -x reads one from stdin into the image.
+
+   Rather than copying each file in directory order, which jumps all
+   over the data area, it sorts every extent of every file by cluster
+   and reads the image front to back once.  A file whose extents come
+   one after the other in that order is streamed straight out of the
+   image.  Only files interleaved with other files have to be held
+   back, in a reorder buffer, until their last extent has been read;
+   the buffer has a fixed size, and when it's full the file is finished
+   early by reading its remaining extents out of order.  A file too big
+   for the buffer on its own isn't copied at all: it's written straight
+   from the image, its extents in chain order. */
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)
+
+struct tar_file {
+    char path[MAXPATHLEN+1];
+    int is_dir;
+    uint32_t size;
+    time_t mtime;
+    struct extent *extents;
+    int nextents;
+    int first_piece, last_piece;	/* where its extents sort to */
+    int pieces_left;
+    uint8_t *buffer;			/* reordered data, if any */
+    int done;
+};
+
+/* one extent of one file, in the order it will be read */
+struct piece {
+    uint16_t start;
+    uint16_t count;
+    uint32_t offset;	/* where it goes in the file */
+    int file;
+};
+
+struct tar_file *files = NULL;
+int nfiles = 0, maxfiles = 0;
+struct piece *pieces = NULL;
+int npieces = 0;
+
+uint64_t bytes_out = 0, buffered = 0, max_buffered = 0, out_of_order = 0;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [--buffer N[K|M]] <imagename> > archive.tar\n", progname);
+    fprintf(stderr, "       %s -x [--sync=none|end|ordered] <imagename> < archive.tar\n", progname);
+    fprintf(stderr, "\twrites every file and directory in the disk image to stdout as a tar archive\n");
+    fprintf(stderr, "\t--buffer: memory for holding back interleaved files (default 4M)\n");
+    fprintf(stderr, "\t-x: instead, unpack the tar archive on stdin into the disk image\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+/* parse_size understands plain byte counts and K/M suffixes */
+uint32_t parse_size(char *arg, char *progname)
+{
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+    {
+	v *= 1024;
+	end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+	v *= 1024 * 1024;
+	end++;
+    }
+    if (end == arg || *end != '\0' || v > UINT32_MAX)
+	usage(progname);
+    return v;
+}
+
+
+void write_out(void *buf, uint32_t len)
+{
+    if (len > 0 && fwrite_image(buf, len, stdout) != len)
+    {
+	fprintf(stderr, "Error writing the tar stream: %s\n", strerror(errno));
+	exit(1);
+    }
+    bytes_out += len;
+    dos_stats.bytes_out += len;
+}
+
+
+void pad_block(void)
+{
+    static uint8_t zeros[TAR_BLOCK];
+
+    if (bytes_out % TAR_BLOCK != 0)
+	write_out(zeros, TAR_BLOCK - bytes_out % TAR_BLOCK);
+}
+
+
+/* write_header writes a ustar header block.  Paths that don't fit in
+   the 100 byte name field are split at a '/' into the prefix field. */
+void write_header(struct tar_file *f)
+{
+    uint8_t header[TAR_BLOCK];
+    char *name = f->path;
+    uint32_t sum = 0;
+    int i, len = strlen(f->path);
+
+    memset(header, 0, sizeof(header));
+    if (len > 100)
+    {
+	char *slash = f->path + len - 101;
+	while (*slash != '\0' && *slash != '/')
+	    slash++;
+	if (*slash == '\0' || slash - f->path > 155)
+	{
+	    fprintf(stderr, "Path too long for tar: %s\n", f->path);
+	    exit(1);
+	}
+	memcpy(header + 345, f->path, slash - f->path);
+	name = slash + 1;
+    }
+    memcpy(header, name, strlen(name));
+
+    sprintf((char *)header + 100, "%07o", f->is_dir ? 0755 : 0644);
+    sprintf((char *)header + 108, "%07o", 0);
+    sprintf((char *)header + 116, "%07o", 0);
+    sprintf((char *)header + 124, "%011o", f->size);
+    sprintf((char *)header + 136, "%011lo", (unsigned long)f->mtime);
+    header[156] = f->is_dir ? '5' : '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    /* the checksum is taken with its own field full of spaces */
+    memset(header + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK; i++)
+	sum += header[i];
+    sprintf((char *)header + 148, "%06o", sum);
+    header[155] = ' ';
+
+    write_out(header, TAR_BLOCK);
+}
+
+
+/* piece_bytes is how much of the file a piece actually holds: the
+   last cluster is usually only partly used, and a chain can run past
+   the end of the file */
+uint32_t piece_bytes(struct piece *p, uint32_t clust_size)
+{
+    uint32_t len = p->count * clust_size;
+    uint32_t size = files[p->file].size;
+
+    if (p->offset >= size)
+	return 0;
+    if (len > size - p->offset)
+	len = size - p->offset;
+    return len;
+}
+
+
+/* collect walks a directory, adding everything in it (and below it)
+   to the list of files in directory order */
+void collect(uint16_t dir_cluster, char *prefix,
+	     uint8_t *image_buf, struct bpb33* bpb)
+{
+    int n = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust)
+	/ sizeof(struct direntry);
+    uint32_t steps = 0, limit = num_clusters(bpb);
+    uint16_t cluster = dir_cluster;
+    struct direntry *dirent;
+    char name[MAXFILENAME];
+    int i;
+
+    if (cluster == MSDOSFSROOT)
+	n = bpb->bpbRootDirEnts;
+
+    while (cluster == MSDOSFSROOT
+	   || (is_valid_cluster(cluster, bpb) && cluster < limit))
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (i = 0; i < n; i++, dirent++)
+	{
+	    struct tar_file *f;
+
+	    dos_stats.dirents_scanned++;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    if (nfiles == maxfiles)
+	    {
+		maxfiles = maxfiles ? maxfiles * 2 : 64;
+		files = realloc(files, maxfiles * sizeof(struct tar_file));
+	    }
+	    f = &files[nfiles];
+	    memset(f, 0, sizeof(*f));
+	    dirent_filename(dirent, name);
+	    f->is_dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+	    if (snprintf(f->path, sizeof(f->path), "%s%s%s", prefix, name,
+			 f->is_dir ? "/" : "") >= (int)sizeof(f->path))
+	    {
+		fprintf(stderr, "Skipping %s%s: path too long\n", prefix, name);
+		continue;
+	    }
+	    f->mtime = dirent_time(dirent);
+	    nfiles++;
+
+	    if (f->is_dir)
+	    {
+		char path[MAXPATHLEN+1];
+		strcpy(path, f->path);
+		collect(getushort(dirent->deStartCluster), path, image_buf, bpb);
+	    }
+	    else
+	    {
+		f->size = getulong(dirent->deFileSize);
+		if (f->size > 0)
+		    f->nextents = get_extents(getushort(dirent->deStartCluster),
+					      &f->extents, image_buf, bpb);
+	    }
+	}
+	if (cluster == MSDOSFSROOT || ++steps >= limit)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+
+int compare_pieces(const void *a, const void *b)
+{
+    const struct piece *pa = a, *pb = b;
+
+    if (pa->start != pb->start)
+	return (int)pa->start - (int)pb->start;
+    return pa->file - pb->file;
+}
+
+
+/* plan_reads lists every extent of every file and sorts them into the
+   order they sit on disk */
+void plan_reads(uint32_t clust_size)
+{
+    int i, j, maxpieces = 0;
+
+    for (i = 0; i < nfiles; i++)
+	maxpieces += files[i].nextents;
+    pieces = malloc((maxpieces ? maxpieces : 1) * sizeof(struct piece));
+
+    for (i = 0; i < nfiles; i++)
+    {
+	uint32_t offset = 0;
+	for (j = 0; j < files[i].nextents; j++)
+	{
+	    pieces[npieces].start = files[i].extents[j].start;
+	    pieces[npieces].count = files[i].extents[j].count;
+	    pieces[npieces].offset = offset;
+	    pieces[npieces].file = i;
+	    offset += files[i].extents[j].count * clust_size;
+	    npieces++;
+	}
+	files[i].pieces_left = files[i].nextents;
+	files[i].first_piece = -1;
+    }
+    qsort(pieces, npieces, sizeof(struct piece), compare_pieces);
+
+    for (i = 0; i < npieces; i++)
+    {
+	struct tar_file *f = &files[pieces[i].file];
+	if (f->first_piece < 0)
+	    f->first_piece = i;
+	f->last_piece = i;
+    }
+}
+
+
+/* finish_data writes out whatever the file's chain didn't cover, as
+   zeros, so the data matches the size in the header */
+void finish_data(struct tar_file *f, uint32_t written)
+{
+    static uint8_t zeros[TAR_BLOCK];
+
+    if (written < f->size)
+    {
+	fprintf(stderr, "%s: the cluster chain is %u bytes short; padding with zeros\n",
+		f->path, f->size - written);
+	while (written < f->size)
+	{
+	    uint32_t len = f->size - written;
+	    if (len > TAR_BLOCK)
+		len = TAR_BLOCK;
+	    write_out(zeros, len);
+	    written += len;
+	}
+    }
+    pad_block();
+    f->done = TRUE;
+}
+
+
+/* stream_file writes a file whose extents are all next to each other
+   in the read order straight from the image, starting at piece i */
+void stream_file(struct tar_file *f, int i,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t written = 0;
+
+    write_header(f);
+    for ( ; i <= f->last_piece; i++)
+    {
+	uint32_t len = piece_bytes(&pieces[i], clust_size);
+	dos_stats.clusters_touched += pieces[i].count - 1;
+	write_out(cluster_to_addr(pieces[i].start, image_buf, bpb), len);
+	written += len;
+    }
+    finish_data(f, written);
+}
+
+
+/* flush_buffered writes out a file from its reorder buffer.  Any
+   extents that haven't been read yet are read now, out of order. */
+void flush_buffered(struct tar_file *f, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t written = 0;
+    int i;
+
+    for (i = f->first_piece; f->pieces_left > 0 && i <= f->last_piece; i++)
+    {
+	struct piece *p = &pieces[i];
+	uint32_t len;
+
+	if (&files[p->file] != f || p->count == 0)
+	    continue;
+	len = piece_bytes(p, clust_size);
+	dos_stats.clusters_touched += p->count - 1;
+	memcpy(f->buffer + p->offset,
+	       cluster_to_addr(p->start, image_buf, bpb), len);
+	out_of_order += len;
+	p->count = 0;
+	f->pieces_left--;
+    }
+
+    write_header(f);
+    for (i = 0; i < f->nextents; i++)
+	written += f->extents[i].count * clust_size;
+    if (written > f->size)
+	written = f->size;
+    write_out(f->buffer, written);
+    finish_data(f, written);
+
+    buffered -= f->size;
+    free(f->buffer);
+    f->buffer = NULL;
+}
+
+
+/* stream_extents writes a file too big to hold back straight from the
+   image, following its chain in file order rather than disk order, at
+   most limit bytes at a time */
+void stream_extents(struct tar_file *f, uint32_t limit,
+		    uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t written = 0, len, chunk;
+    uint8_t *p;
+    int i;
+
+    write_header(f);
+    for (i = 0; i < f->nextents && written < f->size; i++)
+    {
+	len = f->extents[i].count * clust_size;
+	if (len > f->size - written)
+	    len = f->size - written;
+	dos_stats.clusters_touched += f->extents[i].count - 1;
+	p = cluster_to_addr(f->extents[i].start, image_buf, bpb);
+	for ( ; len > 0; len -= chunk, p += chunk)
+	{
+	    chunk = (limit > 0 && len > limit) ? limit : len;
+	    write_out(p, chunk);
+	    written += chunk;
+	}
+    }
+    out_of_order += written;
+    finish_data(f, written);
+}
+
+
+/* export reads the pieces in disk order and writes each file as soon
+   as it's complete */
+void export(uint32_t buffer_limit, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    int i, j;
+
+    /* directories and empty files have no data to wait for */
+    for (i = 0; i < nfiles; i++)
+    {
+	if (files[i].nextents == 0)
+	{
+	    write_header(&files[i]);
+	    finish_data(&files[i], 0);
+	}
+    }
+
+    for (i = 0; i < npieces; i++)
+    {
+	struct piece *p = &pieces[i];
+	struct tar_file *f = &files[p->file];
+	uint32_t len;
+
+	if (f->done || p->count == 0)
+	    continue;
+
+	if (f->buffer == NULL
+	    && f->last_piece - f->first_piece + 1 == f->nextents)
+	{
+	    /* nothing else is mixed in with this file */
+	    stream_file(f, i, image_buf, bpb);
+	    continue;
+	}
+
+	if (f->buffer == NULL)
+	{
+	    /* make room by finishing held-back files early */
+	    for (j = 0; buffered + f->size > buffer_limit && j < nfiles; j++)
+	    {
+		if (files[j].buffer != NULL)
+		    flush_buffered(&files[j], image_buf, bpb);
+	    }
+	    if (buffered + f->size > buffer_limit)
+	    {
+		/* too big to hold back at all */
+		stream_extents(f, buffer_limit, image_buf, bpb);
+		continue;
+	    }
+	    f->buffer = malloc(f->size);
+	    buffered += f->size;
+	    if (buffered > max_buffered)
+		max_buffered = buffered;
+	}
+
+	len = piece_bytes(p, clust_size);
+	dos_stats.clusters_touched += p->count - 1;
+	memcpy(f->buffer + p->offset, cluster_to_addr(p->start, image_buf, bpb),
+	       len);
+	p->count = 0;
+	if (--f->pieces_left == 0)
+	    flush_buffered(f, image_buf, bpb);
+    }
+}
+
+
+/* Importing.  Each file's data is read from stdin straight into its
+   clusters, which are handed out as one run following the previous
+   file's whenever there's room, so an archive unpacked into an empty
+   image comes out laid end to end.  Directories are made as paths
+   need them.  Nothing is flushed until the end: the FAT and directory
+   updates all go out together, and the clusters of any files that
+   were replaced are freed in one batch. */
+
+uint16_t alloc_cursor = CLUST_FIRST;
+struct free_batch replaced;
+uint32_t imported_files = 0, imported_dirs = 0, skipped = 0;
+uint64_t imported_bytes = 0;
+
+
+/* read_fully reads up to len bytes into buf, retrying short reads,
+   and returns the number of bytes read */
+size_t read_fully(int fd, uint8_t *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t bytes;
+
+    while (total < len)
+    {
+	bytes = read(fd, buf + total, len - total);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    break;
+	total += bytes;
+    }
+    dos_stats.bytes_in += total;
+    return total;
+}
+
+
+void read_in(uint8_t *buf, size_t len)
+{
+    if (read_fully(0, buf, len) != len)
+    {
+	fprintf(stderr, "Unexpected end of the tar stream\n");
+	exit(1);
+    }
+}
+
+
+/* skip_data throws away size bytes of entry data, plus its padding */
+void skip_data(uint64_t size)
+{
+    uint8_t block[TAR_BLOCK];
+
+    size = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    for ( ; size > 0; size -= TAR_BLOCK)
+	read_in(block, TAR_BLOCK);
+}
+
+
+/* parse_number reads a numeric header field: octal, or the base-256
+   form GNU tar uses for values that don't fit */
+uint64_t parse_number(uint8_t *field, int len)
+{
+    uint64_t v = 0;
+    int i = 0;
+
+    if (field[0] & 0x80)
+    {
+	v = field[0] & 0x3f;
+	for (i = 1; i < len; i++)
+	    v = (v << 8) | field[i];
+	return v;
+    }
+    while (i < len && field[i] == ' ')
+	i++;
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+	v = v * 8 + (field[i] - '0');
+    return v;
+}
+
+
+int header_ok(uint8_t *header)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK; i++)
+	sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    return sum == parse_number(header + 148, 8);
+}
+
+
+/* canonical_name is the 8.3 name a host name turns into once it's in
+   a directory entry, so that it can be looked up */
+void canonical_name(char *name, char *buffer)
+{
+    struct direntry tmp;
+
+    fill_dirent(&tmp, name, ATTR_ARCHIVE, 0, 0);
+    dirent_filename(&tmp, buffer);
+}
+
+
+/* ensure_dir returns the first cluster of the directory named by
+   path, creating it and any missing parents, or -1 if something in
+   the way isn't a directory.  The last directory found is
+   remembered, since archives keep the files of a directory
+   together. */
+int ensure_dir(char *path, uint8_t *image_buf, struct bpb33* bpb)
+{
+    static char cached_path[MAXPATHLEN+1];
+    static int cached_cluster = -1;
+    char buf[MAXPATHLEN+1], name[MAXFILENAME];
+    char *component;
+    uint16_t cluster = MSDOSFSROOT;
+    struct direntry *dirent;
+
+    if (cached_cluster >= 0 && strcmp(path, cached_path) == 0)
+	return cached_cluster;
+
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN] = '\0';
+    for (component = strtok(buf, "/"); component != NULL;
+	 component = strtok(NULL, "/"))
+    {
+	if (strcmp(component, ".") == 0)
+	    continue;
+	canonical_name(component, name);
+	dirent = lookup_dirent(cluster, name, image_buf, bpb);
+	if (dirent == NULL)
+	{
+	    dirent = make_dir(cluster, component, image_buf, bpb);
+	    if (dirent == NULL)
+	    {
+		fprintf(stderr, "No more space in filesystem for %s\n", path);
+		exit(1);
+	    }
+	    imported_dirs++;
+	}
+	else if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	{
+	    fprintf(stderr, "Skipping %s: %s is not a directory\n", path, name);
+	    return -1;
+	}
+	cluster = getushort(dirent->deStartCluster);
+    }
+
+    strcpy(cached_path, path);
+    cached_cluster = cluster;
+    return cluster;
+}
+
+
+/* alloc_run hands out count clusters as a single run, starting the
+   search just after the last file, and falls back on alloc_clusters()
+   (which takes whatever it can find) when there's no such run */
+int alloc_run(uint32_t count, struct extent **extents,
+	      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t total = num_clusters(bpb), c, run_start = 0;
+    uint32_t run = 0;
+    int n;
+
+    for (c = alloc_cursor; c < total && run < count; c++)
+    {
+	if (get_fat_entry(c, image_buf, bpb) != CLUST_FREE)
+	    run = 0;
+	else if (run++ == 0)
+	    run_start = c;
+    }
+    if (run == count)
+    {
+	for (c = run_start; c < run_start + count - 1; c++)
+	    set_fat_entry(c, c + 1, image_buf, bpb);
+	set_fat_entry(c, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	*extents = malloc(sizeof(struct extent));
+	(*extents)[0].start = run_start;
+	(*extents)[0].count = count;
+	alloc_cursor = run_start + count;
+	return 1;
+    }
+
+    n = alloc_clusters(count, extents, image_buf, bpb);
+    if (n < 0 && replaced.n > 0)
+    {
+	/* we can't wait for the files we've replaced any longer */
+	apply_free_batch(&replaced, image_buf, bpb);
+	n = alloc_clusters(count, extents, image_buf, bpb);
+    }
+    return n;
+}
+
+
+/* import_file reads one file's data from stdin into the image */
+void import_file(char *path, uint64_t size, time_t mtime,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    char dir[MAXPATHLEN+1], name[MAXFILENAME];
+    char *base;
+    struct direntry *dirent;
+    struct extent *ext;
+    uint64_t remaining = size;
+    uint16_t start = 0;
+    int parent, n, i;
+
+    base = strrchr(path, '/');
+    if (base != NULL)
+    {
+	memcpy(dir, path, base - path);
+	dir[base - path] = '\0';
+	base++;
+    }
+    else
+    {
+	dir[0] = '\0';
+	base = path;
+    }
+
+    if (size > UINT32_MAX)
+    {
+	fprintf(stderr, "Skipping %s: too large for FAT\n", path);
+	skip_data(size);
+	skipped++;
+	return;
+    }
+    parent = ensure_dir(dir, image_buf, bpb);
+    if (parent < 0)
+    {
+	skip_data(size);
+	skipped++;
+	return;
+    }
+
+    /* get the directory entry first, so a full directory doesn't
+       leave us with clusters nothing points at */
+    canonical_name(base, name);
+    dirent = lookup_dirent(parent, name, image_buf, bpb);
+    if (dirent != NULL && (dirent->deAttributes & ATTR_DIRECTORY) != 0)
+    {
+	fprintf(stderr, "Skipping %s: there's a directory in the way\n", path);
+	skip_data(size);
+	skipped++;
+	return;
+    }
+    if (dirent != NULL)
+	batch_chain(&replaced, getushort(dirent->deStartCluster),
+		    image_buf, bpb);
+    else
+    {
+	dirent = alloc_dirent(parent, image_buf, bpb);
+	if (dirent == NULL)
+	{
+	    fprintf(stderr, "No more space in the directory for %s\n", path);
+	    exit(1);
+	}
+    }
+    fill_dirent(dirent, base, ATTR_ARCHIVE, 0, 0);
+
+    n = 0;
+    if (size > 0)
+    {
+	n = alloc_run((size + clust_size - 1) / clust_size, &ext,
+		      image_buf, bpb);
+	if (n < 0)
+	{
+	    /* oops - we ran out of disk space */
+	    fprintf(stderr, "No more space in filesystem for %s\n", path);
+	    exit(1);
+	}
+	start = ext[0].start;
+    }
+    for (i = 0; i < n; i++)
+    {
+	uint8_t *p = cluster_to_addr(ext[i].start, image_buf, bpb);
+	uint32_t len = ext[i].count * clust_size;
+
+	dos_stats.clusters_touched += ext[i].count - 1;
+	if (len > remaining)
+	{
+	    memset(p + remaining, 0, len - remaining);
+	    len = remaining;
+	}
+	read_in(p, len);
+	mark_dirty(image_buf, DIRTY_DATA, p, ext[i].count * clust_size);
+	remaining -= len;
+    }
+    if (n > 0)
+	free(ext);
+    if (size % TAR_BLOCK != 0)
+    {
+	uint8_t pad[TAR_BLOCK];
+	read_in(pad, TAR_BLOCK - size % TAR_BLOCK);
+    }
+
+    putushort(dirent->deStartCluster, start);
+    putulong(dirent->deFileSize, size);
+    set_dirent_time(dirent, mtime);
+    mark_dirty(image_buf, DIRTY_DIR, (uint8_t*)dirent, sizeof(struct direntry));
+    imported_files++;
+    imported_bytes += size;
+}
+
+
+/* read_long_name reads the data of a GNU long name entry, or the
+   path out of a pax extended header, into name */
+void read_long_name(uint8_t *header, uint64_t size, char *name)
+{
+    uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    uint8_t *data;
+    char *p, *end;
+
+    if (padded > 1024 * 1024)
+    {
+	skip_data(size);
+	return;
+    }
+    data = malloc(padded + 1);
+    read_in(data, padded);
+    data[size] = '\0';
+
+    if (header[156] == 'L')
+    {
+	strncpy(name, (char *)data, MAXPATHLEN);
+	name[MAXPATHLEN] = '\0';
+    }
+    else
+    {
+	/* records look like "<length> <key>=<value>\n" */
+	for (p = (char *)data; p < (char *)data + size; p = end)
+	{
+	    long len = strtol(p, &end, 10);
+	    if (len <= 0 || *end != ' ' || p + len > (char *)data + size)
+		break;
+	    end = p + len;
+	    p = strchr(p, ' ') + 1;
+	    if (strncmp(p, "path=", 5) == 0 && end - p - 6 <= MAXPATHLEN)
+	    {
+		memcpy(name, p + 5, end - p - 6);
+		name[end - p - 6] = '\0';
+	    }
+	}
+    }
+    free(data);
+}
+
+
+/* import reads tar entries from stdin until the end-of-archive block */
+void import(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint8_t header[TAR_BLOCK];
+    char path[2*MAXPATHLEN+2], long_name[MAXPATHLEN+1];
+    uint64_t size;
+    int i;
+
+    long_name[0] = '\0';
+    while (read_fully(0, header, TAR_BLOCK) == TAR_BLOCK)
+    {
+	for (i = 0; i < TAR_BLOCK && header[i] == 0; i++)
+	    ;
+	if (i == TAR_BLOCK)
+	    return;
+	if (!header_ok(header))
+	{
+	    fprintf(stderr, "Bad tar header checksum - is this a tar archive?\n");
+	    exit(1);
+	}
+	size = parse_number(header + 124, 12);
+
+	if (header[156] == 'L' || header[156] == 'x')
+	{
+	    read_long_name(header, size, long_name);
+	    continue;
+	}
+	if (header[156] == 'g')
+	{
+	    skip_data(size);
+	    continue;
+	}
+
+	if (long_name[0] != '\0')
+	    strcpy(path, long_name);
+	else if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0')
+	    sprintf(path, "%.155s/%.100s", header + 345, header);
+	else
+	    sprintf(path, "%.100s", header);
+	long_name[0] = '\0';
+
+	/* don't let an archive reach outside the image's root */
+	if (strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0
+	    || strstr(path, "/../") != NULL
+	    || (strlen(path) >= 3 && strcmp(path + strlen(path) - 3, "/..") == 0))
+	{
+	    fprintf(stderr, "Skipping %s: it refers to a parent directory\n", path);
+	    skip_data(size);
+	    skipped++;
+	    continue;
+	}
+	if (strlen(path) > MAXPATHLEN)
+	{
+	    fprintf(stderr, "Skipping %s: path too long\n", path);
+	    skip_data(size);
+	    skipped++;
+	    continue;
+	}
+
+	switch (header[156])
+	{
+	case '0':
+	case '\0':
+	case '7':
+	    while (strlen(path) > 0 && path[strlen(path) - 1] == '/')
+		path[strlen(path) - 1] = '\0';
+	    import_file(path, size, (time_t)parse_number(header + 136, 12),
+			image_buf, bpb);
+	    break;
+	case '5':
+	    ensure_dir(path, image_buf, bpb);
+	    skip_data(size);
+	    break;
+	default:
+	    fprintf(stderr, "Skipping %s: only files and directories can go in a FAT image\n",
+		    path);
+	    skip_data(size);
+	    skipped++;
+	    break;
+	}
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    uint32_t buffer_limit = 4 * 1024 * 1024;
+    static uint8_t zeros[TAR_RECORD];
+    char *image = NULL;
+    uint64_t total = 0;
+    int extract = FALSE, sync_policy = SYNC_NONE;
+    int i;
+
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0)
+	usage(argv[0]);
+    for (i = 1; i < argc; i++)
+    {
+	if (strcmp(argv[i], "-x") == 0)
+	    extract = TRUE;
+	else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc)
+	    buffer_limit = parse_size(argv[++i], argv[0]);
+	else if (strncmp(argv[i], "--sync=", 7) == 0)
+	{
+	    sync_policy = parse_sync_policy(argv[i] + 7);
+	    if (sync_policy < 0)
+		usage(argv[0]);
+	}
+	else if (argv[i][0] == '-' || image != NULL)
+	    usage(argv[0]);
+	else
+	    image = argv[i];
+    }
+    if (image == NULL)
+    {
+	usage(argv[0]);
+    }
+    if (isatty(extract ? 0 : 1))
+    {
+	fprintf(stderr, "Refusing to %s a tar archive %s a terminal\n",
+		extract ? "read" : "write", extract ? "from" : "to");
+	exit(1);
+    }
+
+    image_buf = mmap_file(image, &fd);
+    bpb = check_bootsector(image_buf);
+
+    if (extract)
+    {
+	stats_phase(PHASE_DATA);
+	import(image_buf, bpb);
+	apply_free_batch(&replaced, image_buf, bpb);
+	sync_fat_copies(image_buf, bpb);
+	if (flush_dirty(image_buf, sync_policy) < 0)
+	{
+	    fprintf(stderr, "Failed to flush changes to the disk image\n");
+	    exit(1);
+	}
+	fprintf(stderr, "Unpacked %u files (%llu bytes) and made %u directories; skipped %u entries\n",
+		imported_files, (unsigned long long)imported_bytes,
+		imported_dirs, skipped);
+	free(replaced.clusters);
+	unmmap_file(image_buf, &fd);
+	free(bpb);
+	return 0;
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+
+    collect(MSDOSFSROOT, "", image_buf, bpb);
+    plan_reads(bpb->bpbBytesPerSec * bpb->bpbSecPerClust);
+    madvise(image_buf, cluster_to_addr(num_clusters(bpb), image_buf, bpb)
+	    - image_buf, MADV_SEQUENTIAL);
+    stats_phase(PHASE_DATA);
+    export(buffer_limit, image_buf, bpb);
+
+    /* two zero blocks end the archive, padded out to a whole record */
+    write_out(zeros, 2 * TAR_BLOCK);
+    if (bytes_out % TAR_RECORD != 0)
+	write_out(zeros, TAR_RECORD - bytes_out % TAR_RECORD);
+    if (fflush(stdout) != 0)
+    {
+	fprintf(stderr, "Error writing the tar stream: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    for (i = 0; i < nfiles; i++)
+    {
+	total += files[i].size;
+	free(files[i].extents);
+    }
+    fprintf(stderr, "%d entries, %llu bytes of file data; held back at most %llu bytes, read %llu bytes out of order\n",
+	    nfiles, (unsigned long long)total, (unsigned long long)max_buffered,
+	    (unsigned long long)out_of_order);
+
+    free(files);
+    free(pieces);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+
+    return 0;
+}
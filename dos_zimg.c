@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "zimage.h"
+
+
+/* dos_zimg turns disk images into compressed images (see zimage.h),
+   which every tool that only reads an image can open as it is, and
+   turns them back.
+
+   Compressing is done by a pool of threads, a block at a time; the
+   blocks are then written out in order, leaving out the blocks of
+   zeros and the second and later copies of any block seen before. */
+
+#define MAXTHREADS 64
+
+struct packed {
+    uint8_t *data;		/* as it'll be stored; NULL for zeros */
+    uint32_t length, crc;
+};
+
+int image_fd;
+struct zimage_header header;
+struct packed *blocks;
+uint32_t next_block = 0;
+int level = Z_DEFAULT_COMPRESSION;
+pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s compress [-b blocksize] [-l level] [-j threads] <imagename> <newimage>\n", progname);
+    fprintf(stderr, "\twrites a compressed copy of imagename\n");
+    fprintf(stderr, "\t-b: bytes in each block, a power of two from the page size to 1M\n\t\t(default: 64K)\n");
+    fprintf(stderr, "\t-l: zlib compression level, 1 to 9 (default: 6)\n");
+    fprintf(stderr, "\t-j: how many threads to compress with (default: one per processor)\n");
+    fprintf(stderr, "       %s expand <imagename> <newimage>\n", progname);
+    fprintf(stderr, "\twrites the plain image in a compressed one\n");
+    fprintf(stderr, "       %s info <imagename>\n", progname);
+    fprintf(stderr, "\tsays how a compressed image is stored\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
+    exit(1);
+}
+
+
+uint32_t parse_size(char *arg, char *progname)
+{
+    char *end;
+    unsigned long v = strtoul(arg, &end, 10);
+
+    if (*end == 'K' || *end == 'k')
+    {
+	v *= 1024;
+	end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+	v *= 1024 * 1024;
+	end++;
+    }
+    if (end == arg || *end != '\0' || v < 512 || v > ZIMAGE_MAXBLOCK
+	|| (v & (v - 1)) != 0 || v < sysconf(_SC_PAGESIZE))
+	usage(progname);
+    return v;
+}
+
+
+int is_zeros(uint8_t *p, uint32_t len)
+{
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+
+int pwrite_all(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    ssize_t bytes;
+    size_t done;
+
+    for (done = 0; done < len; done += bytes)
+    {
+	bytes = pwrite(fd, buf + done, len - done, offset + done);
+	if (bytes < 0 && errno == EINTR)
+	{
+	    bytes = 0;
+	    continue;
+	}
+	if (bytes <= 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+/* pack_block reads block b of the image and compresses it, keeping
+   it as it is if that doesn't make it any smaller */
+void pack_block(uint32_t b, uint8_t *buf, uint8_t *out, uLong out_size)
+{
+    uint64_t offset = (uint64_t)b * header.block_size;
+    uint32_t size = header.image_size - offset < header.block_size
+	? header.image_size - offset : header.block_size;
+    uLongf length = out_size;
+    ssize_t bytes;
+    uint32_t done;
+
+    for (done = 0; done < size; done += bytes)
+    {
+	bytes = pread(image_fd, buf + done, size - done, offset + done);
+	if (bytes < 0 && errno == EINTR)
+	{
+	    bytes = 0;
+	    continue;
+	}
+	if (bytes <= 0)
+	{
+	    fprintf(stderr, "Failed to read the image: %s\n",
+		    bytes < 0 ? strerror(errno) : "file got shorter");
+	    exit(1);
+	}
+    }
+
+    blocks[b].crc = crc32(0, buf, size);
+    if (is_zeros(buf, size))
+    {
+	blocks[b].data = NULL;
+	blocks[b].length = 0;
+	return;
+    }
+    if (compress2(out, &length, buf, size, level) != Z_OK || length >= size)
+    {
+	out = buf;
+	length = size;
+    }
+    blocks[b].data = malloc(length);
+    if (blocks[b].data == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    memcpy(blocks[b].data, out, length);
+    blocks[b].length = length;
+}
+
+
+void *worker(void *arg)
+{
+    uLong out_size = compressBound(header.block_size);
+    uint8_t *buf = malloc(header.block_size), *out = malloc(out_size);
+    uint32_t b;
+
+    while (TRUE)
+    {
+	pthread_mutex_lock(&next_lock);
+	b = next_block++;
+	pthread_mutex_unlock(&next_lock);
+	if (b >= header.nblocks)
+	    break;
+	pack_block(b, buf, out, out_size);
+    }
+    free(buf);
+    free(out);
+    return NULL;
+}
+
+
+/* stored_before finds an earlier block with the same contents as b,
+   through a table of the blocks stored so far hashed on their CRCs.
+   Returns that block's number, or b after adding b to the table. */
+uint32_t stored_before(uint32_t b, uint32_t *table, uint32_t table_size)
+{
+    uint32_t i = blocks[b].crc % table_size, other;
+
+    for (; table[i] != UINT32_MAX; i = (i + 1) % table_size)
+    {
+	other = table[i];
+	if (blocks[other].crc == blocks[b].crc
+	    && blocks[other].length == blocks[b].length
+	    && memcmp(blocks[other].data, blocks[b].data, blocks[b].length) == 0)
+	    return other;
+    }
+    table[i] = b;
+    return b;
+}
+
+
+void compress_image(char *image, char *new_image, uint32_t block_size,
+		    int nthreads)
+{
+    pthread_t threads[MAXTHREADS];
+    struct zimage_block *index;
+    struct stat statbuf;
+    uint32_t *table, table_size, b, same, zeros = 0, shared = 0;
+    uint64_t offset;
+    int i, started = 0, out_fd;
+
+    image_fd = open(image, O_RDONLY);
+    if (image_fd < 0 || fstat(image_fd, &statbuf) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", image,
+		strerror(errno));
+	exit(1);
+    }
+    if (zimage_is(image_fd))
+    {
+	fprintf(stderr, "%s is compressed already\n", image);
+	exit(1);
+    }
+    if (statbuf.st_size == 0)
+    {
+	fprintf(stderr, "%s is empty\n", image);
+	exit(1);
+    }
+
+    memcpy(header.magic, ZIMAGE_MAGIC, sizeof(header.magic));
+    header.block_size = block_size;
+    header.image_size = statbuf.st_size;
+    header.nblocks = (header.image_size + block_size - 1) / block_size;
+    blocks = calloc(header.nblocks, sizeof(struct packed));
+    index = calloc(header.nblocks, sizeof(struct zimage_block));
+
+    stats_phase(PHASE_DATA);
+    if (nthreads > header.nblocks)
+	nthreads = header.nblocks;
+    for (i = 0; i < nthreads; i++)
+    {
+	if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+	    break;
+	started++;
+    }
+    /* if no thread could be started, do it all here */
+    if (started == 0)
+	worker(NULL);
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+    dos_stats.bytes_in += header.image_size;
+
+    out_fd = open(new_image, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (out_fd < 0)
+    {
+	fprintf(stderr, "Cannot make %s: %s\n", new_image, strerror(errno));
+	exit(1);
+    }
+    table_size = 2 * header.nblocks + 1;
+    table = malloc(table_size * sizeof(uint32_t));
+    memset(table, 0xff, table_size * sizeof(uint32_t));
+
+    offset = sizeof(header);
+    for (b = 0; b < header.nblocks; b++)
+    {
+	index[b].length = blocks[b].length;
+	index[b].crc = blocks[b].crc;
+	if (blocks[b].length == 0)
+	{
+	    zeros++;
+	    continue;
+	}
+	same = stored_before(b, table, table_size);
+	if (same != b)
+	{
+	    index[b].offset = index[same].offset;
+	    shared++;
+	    continue;
+	}
+	if (pwrite_all(out_fd, blocks[b].data, blocks[b].length, offset) < 0)
+	    goto failed;
+	index[b].offset = offset;
+	offset += blocks[b].length;
+    }
+
+    header.index_offset = (offset + 7) & ~(uint64_t)7;
+    stats_phase(PHASE_FLUSH);
+    if (pwrite_all(out_fd, (uint8_t*)index,
+		   header.nblocks * sizeof(struct zimage_block),
+		   header.index_offset) < 0
+	|| pwrite_all(out_fd, (uint8_t*)&header, sizeof(header), 0) < 0
+	|| fsync(out_fd) < 0 || close(out_fd) < 0)
+	goto failed;
+
+    offset = header.index_offset + header.nblocks * sizeof(struct zimage_block);
+    dos_stats.bytes_out += offset;
+    printf("Wrote %s: %llu bytes in %u blocks (%u of zeros, %u repeats) "
+	   "as %llu bytes, %.1f%%\n", new_image,
+	   (unsigned long long)header.image_size, header.nblocks, zeros, shared,
+	   (unsigned long long)offset, 100.0 * offset / header.image_size);
+    for (b = 0; b < header.nblocks; b++)
+	free(blocks[b].data);
+    free(blocks);
+    free(index);
+    free(table);
+    close(image_fd);
+    return;
+
+failed:
+    fprintf(stderr, "Failed to write %s: %s\n", new_image, strerror(errno));
+    unlink(new_image);
+    exit(1);
+}
+
+
+/* expand_image goes through the mapped image like the other tools do,
+   writing out each block that isn't zeros; the zeros are left as holes */
+void expand_image(char *image, char *new_image)
+{
+    struct zimage_block *index;
+    uint8_t *image_buf;
+    uint64_t size, offset;
+    uint32_t b, len;
+    int fd, out_fd;
+
+    fd = open(image, O_RDONLY);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", image,
+		strerror(errno));
+	exit(1);
+    }
+    if (!zimage_is(fd) || zimage_read_index(fd, &header, &index) < 0)
+    {
+	fprintf(stderr, "%s is not a compressed image\n", image);
+	exit(1);
+    }
+    image_buf = zimage_map(fd, image, &size, FALSE);
+    if (image_buf == NULL)
+    {
+	fprintf(stderr, "Cannot read compressed image %s: %s\n", image,
+		strerror(errno));
+	exit(1);
+    }
+    out_fd = open(new_image, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (out_fd < 0)
+    {
+	fprintf(stderr, "Cannot make %s: %s\n", new_image, strerror(errno));
+	exit(1);
+    }
+
+    stats_phase(PHASE_DATA);
+    for (b = 0; b < header.nblocks; b++)
+    {
+	if (index[b].length == 0)
+	    continue;
+	offset = (uint64_t)b * header.block_size;
+	len = size - offset < header.block_size ? size - offset
+	    : header.block_size;
+	zimage_touch(image_buf + offset, len);
+	if (pwrite_all(out_fd, image_buf + offset, len, offset) < 0)
+	    goto failed;
+	dos_stats.bytes_out += len;
+    }
+    stats_phase(PHASE_FLUSH);
+    if (ftruncate(out_fd, size) < 0 || fsync(out_fd) < 0 || close(out_fd) < 0)
+	goto failed;
+
+    printf("Wrote %s: %llu bytes\n", new_image, (unsigned long long)size);
+    zimage_unmap(image_buf);
+    free(index);
+    close(fd);
+    return;
+
+failed:
+    fprintf(stderr, "Failed to write %s: %s\n", new_image, strerror(errno));
+    unlink(new_image);
+    exit(1);
+}
+
+
+void info(char *image)
+{
+    struct zimage_block *index;
+    struct stat statbuf;
+    uint32_t b, zeros = 0, raw = 0, packed = 0, shared = 0;
+    uint64_t stored = 0, inflated = 0, offset, size;
+    int fd;
+
+    fd = open(image, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) < 0)
+    {
+	fprintf(stderr, "Cannot read disk image file %s: %s\n", image,
+		strerror(errno));
+	exit(1);
+    }
+    if (zimage_read_index(fd, &header, &index) < 0)
+    {
+	fprintf(stderr, "%s is not a compressed image\n", image);
+	exit(1);
+    }
+
+    /* blocks are stored in order, so a block that's stored earlier in
+       the file than the ones before it is a repeat */
+    for (b = 0; b < header.nblocks; b++)
+    {
+	offset = (uint64_t)b * header.block_size;
+	size = header.image_size - offset < header.block_size
+	    ? header.image_size - offset : header.block_size;
+	if (index[b].length == 0)
+	    zeros++;
+	else if (index[b].offset < stored + sizeof(header))
+	    shared++;
+	else
+	{
+	    if (index[b].length == size)
+		raw++;
+	    else
+	    {
+		packed++;
+		inflated += size;
+	    }
+	    stored += index[b].length;
+	}
+    }
+
+    printf("%s: a %llu byte image in %u blocks of %u bytes\n", image,
+	   (unsigned long long)header.image_size, header.nblocks,
+	   header.block_size);
+    printf("%u compressed, %u stored as they are, %u of zeros, %u repeats\n",
+	   packed, raw, zeros, shared);
+    printf("%llu bytes stored, %llu bytes in the file, %.1f%% of the image\n",
+	   (unsigned long long)stored, (unsigned long long)statbuf.st_size,
+	   100.0 * statbuf.st_size / header.image_size);
+    free(index);
+    close(fd);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint32_t block_size = ZIMAGE_BLOCK;
+    int nthreads = 0, i;
+    char *args[2];
+    int nargs = 0;
+
+    stats_option(&argc, argv);
+    if (argc == 4 && strcmp(argv[1], "expand") == 0)
+	expand_image(argv[2], argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "info") == 0)
+	info(argv[2]);
+    else if (argc > 1 && strcmp(argv[1], "compress") == 0)
+    {
+	for (i = 2; i < argc; i++)
+	{
+	    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+		block_size = parse_size(argv[++i], argv[0]);
+	    else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+	    {
+		level = atoi(argv[++i]);
+		if (level < 1 || level > 9)
+		    usage(argv[0]);
+	    }
+	    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+	    {
+		nthreads = atoi(argv[++i]);
+		if (nthreads < 1)
+		    usage(argv[0]);
+	    }
+	    else if (argv[i][0] == '-' || nargs == 2)
+		usage(argv[0]);
+	    else
+		args[nargs++] = argv[i];
+	}
+	if (nargs != 2)
+	    usage(argv[0]);
+	if (nthreads == 0)
+	    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+	    nthreads = 1;
+	if (nthreads > MAXTHREADS)
+	    nthreads = MAXTHREADS;
+	compress_image(args[0], args[1], block_size, nthreads);
+    }
+    else
+	usage(argv[0]);
+    return 0;
+}
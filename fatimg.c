@@ -0,0 +1,797 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "fatimg.h"
+
+
+/* The library only uses the parts of dos.c that work on the bytes
+   they're handed - fat12_get(), read_bpb(), dirent_filename() and the
+   like - never the ones with global state, output or exit() calls.
+   Everything else it needs is kept in the handle. */
+
+static char *messages[] = {
+    "success",
+    "I/O error",
+    "not a FAT-12 disk image",
+    "no such file or directory",
+    "not a directory",
+    "is a directory",
+    "no space left in the image",
+    "image is open read-only",
+    "invalid argument",
+    "cluster chain is broken",
+};
+
+
+const char *fatimg_strerror(int status)
+{
+    if (status > 0 || -status >= (int)(sizeof(messages) / sizeof(messages[0])))
+	return "unknown error";
+    return messages[-status];
+}
+
+
+static uint16_t fat_get(struct fatimg *img, uint16_t cluster)
+{
+    return img->fatcache[cluster & FAT12_MASK];
+}
+
+
+/* fat_set updates the decoded copy and every copy on disk at once */
+static void fat_set(struct fatimg *img, uint16_t cluster, uint16_t value)
+{
+    uint32_t fat_bytes = img->bpb.bpbFATsecs * img->bpb.bpbBytesPerSec;
+    int i;
+
+    img->fatcache[cluster & FAT12_MASK] = value;
+    for (i = 0; i < img->bpb.bpbFATs; i++)
+	fat12_set(img->fat + i * fat_bytes, cluster, value);
+}
+
+
+static int valid_cluster(struct fatimg *img, uint16_t cluster)
+{
+    return cluster >= CLUST_FIRST && cluster < img->nclusters;
+}
+
+
+static uint8_t *clust_addr(struct fatimg *img, uint16_t cluster)
+{
+    return img->data + (uint32_t)(cluster - CLUST_FIRST) * img->clust_size;
+}
+
+
+/* sane_bpb checks that the image is big enough for everything the boot
+   sector describes, so that nothing later can point outside it */
+static int sane_bpb(struct fatimg *img)
+{
+    struct bpb33 *bpb = &img->bpb;
+    uint32_t root_secs, overhead;
+
+    if (bpb->bpbBytesPerSec < 512 || bpb->bpbBytesPerSec > 4096
+	|| (bpb->bpbBytesPerSec & (bpb->bpbBytesPerSec - 1)) != 0
+	|| bpb->bpbSecPerClust == 0
+	|| (bpb->bpbSecPerClust & (bpb->bpbSecPerClust - 1)) != 0
+	|| bpb->bpbFATs == 0 || bpb->bpbFATsecs == 0
+	|| bpb->bpbRootDirEnts == 0 || bpb->bpbResSectors == 0)
+	return FALSE;
+
+    root_secs = (bpb->bpbRootDirEnts * sizeof(struct direntry)
+		 + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec;
+    overhead = bpb->bpbResSectors + bpb->bpbFATs * bpb->bpbFATsecs + root_secs;
+    if (overhead + bpb->bpbSecPerClust > bpb->bpbSectors
+	|| (uint64_t)bpb->bpbSectors * bpb->bpbBytesPerSec > img->size)
+	return FALSE;
+
+    /* FAT-12 has room for 0xff6 clusters, and each FAT must hold them */
+    img->nclusters = num_clusters(bpb);
+    if (img->nclusters > (FAT12_MASK & CLUST_RSRVDS)
+	|| (uint32_t)bpb->bpbFATsecs * bpb->bpbBytesPerSec
+	   < (3 * (uint32_t)img->nclusters + 1) / 2)
+	return FALSE;
+    return TRUE;
+}
+
+
+int fatimg_open(struct fatimg *img, const char *path, int flags)
+{
+    struct stat statbuf;
+    int prot = PROT_READ, saved_errno, status;
+    uint16_t cluster;
+
+    if (img == NULL || path == NULL
+	|| (flags != FATIMG_RDONLY && flags != FATIMG_RDWR))
+	return FATIMG_ERR_INVAL;
+
+    memset(img, 0, sizeof(*img));
+    img->writable = (flags == FATIMG_RDWR);
+    img->fd = open(path, img->writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0)
+	return FATIMG_ERR_IO;
+    if (fstat(img->fd, &statbuf) < 0)
+    {
+	status = FATIMG_ERR_IO;
+	goto fail;
+    }
+    if (statbuf.st_size < 512)
+    {
+	status = FATIMG_ERR_FORMAT;
+	goto fail;
+    }
+    img->size = statbuf.st_size;
+
+    if (img->writable)
+	prot |= PROT_WRITE;
+    img->image = mmap(NULL, img->size, prot, MAP_SHARED, img->fd, 0);
+    if (img->image == MAP_FAILED)
+    {
+	img->image = NULL;
+	status = FATIMG_ERR_IO;
+	goto fail;
+    }
+
+    read_bpb(img->image, &img->bpb);
+    if (!sane_bpb(img))
+    {
+	status = FATIMG_ERR_FORMAT;
+	goto fail;
+    }
+    img->clust_size = img->bpb.bpbBytesPerSec * img->bpb.bpbSecPerClust;
+    img->fat = img->image + img->bpb.bpbResSectors * img->bpb.bpbBytesPerSec;
+    img->root = root_dir_addr(img->image, &img->bpb);
+    img->data = img->root + img->bpb.bpbRootDirEnts * sizeof(struct direntry);
+    for (cluster = 0; cluster < img->nclusters; cluster++)
+	img->fatcache[cluster] = fat12_get(img->fat, cluster);
+
+    if (pthread_rwlock_init(&img->lock, NULL) != 0)
+    {
+	status = FATIMG_ERR_IO;
+	goto fail;
+    }
+    pthread_mutex_init(&img->dircache_lock, NULL);
+    return FATIMG_OK;
+
+ fail:
+    saved_errno = errno;
+    if (img->image != NULL)
+	munmap(img->image, img->size);
+    close(img->fd);
+    errno = saved_errno;
+    return status;
+}
+
+
+int fatimg_close(struct fatimg *img)
+{
+    int status = FATIMG_OK;
+
+    if (img == NULL || img->image == NULL)
+	return FATIMG_ERR_INVAL;
+    pthread_rwlock_destroy(&img->lock);
+    pthread_mutex_destroy(&img->dircache_lock);
+    if (munmap(img->image, img->size) < 0)
+	status = FATIMG_ERR_IO;
+    if (close(img->fd) < 0)
+	status = FATIMG_ERR_IO;
+    img->image = NULL;
+    return status;
+}
+
+
+int fatimg_sync(struct fatimg *img)
+{
+    int status = FATIMG_OK;
+
+    if (img == NULL || img->image == NULL)
+	return FATIMG_ERR_INVAL;
+    if (!img->writable)
+	return FATIMG_OK;
+
+    /* a shared lock is enough to keep writers from changing things
+       half way through */
+    pthread_rwlock_rdlock(&img->lock);
+    if (msync(img->image, img->size, MS_SYNC) < 0)
+	status = FATIMG_ERR_IO;
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+
+/* walking the slots of a directory */
+struct dir_iter {
+    uint16_t cluster;
+    uint32_t i, n;	/* slot within this cluster, and slots per cluster */
+    uint32_t slot;	/* slots handed out so far */
+    uint32_t steps;
+};
+
+
+static void dir_start(struct fatimg *img, struct dir_iter *it, uint16_t dir)
+{
+    it->cluster = dir;
+    it->i = it->slot = it->steps = 0;
+    if (dir == MSDOSFSROOT)
+	it->n = img->bpb.bpbRootDirEnts;
+    else if (valid_cluster(img, dir))
+	it->n = img->clust_size / sizeof(struct direntry);
+    else
+	it->n = 0;
+}
+
+
+/* dir_next returns the next slot of the directory, or NULL at the end
+   of its cluster chain.  A chain that loops gives out after it has
+   visited as many clusters as the disk has. */
+static struct direntry *dir_next(struct fatimg *img, struct dir_iter *it)
+{
+    uint16_t next;
+    uint8_t *base;
+
+    if (it->n == 0)
+	return NULL;
+    if (it->i == it->n)
+    {
+	if (it->cluster == MSDOSFSROOT)
+	    return NULL;
+	next = fat_get(img, it->cluster);
+	if (!valid_cluster(img, next) || ++it->steps >= img->nclusters)
+	    return NULL;
+	it->cluster = next;
+	it->i = 0;
+    }
+    base = (it->cluster == MSDOSFSROOT) ? img->root
+	: clust_addr(img, it->cluster);
+    it->slot++;
+    return (struct direntry*)base + it->i++;
+}
+
+
+/* is_live says whether a slot holds a real file or directory, as
+   opposed to a free slot, ".", "..", a volume label or a long filename
+   piece */
+static int is_live(struct direntry *dirent)
+{
+    if (dirent->deName[0] == SLOT_EMPTY || dirent->deName[0] == SLOT_DELETED
+	|| dirent->deName[0] == '.')
+	return FALSE;
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+	|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+	return FALSE;
+    return TRUE;
+}
+
+
+static void fill_entry(struct direntry *dirent, struct fatimg_entry *entry)
+{
+    dirent_filename(dirent, entry->name);
+    entry->attributes = dirent->deAttributes;
+    entry->size = getulong(dirent->deFileSize);
+    entry->start_cluster = getushort(dirent->deStartCluster);
+    entry->mtime = dirent_time(dirent);
+}
+
+
+/* find_in_dir returns the live entry called name in the directory
+   starting at dir, or NULL */
+static struct direntry *find_in_dir(struct fatimg *img, uint16_t dir,
+				    const char *name)
+{
+    char buffer[MAXFILENAME];
+    struct direntry *dirent;
+    struct dir_iter it;
+
+    dir_start(img, &it, dir);
+    while ((dirent = dir_next(img, &it)) != NULL)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    return NULL;
+	if (!is_live(dirent))
+	    continue;
+	dirent_filename(dirent, buffer);
+	if (strcasecmp(buffer, name) == 0)
+	    return dirent;
+    }
+    return NULL;
+}
+
+
+/* find_dir finds where the directory at path (relative to the root,
+   with no leading '/') starts.  Directories never move once made, so
+   the answer is remembered for next time. */
+static int find_dir(struct fatimg *img, char *path, uint16_t *dir)
+{
+    char buf[MAXPATHLEN+1], *component, *save;
+    struct direntry *dirent;
+    uint16_t cluster = MSDOSFSROOT;
+    int i;
+
+    if (path[0] == '\0')
+    {
+	*dir = MSDOSFSROOT;
+	return FATIMG_OK;
+    }
+
+    pthread_mutex_lock(&img->dircache_lock);
+    for (i = 0; i < FATIMG_DIRCACHE; i++)
+    {
+	if (img->dircache[i].path[0] != '\0'
+	    && strcasecmp(img->dircache[i].path, path) == 0)
+	{
+	    *dir = img->dircache[i].cluster;
+	    pthread_mutex_unlock(&img->dircache_lock);
+	    return FATIMG_OK;
+	}
+    }
+    pthread_mutex_unlock(&img->dircache_lock);
+
+    strcpy(buf, path);
+    for (component = strtok_r(buf, "/", &save); component != NULL;
+	 component = strtok_r(NULL, "/", &save))
+    {
+	dirent = find_in_dir(img, cluster, component);
+	if (dirent == NULL)
+	    return FATIMG_ERR_NOENT;
+	if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    return FATIMG_ERR_NOTDIR;
+	cluster = getushort(dirent->deStartCluster);
+    }
+
+    pthread_mutex_lock(&img->dircache_lock);
+    i = img->dircache_next;
+    img->dircache_next = (i + 1) % FATIMG_DIRCACHE;
+    strcpy(img->dircache[i].path, path);
+    img->dircache[i].cluster = cluster;
+    pthread_mutex_unlock(&img->dircache_lock);
+
+    *dir = cluster;
+    return FATIMG_OK;
+}
+
+
+/* resolve finds the directory entry for path.  The root directory has
+   no entry of its own, so for it *dirent is set to NULL. */
+static int resolve(struct fatimg *img, const char *path,
+		   struct direntry **dirent)
+{
+    char buf[MAXPATHLEN+1], *dirpath, *name, *slash;
+    uint16_t dir;
+    int status;
+
+    *dirent = NULL;
+    if (strlen(path) > MAXPATHLEN)
+	return FATIMG_ERR_INVAL;
+
+    /* split into the directory and the last name, ignoring slashes at
+       either end */
+    while (*path == '/')
+	path++;
+    strcpy(buf, path);
+    for (slash = buf + strlen(buf); slash > buf && slash[-1] == '/'; slash--)
+	slash[-1] = '\0';
+    if (buf[0] == '\0')
+	return FATIMG_OK;
+
+    slash = strrchr(buf, '/');
+    if (slash != NULL)
+    {
+	*slash = '\0';
+	dirpath = buf;
+	name = slash + 1;
+    }
+    else
+    {
+	dirpath = "";
+	name = buf;
+    }
+
+    status = find_dir(img, dirpath, &dir);
+    if (status != FATIMG_OK)
+	return status;
+    *dirent = find_in_dir(img, dir, name);
+    return (*dirent != NULL) ? FATIMG_OK : FATIMG_ERR_NOENT;
+}
+
+
+/* resolve_dir finds the first cluster of the directory at path */
+static int resolve_dir(struct fatimg *img, const char *path, uint16_t *dir)
+{
+    struct direntry *dirent;
+    int status = resolve(img, path, &dirent);
+
+    if (status != FATIMG_OK)
+	return status;
+    if (dirent == NULL)
+	*dir = MSDOSFSROOT;
+    else if ((dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	return FATIMG_ERR_NOTDIR;
+    else
+	*dir = getushort(dirent->deStartCluster);
+    return FATIMG_OK;
+}
+
+
+int fatimg_lookup(struct fatimg *img, const char *path,
+		  struct fatimg_entry *entry)
+{
+    struct direntry *dirent;
+    int status;
+
+    if (img == NULL || path == NULL || entry == NULL)
+	return FATIMG_ERR_INVAL;
+
+    pthread_rwlock_rdlock(&img->lock);
+    status = resolve(img, path, &dirent);
+    if (status == FATIMG_OK)
+    {
+	if (dirent != NULL)
+	    fill_entry(dirent, entry);
+	else
+	{
+	    memset(entry, 0, sizeof(*entry));
+	    entry->attributes = ATTR_DIRECTORY;
+	}
+    }
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+
+int fatimg_list(struct fatimg *img, const char *path, uint32_t *cookie,
+		struct fatimg_entry *entries, uint32_t max, uint32_t *count)
+{
+    struct direntry *dirent;
+    struct dir_iter it;
+    uint16_t dir;
+    int status;
+
+    if (img == NULL || path == NULL || cookie == NULL || count == NULL
+	|| (entries == NULL && max > 0))
+	return FATIMG_ERR_INVAL;
+
+    *count = 0;
+    pthread_rwlock_rdlock(&img->lock);
+    status = resolve_dir(img, path, &dir);
+    if (status == FATIMG_OK)
+    {
+	dir_start(img, &it, dir);
+	while (*count < max && (dirent = dir_next(img, &it)) != NULL)
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		break;
+	    if (it.slot <= *cookie || !is_live(dirent))
+		continue;
+	    fill_entry(dirent, &entries[(*count)++]);
+	    *cookie = it.slot;
+	}
+    }
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+
+int fatimg_read(struct fatimg *img, const char *path, uint32_t offset,
+		void *buf, uint32_t len, uint32_t *got)
+{
+    struct direntry *dirent;
+    uint32_t size, skip, pos, n, steps = 0;
+    uint16_t cluster;
+    int status;
+
+    if (img == NULL || path == NULL || got == NULL || (buf == NULL && len > 0))
+	return FATIMG_ERR_INVAL;
+
+    *got = 0;
+    pthread_rwlock_rdlock(&img->lock);
+    status = resolve(img, path, &dirent);
+    if (status == FATIMG_OK
+	&& (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) != 0))
+	status = FATIMG_ERR_ISDIR;
+    if (status != FATIMG_OK)
+	goto done;
+
+    size = getulong(dirent->deFileSize);
+    if (offset >= size)
+	goto done;
+    if (len > size - offset)
+	len = size - offset;
+
+    cluster = getushort(dirent->deStartCluster);
+    for (skip = offset / img->clust_size; skip > 0; skip--)
+    {
+	if (!valid_cluster(img, cluster))
+	{
+	    status = FATIMG_ERR_CORRUPT;
+	    goto done;
+	}
+	cluster = fat_get(img, cluster);
+    }
+
+    pos = offset % img->clust_size;
+    while (*got < len)
+    {
+	if (!valid_cluster(img, cluster) || steps++ >= img->nclusters)
+	{
+	    status = FATIMG_ERR_CORRUPT;
+	    break;
+	}
+	n = img->clust_size - pos;
+	if (n > len - *got)
+	    n = len - *got;
+	memcpy((uint8_t*)buf + *got, clust_addr(img, cluster) + pos, n);
+	*got += n;
+	pos = 0;
+	cluster = fat_get(img, cluster);
+    }
+
+ done:
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+
+/* next_free returns the first free cluster at or after cluster, or 0 */
+static uint16_t next_free(struct fatimg *img, uint16_t cluster)
+{
+    for ( ; cluster < img->nclusters; cluster++)
+    {
+	if (fat_get(img, cluster) == CLUST_FREE)
+	    return cluster;
+    }
+    return 0;
+}
+
+
+/* write_locked does fatimg_write()'s work, with the lock held.  Every
+   check that can fail happens before anything is changed. */
+static int write_locked(struct fatimg *img, char *dirpath, char *name,
+			const uint8_t *buf, uint32_t len)
+{
+    struct direntry proto, *dirent, *old = NULL, *slot = NULL;
+    char canonical[MAXFILENAME], existing[MAXFILENAME];
+    uint32_t need, grow, nfree = 0, done, n, steps = 0;
+    uint16_t dir, cluster, start = 0, prev = 0, next;
+    struct dir_iter it;
+    int status;
+
+    status = resolve_dir(img, dirpath, &dir);
+    if (status != FATIMG_OK)
+	return status;
+
+    /* the name as it will be stored, so "readme.text" matches README.TEX */
+    fill_dirent(&proto, name, ATTR_ARCHIVE, 0, len);
+    dirent_filename(&proto, canonical);
+
+    dir_start(img, &it, dir);
+    while ((dirent = dir_next(img, &it)) != NULL)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY
+	    || dirent->deName[0] == SLOT_DELETED)
+	{
+	    if (slot == NULL)
+		slot = dirent;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		break;
+	    continue;
+	}
+	if (!is_live(dirent))
+	    continue;
+	dirent_filename(dirent, existing);
+	if (strcasecmp(existing, canonical) == 0)
+	{
+	    old = dirent;
+	    break;
+	}
+    }
+    if (old != NULL && (old->deAttributes & ATTR_DIRECTORY) != 0)
+	return FATIMG_ERR_ISDIR;
+
+    /* a full subdirectory gets another cluster; the root can't grow */
+    grow = (old == NULL && slot == NULL);
+    if (grow && dir == MSDOSFSROOT)
+	return FATIMG_ERR_NOSPC;
+
+    need = (len + img->clust_size - 1) / img->clust_size;
+    for (cluster = CLUST_FIRST;
+	 cluster < img->nclusters && nfree < need + grow; cluster++)
+    {
+	if (fat_get(img, cluster) == CLUST_FREE)
+	    nfree++;
+    }
+    if (nfree < need + grow)
+	return FATIMG_ERR_NOSPC;
+
+    /* the data goes into fresh clusters, so the old contents stay
+       intact until the directory entry moves over */
+    cluster = CLUST_FIRST;
+    for (done = 0; done < need; done++)
+    {
+	cluster = next_free(img, cluster);
+	n = len - done * img->clust_size;
+	if (n > img->clust_size)
+	    n = img->clust_size;
+	memcpy(clust_addr(img, cluster), buf + done * img->clust_size, n);
+	memset(clust_addr(img, cluster) + n, 0, img->clust_size - n);
+	fat_set(img, cluster, FAT12_MASK & CLUST_EOFS);
+	if (prev != 0)
+	    fat_set(img, prev, cluster);
+	else
+	    start = cluster;
+	prev = cluster;
+    }
+
+    if (grow)
+    {
+	cluster = next_free(img, cluster);
+	memset(clust_addr(img, cluster), 0, img->clust_size);
+	fat_set(img, cluster, FAT12_MASK & CLUST_EOFS);
+	fat_set(img, it.cluster, cluster);
+	slot = (struct direntry*)clust_addr(img, cluster);
+    }
+
+    if (old == NULL)
+    {
+	putushort(proto.deStartCluster, start);
+	memcpy(slot, &proto, sizeof(struct direntry));
+	return FATIMG_OK;
+    }
+
+    cluster = getushort(old->deStartCluster);
+    putushort(old->deStartCluster, start);
+    putulong(old->deFileSize, len);
+    set_dirent_time(old, time(NULL));
+
+    while (valid_cluster(img, cluster) && steps++ < img->nclusters)
+    {
+	next = fat_get(img, cluster);
+	fat_set(img, cluster, CLUST_FREE);
+	cluster = next;
+    }
+    return FATIMG_OK;
+}
+
+
+int fatimg_write(struct fatimg *img, const char *path, const void *buf,
+		 uint32_t len)
+{
+    char dirpath[MAXPATHLEN+1], name[MAXPATHLEN+1], *slash;
+    int status;
+
+    if (img == NULL || path == NULL || (buf == NULL && len > 0))
+	return FATIMG_ERR_INVAL;
+    if (!img->writable)
+	return FATIMG_ERR_RDONLY;
+    if (strlen(path) > MAXPATHLEN)
+	return FATIMG_ERR_INVAL;
+
+    strcpy(dirpath, path);
+    slash = strrchr(dirpath, '/');
+    strcpy(name, (slash != NULL) ? slash + 1 : dirpath);
+    if (name[0] == '\0')
+	return FATIMG_ERR_INVAL;
+    if (slash != NULL)
+	*slash = '\0';
+    else
+	dirpath[0] = '\0';
+
+    pthread_rwlock_wrlock(&img->lock);
+    status = write_locked(img, dirpath, name, buf, len);
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+
+/* check_chain claims the clusters of one chain for owner id, and
+   returns how many it claimed before the chain ended, broke or ran
+   into clusters some other chain had already claimed */
+static uint32_t check_chain(struct fatimg *img, uint16_t cluster,
+			    uint32_t *owner, uint32_t id,
+			    struct fatimg_report *report)
+{
+    uint32_t n = 0;
+
+    if (cluster == CLUST_FREE)
+	return 0;
+    while (TRUE)
+    {
+	if (!valid_cluster(img, cluster) || owner[cluster] == id)
+	{
+	    report->broken_chains++;
+	    break;
+	}
+	if (owner[cluster] != 0)
+	{
+	    report->crosslinks++;
+	    break;
+	}
+	owner[cluster] = id;
+	n++;
+	cluster = fat_get(img, cluster);
+	if (is_end_of_file(cluster))
+	    break;
+    }
+    return n;
+}
+
+
+static void check_dir(struct fatimg *img, uint16_t dir, uint32_t *owner,
+		      uint32_t *ids, struct fatimg_report *report)
+{
+    struct direntry *dirent;
+    struct dir_iter it;
+    uint16_t start;
+    uint32_t n, size;
+
+    dir_start(img, &it, dir);
+    while ((dirent = dir_next(img, &it)) != NULL)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    break;
+	if (!is_live(dirent))
+	    continue;
+
+	start = getushort(dirent->deStartCluster);
+	n = check_chain(img, start, owner, ++*ids, report);
+	if (dirent->deAttributes & ATTR_DIRECTORY)
+	{
+	    report->dirs++;
+	    /* only a chain that was ours alone gets walked, so a
+	       directory that contains itself can't send us round for
+	       ever */
+	    if (n > 0)
+		check_dir(img, start, owner, ids, report);
+	}
+	else
+	{
+	    report->files++;
+	    size = getulong(dirent->deFileSize);
+	    if ((size + img->clust_size - 1) / img->clust_size != n)
+		report->size_mismatches++;
+	}
+    }
+}
+
+
+int fatimg_check(struct fatimg *img, struct fatimg_report *report)
+{
+    /* FAT-12 never has more than 0xff6 clusters, so this fits on the
+       stack of any thread */
+    uint32_t owner[FAT12_MASK + 1];
+    uint32_t ids = 0;
+    uint16_t cluster, value;
+
+    if (img == NULL || report == NULL)
+	return FATIMG_ERR_INVAL;
+
+    memset(report, 0, sizeof(*report));
+    memset(owner, 0, img->nclusters * sizeof(uint32_t));
+
+    pthread_rwlock_rdlock(&img->lock);
+    check_dir(img, MSDOSFSROOT, owner, &ids, report);
+    for (cluster = CLUST_FIRST; cluster < img->nclusters; cluster++)
+    {
+	value = fat_get(img, cluster);
+	if (value == CLUST_FREE)
+	    report->free_clusters++;
+	else if (value != (FAT12_MASK & CLUST_BAD))
+	{
+	    report->used_clusters++;
+	    if (owner[cluster] == 0)
+		report->orphans++;
+	}
+    }
+    pthread_rwlock_unlock(&img->lock);
+    return FATIMG_OK;
+}
@@ -0,0 +1,138 @@
+#ifndef __FATIMG_H__
+#define __FATIMG_H__
+
+/* libfatimg: the disk image code as a library, for programs that want
+   to work on FAT-12 images without running the tools.
+
+   Nothing in the library prints or exits; every call returns one of
+   the FATIMG_ status codes below.  Results go into buffers the caller
+   provides, and the library never allocates memory itself: the handle
+   is a struct the caller owns, which may live on the stack, in a
+   static or inside a bigger structure.
+
+   A handle may be shared between threads.  Lookups, listings, reads
+   and checks take a shared lock on it and run in parallel; writes take
+   it exclusively.  Two handles on the same image don't know about each
+   other, so a process should open each image once. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bpb.h"
+
+/* status codes */
+#define FATIMG_OK 0
+#define FATIMG_ERR_IO (-1)		/* a system call failed; see errno */
+#define FATIMG_ERR_FORMAT (-2)		/* not a FAT-12 image */
+#define FATIMG_ERR_NOENT (-3)		/* no such file or directory */
+#define FATIMG_ERR_NOTDIR (-4)		/* a path component isn't a directory */
+#define FATIMG_ERR_ISDIR (-5)		/* the path names a directory */
+#define FATIMG_ERR_NOSPC (-6)		/* no free clusters or directory slots */
+#define FATIMG_ERR_RDONLY (-7)		/* the image was opened read-only */
+#define FATIMG_ERR_INVAL (-8)		/* a bad argument, or a path that's too long */
+#define FATIMG_ERR_CORRUPT (-9)		/* a cluster chain is broken */
+
+/* flags for fatimg_open() */
+#define FATIMG_RDONLY 0
+#define FATIMG_RDWR 1
+
+#define FATIMG_NAMELEN 13		/* an 8.3 name, its dot and a NUL */
+#define FATIMG_MAXPATH 255
+#define FATIMG_DIRCACHE 16		/* directories remembered per handle */
+
+/* an open image.  The fields are private to the library.
+
+   The handle keeps the FAT decoded, and remembers where recently used
+   directories start, so it goes stale if anything else changes the
+   image while it's open.  A program that keeps a handle for long has
+   to notice that (dos_server compares the file's inode, size and mtime
+   on each request) and reopen the image. */
+struct fatimg {
+    uint8_t *image;
+    size_t size;
+    int fd;
+    int writable;
+    struct bpb33 bpb;
+    uint32_t clust_size;
+    uint16_t nclusters;		/* one past the highest data cluster */
+    uint8_t *fat, *root, *data;
+    pthread_rwlock_t lock;
+
+    uint16_t fatcache[4096];	/* every FAT-12 entry, decoded */
+
+    struct {
+	char path[FATIMG_MAXPATH+1];
+	uint16_t cluster;
+    } dircache[FATIMG_DIRCACHE];
+    int dircache_next;
+    pthread_mutex_t dircache_lock;	/* readers fill the cache too */
+};
+
+/* what fatimg_lookup() and fatimg_list() say about a file */
+struct fatimg_entry {
+    char name[FATIMG_NAMELEN];
+    uint8_t attributes;		/* ATTR_ bits from direntry.h */
+    uint32_t size;
+    uint16_t start_cluster;
+    time_t mtime;
+};
+
+/* what fatimg_check() found.  Nothing is repaired; scandisk does that. */
+struct fatimg_report {
+    uint32_t files, dirs;
+    uint32_t used_clusters, free_clusters;
+    uint32_t orphans;		/* allocated clusters nothing refers to */
+    uint32_t crosslinks;	/* chains that run into another chain */
+    uint32_t broken_chains;	/* chains that loop, or end in a bad or
+				   out of range cluster */
+    uint32_t size_mismatches;	/* files whose size and chain disagree */
+};
+
+/* fatimg_open maps the image at path and checks its boot sector.  With
+   FATIMG_RDONLY the image is never modified. */
+int fatimg_open(struct fatimg *img, const char *path, int flags);
+
+/* fatimg_close unmaps the image.  No other thread may be using it. */
+int fatimg_close(struct fatimg *img);
+
+/* fatimg_sync waits until every change made so far is on disk */
+int fatimg_sync(struct fatimg *img);
+
+/* fatimg_lookup describes the file or directory at path.  Paths use
+   '/' between components, and names match without regard to case.
+   "" and "/" name the root directory. */
+int fatimg_lookup(struct fatimg *img, const char *path,
+		  struct fatimg_entry *entry);
+
+/* fatimg_list fills entries with up to max entries of the directory at
+   path, and sets *count to how many it filled.  *cookie says where to
+   start: set it to 0 for the first call, and pass it back unchanged to
+   carry on.  The listing is finished when *count comes back less than
+   max.  "." and ".." aren't listed. */
+int fatimg_list(struct fatimg *img, const char *path, uint32_t *cookie,
+		struct fatimg_entry *entries, uint32_t max, uint32_t *count);
+
+/* fatimg_read copies up to len bytes of the file at path, starting
+   offset bytes in, into buf, and sets *got to how many it copied.
+   Reading at or past the end of the file gets 0 bytes. */
+int fatimg_read(struct fatimg *img, const char *path, uint32_t offset,
+		void *buf, uint32_t len, uint32_t *got);
+
+/* fatimg_write makes the file at path hold exactly the len bytes in
+   buf, creating it if needed.  Its directory must already exist.  The
+   new contents go into fresh clusters and the directory entry is
+   switched over before the old clusters are freed, and on any error
+   the image is left as it was. */
+int fatimg_write(struct fatimg *img, const char *path, const void *buf,
+		 uint32_t len);
+
+/* fatimg_check walks the whole image and counts what's wrong with it */
+int fatimg_check(struct fatimg *img, struct fatimg_report *report);
+
+/* fatimg_strerror describes a status code */
+const char *fatimg_strerror(int status);
+
+#endif // __FATIMG_H__
@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "ioqueue.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+
+
+int ioq_depth = 0;
+int ioq_engine = IOQ_ANY;
+
+/* how deep the queue is if --io= is given without --queue-depth= */
+#define DEFAULT_DEPTH 32
+
+/* more threads than this don't help the fallback keep a disk busy */
+#define MAX_THREADS 16
+
+
+int ioq_option(int *argc, char **argv)
+{
+    int i, j, rv = 0;
+
+    for (i = j = 0; i < *argc; i++)
+    {
+	if (i > 0 && strncmp(argv[i], "--queue-depth=", 14) == 0)
+	{
+	    ioq_depth = atoi(argv[i] + 14);
+	    if (ioq_depth < 1 || ioq_depth > IOQ_MAXDEPTH)
+		rv = -1;
+	}
+	else if (i > 0 && strncmp(argv[i], "--io=", 5) == 0)
+	{
+	    if (strcmp(argv[i] + 5, "uring") == 0)
+		ioq_engine = IOQ_ANY;
+	    else if (strcmp(argv[i] + 5, "threads") == 0)
+		ioq_engine = IOQ_THREADS;
+	    else
+		rv = -1;
+	    if (ioq_depth == 0)
+		ioq_depth = DEFAULT_DEPTH;
+	}
+	else
+	    argv[j++] = argv[i];
+    }
+    argv[j] = NULL;
+    *argc = j;
+    return rv;
+}
+
+
+const char *ioq_name(struct ioqueue *q)
+{
+    return q->uring ? "io_uring" : "threads";
+}
+
+
+#ifdef HAVE_URING
+
+/* uring_open maps the rings.  The kernel may only give us a ring of
+   the size we ask for, rounded up to a power of two, so it is always
+   at least depth deep and the submission ring can never overflow. */
+static int uring_open(struct ioqueue *q)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    q->ring_fd = syscall(__NR_io_uring_setup, q->depth, &p);
+    if (q->ring_fd < 0)
+	return -1;
+
+    q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+    q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_CQ_RING);
+    q->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   q->ring_fd, IORING_OFF_SQES);
+    if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED
+	|| q->sqes == MAP_FAILED)
+    {
+	if (q->sq_ring != MAP_FAILED)
+	    munmap(q->sq_ring, q->sq_ring_size);
+	if (q->cq_ring != MAP_FAILED)
+	    munmap(q->cq_ring, q->cq_ring_size);
+	if (q->sqes != MAP_FAILED)
+	    munmap(q->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	close(q->ring_fd);
+	return -1;
+    }
+
+    q->sq_head = (uint32_t*)(q->sq_ring + p.sq_off.head);
+    q->sq_tail = (uint32_t*)(q->sq_ring + p.sq_off.tail);
+    q->sq_mask = (uint32_t*)(q->sq_ring + p.sq_off.ring_mask);
+    q->sq_array = (uint32_t*)(q->sq_ring + p.sq_off.array);
+    q->cq_head = (uint32_t*)(q->cq_ring + p.cq_off.head);
+    q->cq_tail = (uint32_t*)(q->cq_ring + p.cq_off.tail);
+    q->cq_mask = (uint32_t*)(q->cq_ring + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*)(q->cq_ring + p.cq_off.cqes);
+    q->unsubmitted = 0;
+    return 0;
+}
+
+
+static void uring_close(struct ioqueue *q)
+{
+    munmap(q->sqes, (*q->sq_mask + 1) * sizeof(struct io_uring_sqe));
+    munmap(q->sq_ring, q->sq_ring_size);
+    munmap(q->cq_ring, q->cq_ring_size);
+    close(q->ring_fd);
+}
+
+
+/* uring_queue puts a request in the submission ring.  The kernel
+   doesn't see it until the next io_uring_enter(), so a burst of
+   submissions costs one system call. */
+static void uring_queue(struct ioqueue *q, int slot)
+{
+    uint32_t tail = *q->sq_tail;
+    uint32_t index = tail & *q->sq_mask;
+    struct io_uring_sqe *sqe = &q->sqes[index];
+    struct ioq_req *r = &q->reqs[slot];
+
+    /* the vectored ops are the oldest, so work on any io_uring kernel */
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (r->op == IOQ_READ) ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&q->iovs[slot];
+    sqe->len = 1;
+    sqe->off = r->offset;
+    sqe->user_data = slot;
+    q->sq_array[index] = index;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->unsubmitted++;
+}
+
+
+/* uring_reap returns the slot of a finished request, submitting
+   whatever is queued and waiting if nothing has finished yet */
+static int uring_reap(struct ioqueue *q)
+{
+    uint32_t head, tail;
+    struct io_uring_cqe *cqe;
+    int slot, empty, rv;
+
+    while (TRUE)
+    {
+	head = *q->cq_head;
+	tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+	empty = (head == tail);
+	if (empty || q->unsubmitted > 0)
+	{
+	    rv = syscall(__NR_io_uring_enter, q->ring_fd, q->unsubmitted,
+			 empty ? 1 : 0, empty ? IORING_ENTER_GETEVENTS : 0,
+			 NULL, 0);
+	    if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		return -1;
+	    if (rv > 0)
+		q->unsubmitted -= rv;
+	    if (empty)
+		continue;
+	}
+
+	cqe = &q->cqes[head & *q->cq_mask];
+	slot = cqe->user_data;
+	q->reqs[slot].result = cqe->res;
+	__atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+	return slot;
+    }
+}
+
+#endif // HAVE_URING
+
+
+/* worker is one thread of the fallback engine: it takes requests in
+   the order they were submitted and does them with pread/pwrite */
+static void *worker(void *arg)
+{
+    struct ioqueue *q = arg;
+    struct ioq_req *r;
+    ssize_t bytes;
+    int slot;
+
+    pthread_mutex_lock(&q->lock);
+    while (TRUE)
+    {
+	while (q->npending == 0 && !q->stopping)
+	    pthread_cond_wait(&q->work, &q->lock);
+	if (q->npending == 0)
+	    break;
+	slot = q->pending[0];
+	memmove(q->pending, q->pending + 1, --q->npending * sizeof(int));
+	pthread_mutex_unlock(&q->lock);
+
+	r = &q->reqs[slot];
+	do
+	{
+	    if (r->op == IOQ_READ)
+		bytes = pread(r->fd, r->buf, r->len, r->offset);
+	    else
+		bytes = pwrite(r->fd, r->buf, r->len, r->offset);
+	} while (bytes < 0 && errno == EINTR);
+	r->result = (bytes < 0) ? -errno : bytes;
+
+	pthread_mutex_lock(&q->lock);
+	q->finished[q->nfinished++] = slot;
+	pthread_cond_signal(&q->done);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+
+static int threads_open(struct ioqueue *q)
+{
+    int i;
+
+    q->pending = malloc(q->depth * sizeof(int));
+    q->finished = malloc(q->depth * sizeof(int));
+    q->npending = q->nfinished = 0;
+    q->stopping = FALSE;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+
+    q->nthreads = (q->depth < MAX_THREADS) ? q->depth : MAX_THREADS;
+    q->threads = malloc(q->nthreads * sizeof(pthread_t));
+    for (i = 0; i < q->nthreads; i++)
+    {
+	if (pthread_create(&q->threads[i], NULL, worker, q) != 0)
+	    break;
+    }
+    q->nthreads = i;
+    if (i == 0)
+    {
+	errno = EAGAIN;
+	return -1;
+    }
+    return 0;
+}
+
+
+static void threads_close(struct ioqueue *q)
+{
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    q->stopping = TRUE;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for (i = 0; i < q->nthreads; i++)
+	pthread_join(q->threads[i], NULL);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->work);
+    pthread_cond_destroy(&q->done);
+    free(q->threads);
+    free(q->pending);
+    free(q->finished);
+}
+
+
+int ioq_open(struct ioqueue *q, int depth, int engine)
+{
+    int i;
+
+    if (depth < 1 || depth > IOQ_MAXDEPTH)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(q, 0, sizeof(*q));
+    q->depth = depth;
+    q->reqs = calloc(depth, sizeof(struct ioq_req));
+    q->iovs = calloc(depth, sizeof(struct iovec));
+    q->free_slots = malloc(depth * sizeof(int));
+    for (i = 0; i < depth; i++)
+	q->free_slots[i] = depth - 1 - i;
+    q->nfree = depth;
+
+#ifdef HAVE_URING
+    /* io_uring may be missing, or blocked by a seccomp filter */
+    if (engine != IOQ_THREADS && uring_open(q) == 0)
+    {
+	q->uring = TRUE;
+	return 0;
+    }
+#endif
+    if (threads_open(q) == 0)
+	return 0;
+
+    free(q->reqs);
+    free(q->iovs);
+    free(q->free_slots);
+    return -1;
+}
+
+
+/* ioq_close waits for anything still in flight before tearing down */
+void ioq_close(struct ioqueue *q)
+{
+    struct ioq_done done;
+
+    while (ioq_wait(q, &done) == 0)
+	;
+#ifdef HAVE_URING
+    if (q->uring)
+	uring_close(q);
+    else
+#endif
+	threads_close(q);
+    free(q->reqs);
+    free(q->iovs);
+    free(q->free_slots);
+}
+
+
+int ioq_submit(struct ioqueue *q, int op, int fd, void *buf, uint32_t len,
+	       uint64_t offset, void *tag)
+{
+    struct ioq_req *r;
+    int slot;
+
+    if (q->nfree == 0)
+    {
+	errno = EAGAIN;
+	return -1;
+    }
+    slot = q->free_slots[--q->nfree];
+    r = &q->reqs[slot];
+    r->op = op;
+    r->fd = fd;
+    r->buf = buf;
+    r->len = len;
+    r->offset = offset;
+    r->tag = tag;
+    q->iovs[slot].iov_base = buf;
+    q->iovs[slot].iov_len = len;
+    q->inflight++;
+
+#ifdef HAVE_URING
+    if (q->uring)
+    {
+	uring_queue(q, slot);
+	return 0;
+    }
+#endif
+    pthread_mutex_lock(&q->lock);
+    q->pending[q->npending++] = slot;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+
+int ioq_wait(struct ioqueue *q, struct ioq_done *done)
+{
+    int slot;
+
+    if (q->inflight == 0)
+	return -1;
+
+#ifdef HAVE_URING
+    if (q->uring)
+    {
+	slot = uring_reap(q);
+	if (slot < 0)
+	    return -1;
+    }
+    else
+#endif
+    {
+	pthread_mutex_lock(&q->lock);
+	while (q->nfinished == 0)
+	    pthread_cond_wait(&q->done, &q->lock);
+	slot = q->finished[--q->nfinished];
+	pthread_mutex_unlock(&q->lock);
+    }
+
+    done->op = q->reqs[slot].op;
+    done->tag = q->reqs[slot].tag;
+    done->result = q->reqs[slot].result;
+    q->free_slots[q->nfree++] = slot;
+    q->inflight--;
+    return 0;
+}
+
+
+/* a piece of a copy or scan: up to IOQ_CHUNK bytes that are read into
+   one buffer and, for a copy, written out again from it */
+struct piece {
+    uint64_t in_off, out_off;
+    uint32_t len, done;
+    int op;
+    uint8_t *buf;
+};
+
+
+/* run_pieces keeps up to depth pieces moving.  A piece is read, then
+   if out_fd isn't -1 written, and its buffer goes to the next piece.
+   Short transfers are carried on from where they stopped.  bad() is
+   told about pieces that fail; otherwise the first error stops any
+   new pieces being started.  Returns the number of failed pieces. */
+static int run_pieces(struct ioqueue *q, struct piece *pieces, int npieces,
+		      int in_fd, int out_fd, int *error,
+		      void (*bad)(uint64_t, uint32_t, int, void *), void *arg)
+{
+    uint8_t *buffers = malloc((size_t)q->depth * IOQ_CHUNK);
+    uint8_t **spare = malloc(q->depth * sizeof(uint8_t *));
+    int nspare, next = 0, failed = 0, i;
+    struct ioq_done done;
+    struct piece *p;
+
+    for (i = 0; i < q->depth; i++)
+	spare[i] = buffers + (size_t)i * IOQ_CHUNK;
+    nspare = q->depth;
+    *error = 0;
+
+    while (TRUE)
+    {
+	while (next < npieces && nspare > 0 && (*error == 0 || bad != NULL))
+	{
+	    p = &pieces[next++];
+	    p->buf = spare[--nspare];
+	    p->done = 0;
+	    p->op = IOQ_READ;
+	    ioq_submit(q, IOQ_READ, in_fd, p->buf, p->len, p->in_off, p);
+	}
+	if (ioq_wait(q, &done) < 0)
+	    break;
+	p = done.tag;
+
+	if (done.result <= 0)
+	{
+	    /* a read that gets nothing has run off the end of the file */
+	    *error = (done.result < 0) ? -done.result : EIO;
+	    if (bad != NULL)
+		bad(p->in_off, p->len, *error, arg);
+	    failed++;
+	    spare[nspare++] = p->buf;
+	    continue;
+	}
+
+	p->done += done.result;
+	if (p->done < p->len)
+	{
+	    if (p->op == IOQ_READ)
+		ioq_submit(q, IOQ_READ, in_fd, p->buf + p->done,
+			   p->len - p->done, p->in_off + p->done, p);
+	    else
+		ioq_submit(q, IOQ_WRITE, out_fd, p->buf + p->done,
+			   p->len - p->done, p->out_off + p->done, p);
+	}
+	else if (p->op == IOQ_READ && out_fd >= 0)
+	{
+	    p->op = IOQ_WRITE;
+	    p->done = 0;
+	    ioq_submit(q, IOQ_WRITE, out_fd, p->buf, p->len, p->out_off, p);
+	}
+	else
+	{
+	    if (p->op == IOQ_WRITE)
+		dos_stats.bytes_out += p->len;
+	    spare[nspare++] = p->buf;
+	}
+    }
+
+    free(spare);
+    free(buffers);
+    return failed;
+}
+
+
+int ioq_copy_out(struct ioqueue *q, int image_fd, uint16_t cluster,
+		 uint32_t size, int out_fd, uint8_t *image_buf,
+		 struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t remaining = size, run, len;
+    uint64_t in_off, out_off = 0;
+    struct extent *extents;
+    struct piece *pieces;
+    int nextents, npieces = 0, error, i;
+
+    nextents = get_extents(cluster, &extents, image_buf, bpb);
+    pieces = malloc((size / IOQ_CHUNK + nextents + 1) * sizeof(struct piece));
+    for (i = 0; i < nextents && remaining > 0; i++)
+    {
+	run = extents[i].count * clust_size;
+	if (run > remaining)
+	    run = remaining;
+	in_off = cluster_to_addr(extents[i].start, image_buf, bpb) - image_buf;
+	dos_stats.clusters_touched += extents[i].count - 1;
+	remaining -= run;
+	for ( ; run > 0; run -= len)
+	{
+	    len = (run < IOQ_CHUNK) ? run : IOQ_CHUNK;
+	    pieces[npieces].in_off = in_off;
+	    pieces[npieces].out_off = out_off;
+	    pieces[npieces].len = len;
+	    npieces++;
+	    in_off += len;
+	    out_off += len;
+	}
+    }
+    free(extents);
+
+    run_pieces(q, pieces, npieces, image_fd, out_fd, &error, NULL, NULL);
+    free(pieces);
+    if (error == 0 && remaining > 0)
+	error = EIO;
+    if (error != 0)
+    {
+	errno = error;
+	return -1;
+    }
+    return 0;
+}
+
+
+int ioq_scan(struct ioqueue *q, int fd, uint64_t offset, uint64_t len,
+	     void (*bad)(uint64_t offset, uint32_t len, int error, void *arg),
+	     void *arg)
+{
+    int npieces = (len + IOQ_CHUNK - 1) / IOQ_CHUNK, failed, error, i;
+    struct piece *pieces = malloc((npieces + 1) * sizeof(struct piece));
+
+    for (i = 0; i < npieces; i++)
+    {
+	pieces[i].in_off = offset + (uint64_t)i * IOQ_CHUNK;
+	pieces[i].out_off = 0;
+	pieces[i].len = (len - (uint64_t)i * IOQ_CHUNK < IOQ_CHUNK)
+	    ? len - (uint64_t)i * IOQ_CHUNK : IOQ_CHUNK;
+    }
+    failed = run_pieces(q, pieces, npieces, fd, -1, &error, bad, arg);
+    free(pieces);
+    return failed;
+}
@@ -0,0 +1,120 @@
+#ifndef __IOQUEUE_H__
+#define __IOQUEUE_H__
+
+/* ioqueue keeps a number of reads and writes in flight at once, so that
+   bulk copies out of an image and whole-image scans overlap their I/O
+   instead of waiting for each cluster in turn.
+
+   It uses io_uring where the kernel has it (through the raw system
+   calls - there's no liburing dependency), and otherwise a pool of
+   threads doing pread() and pwrite().  Requests complete in any order;
+   each carries a tag the caller gets back from ioq_wait(). */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define IOQ_READ 0
+#define IOQ_WRITE 1
+
+/* engines for ioq_open() */
+#define IOQ_ANY 0		/* io_uring if we can, otherwise threads */
+#define IOQ_THREADS 1
+
+#define IOQ_MAXDEPTH 256
+#define IOQ_CHUNK (64 * 1024)	/* the most ioq_copy_out() and ioq_scan()
+				   ask for in one request */
+
+/* what ioq_wait() hands back */
+struct ioq_done {
+    int op;
+    void *tag;
+    int32_t result;		/* bytes transferred, or -errno */
+};
+
+struct ioq_req {
+    int op, fd;
+    void *buf;
+    uint32_t len;
+    uint64_t offset;
+    void *tag;
+    int32_t result;
+};
+
+/* an open queue.  The fields are private to ioqueue.c. */
+struct ioqueue {
+    int depth;
+    int inflight;		/* submitted and not yet waited for */
+    int uring;			/* TRUE for io_uring, FALSE for threads */
+
+    /* io_uring */
+    int ring_fd;
+    uint8_t *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t unsubmitted;	/* queued in the ring, not yet entered */
+
+    /* both: one request per slot, and the slots not in use */
+    struct ioq_req *reqs;
+    struct iovec *iovs;
+    int *free_slots, nfree;
+
+    /* threads */
+    pthread_t *threads;
+    int nthreads;
+    int *pending, npending;	/* slots waiting for a thread */
+    int *finished, nfinished;	/* slots done, waiting for ioq_wait() */
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+};
+
+/* the queue depth and engine asked for with --queue-depth= and --io=;
+   a depth of 0 means the tool should do its I/O the usual way */
+extern int ioq_depth;
+extern int ioq_engine;
+
+/* ioq_option takes --queue-depth=N and --io=uring|threads out of a
+   tool's arguments, like stats_option() does for --stats.  It returns
+   -1 if either has a value we don't understand. */
+int ioq_option(int *argc, char **argv);
+
+/* ioq_open sets up a queue allowing depth requests in flight.  Returns
+   0, or -1 with errno set. */
+int ioq_open(struct ioqueue *q, int depth, int engine);
+void ioq_close(struct ioqueue *q);
+
+/* ioq_name says which engine a queue ended up with */
+const char *ioq_name(struct ioqueue *q);
+
+/* ioq_submit queues one read or write.  It returns -1 with errno
+   EAGAIN if depth requests are already in flight. */
+int ioq_submit(struct ioqueue *q, int op, int fd, void *buf, uint32_t len,
+	       uint64_t offset, void *tag);
+
+/* ioq_wait starts anything queued and waits for one request to finish.
+   It returns -1 if nothing is in flight. */
+int ioq_wait(struct ioqueue *q, struct ioq_done *done);
+
+struct bpb33;
+
+/* ioq_copy_out copies size bytes of the chain starting at cluster from
+   the image open on image_fd to out_fd, starting at the beginning of
+   out_fd.  Returns 0, or -1 with errno set (EIO if the chain is
+   shorter than size). */
+int ioq_copy_out(struct ioqueue *q, int image_fd, uint16_t cluster,
+		 uint32_t size, int out_fd, uint8_t *image_buf,
+		 struct bpb33 *bpb);
+
+/* ioq_scan reads len bytes of fd from offset, throwing the data away,
+   and calls bad() for each IOQ_CHUNK-sized piece that can't be read.
+   Returns the number of bad pieces. */
+int ioq_scan(struct ioqueue *q, int fd, uint64_t offset, uint64_t len,
+	     void (*bad)(uint64_t offset, uint32_t len, int error, void *arg),
+	     void *arg);
+
+#endif // __IOQUEUE_H__
@@ -14,10 +14,21 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "ioqueue.h"
+#include "zimage.h"
 
 
+//number of entries in the per-cluster maps: one past the highest data cluster of the image being checked
+int map_size = 0;
+
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--surface] [--queue-depth=N] [--io=uring|threads] [--map=...] [--overlay=FILE] [--stats] <imagename>\n", progname);
+    fprintf(stderr, "\t--surface: read every data cluster first and report the ones that can't be read\n");
+    fprintf(stderr, "\t--queue-depth=N: keep N surface reads in flight (default 32)\n");
+    fprintf(stderr, "\t--io=uring|threads: how to queue them (default io_uring if the kernel has it)\n");
+    fprintf(stderr, "\t--map=populate,huge,load: prefault the image, back it with huge pages,\n\t\tor load it into memory and write back what changed\n");
+    fprintf(stderr, "\t--overlay=FILE: keep changes in FILE, leaving the image file as it is;\n\t\tFILE is made if it doesn't exist (see dos_overlay)\n");
+    fprintf(stderr, "\t--stats: report counters and timings on stderr when done\n");
     exit(1);
 }//end usage()
 
@@ -137,7 +148,7 @@ bool is_free_clust(uint16_t clust, uint8_t *image_buf, struct bpb33* bpb){
 }//end is_free_cluster
 
 void mark_reference_map(uint16_t clust, int reference_map[], int value){
-	if(clust < 0 || clust >= 2849){
+	if(clust < 0 || clust >= map_size){
 		return;
 	}//end if 
 
@@ -190,16 +201,71 @@ void trim_size_FAT(uint16_t currentclust, uint8_t *image_buf, struct bpb33 *bpb,
 
 }//end trim_FAT_size
 
+void break_cycle(uint16_t clust, uint8_t *image_buf, struct bpb33 *bpb){
+	//walk the chain again, remembering where we've been, and end it at the entry that points back into it.
+	//If it never points back, it's ended at its last valid cluster instead, so the chain is always cut somewhere.
+
+	char *visited = calloc(map_size, 1);
+
+	while(clust >= CLUST_FIRST && clust < map_size){
+		visited[clust] = 1;
+		uint16_t next = get_fat_entry(clust, image_buf, bpb);
+		if(next >= CLUST_FIRST && next < map_size && visited[next]){
+			set_fat_entry(clust, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+			printf("Found a cycle in the FAT (cluster #%d points back to #%d). The entry has been set to EOF.\n\n", clust, next);
+			break;
+		}//end if
+		if(next < CLUST_FIRST || next >= map_size){
+			set_fat_entry(clust, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+			printf("Found no cycle in the FAT chain; its last valid cluster (#%d) has been set to EOF.\n\n", clust);
+			break;
+		}//end if
+		clust = next;
+	}//end while
+
+	free(visited);
+
+}//end break_cycle
+
 int followFATChain(uint16_t data_cluster, int cluster_size, uint8_t *image_buf, struct bpb33 *bpb, int reference_map[]){
 
 	int size_FAT = 0;
 
+	if(data_cluster == CLUST_FREE){//an empty file has no clusters at all
+		return 0;
+	}//end if
+
+	if(data_cluster < CLUST_FIRST || data_cluster >= map_size){//a start cluster that isn't on the disk has no chain to follow
+		return 0;
+	}//end if
+
 	mark_reference_map(data_cluster, reference_map, 1);
 
+	uint16_t first_cluster = data_cluster;
+	int steps = 0;
 	while(!is_end_of_file(data_cluster) && !is_bad_clust(data_cluster, image_buf, bpb)){
+		if(++steps > map_size){//a chain longer than the disk has to loop back on itself somewhere. Cut it and count again.
+			break_cycle(first_cluster, image_buf, bpb);
+			data_cluster = first_cluster;
+			size_FAT = 0;
+			steps = 0;
+			continue;
+		}//end if
 		size_FAT += cluster_size;
 		uint16_t original_cluster = data_cluster;
 		data_cluster = get_fat_entry(data_cluster, image_buf, bpb);
+
+		if(!is_end_of_file(data_cluster) && (data_cluster < CLUST_FIRST || data_cluster >= map_size)){//a free, reserved or out-of-range entry can't continue the chain, so the chain ends here
+			set_fat_entry(original_cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+			if(data_cluster == CLUST_FREE){
+				printf("Found a free cluster (#%d) in a FAT chain. The entry has been set to EOF.\n\n", original_cluster);
+			}//end if
+			else{
+				printf("Found a FAT entry (cluster #%d) that points to invalid cluster #%d. The entry has been set to EOF.\n\n", original_cluster, data_cluster);
+			}//end else
+			data_cluster = original_cluster;
+			break;
+		}//end if
 		mark_reference_map(data_cluster, reference_map, 1);
 
 		if(original_cluster == data_cluster){
@@ -210,7 +276,7 @@ int followFATChain(uint16_t data_cluster, int cluster_size, uint8_t *image_buf,
 		
 	}//end while
 
-	if(is_bad_clust(data_cluster, image_buf, bpb)){//if a bad cluster is found, change it into an EOF. 
+	if(data_cluster < map_size && is_bad_clust(data_cluster, image_buf, bpb)){//if a bad cluster is found, change it into an EOF. 
 		printf("Bad cluster detected: #%d.\n\n", data_cluster);
 		set_fat_entry(data_cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
 	}//end if
@@ -232,50 +298,67 @@ void traverse_world_and_populate_map(uint16_t clust, uint8_t *image_buf, struct
 
 	
 
-	//loop through the directory entries of the start clust
-	struct direntry *dirent = (struct direntry*)cluster_to_addr(clust, image_buf, bpb);
+	//loop through the directory entries of every cluster of this directory. The root directory (cluster 0) is a fixed-size area instead of a cluster chain.
 	int cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
 	int direntry_per_cluster = cluster_size / sizeof(struct direntry);
+	if(clust == 0){
+		direntry_per_cluster = bpb->bpbRootDirEnts;
+	}//end if
 
-    for (int i = 0; i < direntry_per_cluster; i++){
-
-		char entry_name[14];
-		memset(entry_name, '\0', 14);
-		int type = -1;
-		uint16_t startclust = read_dirent(dirent, &type, entry_name);
-		if(type == 1){//if this entry contains information about a directory	
-			traverse_world_and_populate_map(startclust, image_buf, bpb, reference_map);
-		}//end if
-		else if(type == 0){//if this entry contains information about a regular file, get its sizes as indicated by the FAT table and the directory entry, respectively
+	int steps = 0;
+	while(1){
+		struct direntry *dirent = (struct direntry*)cluster_to_addr(clust, image_buf, bpb);
+		for (int i = 0; i < direntry_per_cluster; i++){
+			dos_stats.dirents_scanned++;
+
+			char entry_name[14];
+			memset(entry_name, '\0', 14);
+			int type = -1;
+			uint16_t startclust = read_dirent(dirent, &type, entry_name);
+			if(type == 1){//if this entry contains information about a directory	
+				traverse_world_and_populate_map(startclust, image_buf, bpb, reference_map);
+			}//end if
+			else if(type == 0){//if this entry contains information about a regular file, get its sizes as indicated by the FAT table and the directory entry, respectively
 
-			int size_dirent = -1;
-			int size_FAT = -1;
+				int size_dirent = -1;
+				int size_FAT = -1;
 
-			size_dirent = getulong(dirent->deFileSize);
+				size_dirent = getulong(dirent->deFileSize);
 
-			uint16_t data_cluster = getushort(dirent->deStartCluster);	
-			mark_reference_map(data_cluster, reference_map, 1);
-			size_FAT = followFATChain(data_cluster, cluster_size, image_buf, bpb, reference_map);	
+				uint16_t data_cluster = getushort(dirent->deStartCluster);	
+				mark_reference_map(data_cluster, reference_map, 1);
+				size_FAT = followFATChain(data_cluster, cluster_size, image_buf, bpb, reference_map);	
 
-			//printf("Filename: %s. Direntry size: %d. FAT SIZE: %d.\n", entry_name, size_dirent, size_FAT);//TEST
+				//printf("Filename: %s. Direntry size: %d. FAT SIZE: %d.\n", entry_name, size_dirent, size_FAT);//TEST
 
-			if(size_FAT - size_dirent > cluster_size){
+				if(size_FAT - size_dirent > cluster_size){
 				
-				printf("FAT size is too large for: %s. Direntry size: %d; FAT size: %d. ", entry_name, size_dirent, size_FAT);
-				trim_size_FAT(data_cluster, image_buf, bpb, size_dirent, cluster_size, reference_map);
-				printf("After reconciling sizes: direntry size is: %d; FAT size is: %d. \n\n", size_dirent, followFATChain(data_cluster, cluster_size, image_buf, bpb, reference_map));
-			}//end if
-			else if(size_dirent > size_FAT){
-				printf("Direntry size is too large: %s. Direntry size: %d; FAT size: %d. ", entry_name, size_dirent, size_FAT);
-				trim_size_dirent(dirent, size_FAT);
-				printf("After reconciling sizes: direntry size is: %d; The FAT size is: %d. \n\n", getulong(dirent->deFileSize), size_FAT);
-			}//end if
+					printf("FAT size is too large for: %s. Direntry size: %d; FAT size: %d. ", entry_name, size_dirent, size_FAT);
+					trim_size_FAT(data_cluster, image_buf, bpb, size_dirent, cluster_size, reference_map);
+					printf("After reconciling sizes: direntry size is: %d; FAT size is: %d. \n\n", size_dirent, followFATChain(data_cluster, cluster_size, image_buf, bpb, reference_map));
+				}//end if
+				else if(size_dirent > size_FAT){
+					printf("Direntry size is too large: %s. Direntry size: %d; FAT size: %d. ", entry_name, size_dirent, size_FAT);
+					trim_size_dirent(dirent, size_FAT);
+					printf("After reconciling sizes: direntry size is: %d; The FAT size is: %d. \n\n", getulong(dirent->deFileSize), size_FAT);
+				}//end if
 			
-		}//end else if
+			}//end else if
 
-		dirent++;
+			dirent++;
 
-	}//end for
+		}//end for
+
+		if(clust == 0){
+			break;
+		}//end if
+		clust = get_fat_entry(clust, image_buf, bpb);
+		if(!is_valid_cluster(clust, bpb) || clust >= num_clusters(bpb) || ++steps >= num_clusters(bpb)){
+			break;
+		}//end if
+		mark_reference_map(clust, reference_map, 1);
+
+	}//end while
 
 }//end traverse_world_and_populate_map
 
@@ -369,7 +452,7 @@ void delete_orphans(uint16_t orphan, uint16_t orphan_list[], uint8_t *image_buf,
 	uint16_t currentclust = orphan;
 	while(1){
 
-		for(int i = 0; i < 2849; i++){
+		for(int i = 0; i < map_size; i++){
 			if(orphan_list[i] == currentclust){
 				orphan_list[i] = (uint16_t) 0;
 				break;
@@ -406,7 +489,7 @@ void house_an_orphan(uint16_t orphan, uint8_t *image_buf, struct bpb33* bpb, int
 	strcat(name, ".dat");
 
 	int cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
-	int buffer[2849];
+	int buffer[map_size];
 	int file_size = followFATChain(orphan, cluster_size, image_buf, bpb, buffer);
 	
 	delete_orphans(orphan, orphan_list, image_buf, bpb);
@@ -416,7 +499,7 @@ void house_an_orphan(uint16_t orphan, uint8_t *image_buf, struct bpb33* bpb, int
 
 void house_orphans(uint16_t orphan_list[], uint8_t *image_buf, struct bpb33* bpb){
 	int orphan_count = 0;
-	for(int i = 0; i < 2849; i++){
+	for(int i = 0; i < map_size; i++){
 		if(orphan_list[i] != (uint16_t) 0){
 			orphan_count++;
 			house_an_orphan(orphan_list[i], image_buf, bpb, orphan_count, orphan_list);
@@ -440,6 +523,57 @@ void print_orphans(uint16_t orphan_list[]){
 
 }//end print_orphans
 
+//-------------------------------------------------------------- Surface scan: read the whole data area through the I/O queue
+
+struct surface {
+	uint64_t data_start;//offset of cluster 2 in the image file
+	int cluster_size;
+	int bad_clusters;
+};
+
+void report_bad_read(uint64_t offset, uint32_t len, int error, void *arg){
+	//called by ioq_scan() for each piece of the data area that couldn't be read
+	struct surface *surface = arg;
+	int first = CLUST_FIRST + (offset - surface->data_start) / surface->cluster_size;
+	int last = CLUST_FIRST + (offset + len - 1 - surface->data_start) / surface->cluster_size;
+
+	if(last >= map_size){
+		last = map_size - 1;
+	}//end if
+	printf("Cannot read clusters %d to %d: %s\n", first, last, strerror(error));
+	surface->bad_clusters += last - first + 1;
+}//end report_bad_read
+
+void surface_scan(int fd, uint8_t *image_buf, struct bpb33* bpb){
+	struct ioqueue queue;
+	struct surface surface;
+
+	surface.data_start = cluster_to_addr(CLUST_FIRST, image_buf, bpb) - image_buf;
+	surface.cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	surface.bad_clusters = 0;
+	if(zimage_mapped(image_buf)){//the file is compressed blocks, not the image: check that each one inflates
+		stats_phase(PHASE_DATA);
+		zimage_scan(image_buf, surface.data_start,
+			    (uint64_t)(map_size - CLUST_FIRST) * surface.cluster_size,
+			    report_bad_read, &surface);
+		printf("Surface scan (compressed image): %d of %d clusters unreadable\n",
+		       surface.bad_clusters, map_size - CLUST_FIRST);
+		return;
+	}//end if
+	if(ioq_open(&queue, ioq_depth > 0 ? ioq_depth : 32, ioq_engine) < 0){
+		fprintf(stderr, "Can't set up the I/O queue: %s\n", strerror(errno));
+		exit(1);
+	}//end if
+
+	stats_phase(PHASE_DATA);
+	ioq_scan(&queue, fd, surface.data_start,
+		 (uint64_t)(map_size - CLUST_FIRST) * surface.cluster_size,
+		 report_bad_read, &surface);
+	printf("Surface scan (%s): %d of %d clusters unreadable\n", ioq_name(&queue),
+	       surface.bad_clusters, map_size - CLUST_FIRST);
+	ioq_close(&queue);
+}//end surface_scan
+
 void initialize_reference_map(int reference_map[], int map_size){
 	for(int i = 0; i < map_size; i++){//initialize reference_map
 		reference_map[i] = 0;
@@ -457,24 +591,48 @@ int main(int argc, char** argv) {
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc < 2) {
+
+    int surface = false;
+    char *image = NULL;
+
+    //--queue-depth and --io come out with ioq_option(); --surface, like them, can go anywhere
+    stats_option(&argc, argv);
+    if (map_option(&argc, argv) < 0 || ioq_option(&argc, argv) < 0) {
+	usage(argv[0]);
+    }
+    for (int i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--surface") == 0) {
+	    surface = true;
+	}
+	else if (argv[i][0] == '-' || image != NULL) {
+	    usage(argv[0]);
+	}
+	else {
+	    image = argv[i];
+	}//end if
+    }//end for
+    if (image == NULL) {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(image, &fd);
     bpb = check_bootsector(image_buf);
 	printf("---------------------\n");
 
     // your code should start here...
 	uint16_t root_dir_start_clust = 0;
 
-	int map_size = 2849; //2880 - 1 - 9 - 9 - 14  + 2 = 2849
+	map_size = num_clusters(bpb); //2880 - 1 - 9 - 9 - 14  + 2 = 2849 for a 1.44MB floppy
+	if(surface){
+		surface_scan(fd, image_buf, bpb);
+	}//end if
 	int reference_map[map_size];//means referenced, 0 means not referenced
 	initialize_reference_map(reference_map, map_size);
 	traverse_world_and_populate_map(root_dir_start_clust, image_buf, bpb, reference_map);
 
 	uint16_t orphan_list[map_size];	
 	initialize_orphan_list(orphan_list, map_size);
+	stats_phase(PHASE_REPAIR);
 	find_orphans(reference_map, orphan_list, map_size, image_buf, bpb);
 	print_orphans(orphan_list);
 	house_orphans(orphan_list, image_buf, bpb);
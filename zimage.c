@@ -0,0 +1,487 @@
+#define _GNU_SOURCE		/* mremap() */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "zimage.h"
+
+#ifndef TRUE
+#define TRUE (1)
+#define FALSE (0)
+#endif
+
+
+/* Each mapped image reserves its whole size of address space with no
+   access allowed.  A block is made readable by inflating it into a
+   fresh page-aligned buffer and moving that over the block with
+   mremap(), so another thread never sees a block half filled; it's
+   dropped again by mapping inaccessible memory back over it.  Blocks
+   of zeros are just made readable, since the reserved memory is zeros
+   already, and aren't counted against the cache. */
+
+#define MAX_IMAGES 4		/* dos_diff has two open */
+#define MIN_KEPT 16		/* enough that no one access can need more */
+
+struct zopen {
+    uint8_t *image;		/* the reserved address range */
+    uint64_t span;		/* nblocks * block_size */
+    int fd;
+    struct zimage_header h;
+    struct zimage_block *index;
+    uint8_t *resident;		/* per block, TRUE if it's readable */
+    uint32_t *kept;		/* inflated blocks, the oldest at kept[next] */
+    uint32_t nkept, maxkept, next;
+    uint8_t *packed;		/* a block as it's stored */
+    uint8_t *spare;		/* fresh memory for the next block inflated */
+    z_stream z;
+    char name[256];
+};
+
+static struct zopen *images[MAX_IMAGES];
+static int nimages = 0;
+static char busy = 0;
+static struct sigaction previous;
+
+/* the last address this thread faulted on: faulting twice on the same
+   address of a readable block means it's being written to */
+static __thread const uint8_t *last_fault = NULL;
+
+struct zimage_stats zimage_stats;
+
+
+/* the fault handler can run in any thread, so everything here that
+   changes a mapped image is done holding busy.  It's a spin lock
+   because it has to be taken in a signal handler. */
+static void lock(void)
+{
+    while (__atomic_test_and_set(&busy, __ATOMIC_ACQUIRE))
+	sched_yield();
+}
+
+
+static void unlock(void)
+{
+    __atomic_clear(&busy, __ATOMIC_RELEASE);
+}
+
+
+static uint32_t block_bytes(struct zimage_header *h, uint32_t b)
+{
+    uint64_t left = h->image_size - (uint64_t)b * h->block_size;
+
+    return left < h->block_size ? left : h->block_size;
+}
+
+
+/* fail stops the tool from inside the fault handler, where the access
+   that faulted can't be told it failed */
+static void fail(struct zopen *z, const char *message)
+{
+    char buffer[512];
+    int n;
+
+    n = snprintf(buffer, sizeof(buffer), "%s %s\n", z->name, message);
+    if (n > sizeof(buffer) - 1)
+	n = sizeof(buffer) - 1;
+    if (write(STDERR_FILENO, buffer, n) < 0)
+	_exit(2);
+    _exit(1);
+}
+
+
+/* zimage_is says whether the file open on fd is a compressed image */
+int zimage_is(int fd)
+{
+    char magic[8];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+	&& memcmp(magic, ZIMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+
+/* zimage_read_index reads the header and the index (malloc'd, the
+   caller frees it) of the compressed image open on fd, and checks
+   that they describe a file that could be this one.  Returns -1 if
+   they don't. */
+int zimage_read_index(int fd, struct zimage_header *h,
+		      struct zimage_block **index)
+{
+    struct stat statbuf;
+    uint64_t bytes;
+    uint32_t b;
+
+    if (fstat(fd, &statbuf) < 0
+	|| pread(fd, h, sizeof(*h), 0) != sizeof(*h)
+	|| memcmp(h->magic, ZIMAGE_MAGIC, sizeof(h->magic)) != 0
+	|| h->block_size < 512 || h->block_size > ZIMAGE_MAXBLOCK
+	|| (h->block_size & (h->block_size - 1)) != 0
+	|| h->image_size == 0
+	|| h->nblocks != (h->image_size + h->block_size - 1) / h->block_size)
+	return -1;
+
+    bytes = (uint64_t)h->nblocks * sizeof(struct zimage_block);
+    if (h->index_offset + bytes > statbuf.st_size)
+	return -1;
+    *index = malloc(bytes);
+    if (*index == NULL)
+	return -1;
+    if (pread(fd, *index, bytes, h->index_offset) != bytes)
+	goto bad;
+    for (b = 0; b < h->nblocks; b++)
+    {
+	if ((*index)[b].length > block_bytes(h, b)
+	    || (*index)[b].offset + (*index)[b].length > statbuf.st_size)
+	    goto bad;
+    }
+    return 0;
+
+bad:
+    free(*index);
+    return -1;
+}
+
+
+/* inflate_into reads block b and inflates it into out, which has room
+   for the whole block.  A block stored as it is has only its CRC to
+   vouch for it, so that's always checked; a compressed one has zlib's
+   own check as well, so its CRC only is if check is set.  Returns 0,
+   or an errno value if the block can't be had. */
+static int inflate_into(struct zopen *z, uint32_t b, uint8_t *out, int check)
+{
+    struct zimage_block *block = &z->index[b];
+    uint32_t size = block_bytes(&z->h, b), done;
+    uint8_t *in = block->length == size ? out : z->packed;
+    ssize_t bytes;
+
+    if (block->length == 0)
+    {
+	memset(out, 0, size);
+	return 0;
+    }
+    for (done = 0; done < block->length; done += bytes)
+    {
+	bytes = pread(z->fd, in + done, block->length - done,
+		      block->offset + done);
+	if (bytes < 0 && errno == EINTR)
+	{
+	    bytes = 0;
+	    continue;
+	}
+	if (bytes < 0)
+	    return errno;
+	if (bytes == 0)
+	    return EIO;
+    }
+    if (in != out)
+    {
+	inflateReset(&z->z);
+	z->z.next_in = in;
+	z->z.avail_in = block->length;
+	z->z.next_out = out;
+	z->z.avail_out = size;
+	if (inflate(&z->z, Z_FINISH) != Z_STREAM_END || z->z.total_out != size)
+	    return EIO;
+    }
+    if ((check || in == out) && crc32(0, out, size) != block->crc)
+	return EIO;
+    return 0;
+}
+
+
+/* drop makes the oldest inflated block inaccessible again, giving its
+   memory back */
+static void drop(struct zopen *z)
+{
+    uint32_t b = z->kept[z->next];
+
+    if (mmap(z->image + (uint64_t)b * z->h.block_size, z->h.block_size,
+	     PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+	     -1, 0) == MAP_FAILED)
+	fail(z, "can't be mapped");
+    z->resident[b] = FALSE;
+    z->next = (z->next + 1) % z->maxkept;
+    z->nkept--;
+    zimage_stats.dropped++;
+}
+
+
+/* load makes block b readable, inflating it if it has to */
+static void load(struct zopen *z, uint32_t b)
+{
+    uint8_t *at = z->image + (uint64_t)b * z->h.block_size;
+    uint32_t size = z->h.block_size;
+    int error;
+
+    if (z->index[b].length == 0)
+    {
+	if (mprotect(at, size, PROT_READ) < 0)
+	    fail(z, "can't be mapped");
+	z->resident[b] = TRUE;
+	return;
+    }
+    if (z->nkept == z->maxkept)
+	drop(z);
+
+    error = inflate_into(z, b, z->spare, FALSE);
+    if (error != 0)
+	fail(z, error == EIO ? "is corrupt" : "can't be read");
+    if (mprotect(z->spare, size, PROT_READ) < 0
+	|| mremap(z->spare, size, size, MREMAP_MAYMOVE | MREMAP_FIXED,
+		  at) == MAP_FAILED)
+	fail(z, "can't be mapped");
+    z->spare = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (z->spare == MAP_FAILED)
+	fail(z, "can't be mapped");
+
+    z->resident[b] = TRUE;
+    z->kept[(z->next + z->nkept) % z->maxkept] = b;
+    z->nkept++;
+    zimage_stats.inflated++;
+}
+
+
+static void fault(int sig, siginfo_t *info, void *context)
+{
+    const uint8_t *addr = info->si_addr;
+    struct zopen *z = NULL;
+    int i, saved = errno;
+    uint32_t b;
+
+    lock();
+    for (i = 0; i < nimages && z == NULL; i++)
+    {
+	if (addr >= images[i]->image && addr < images[i]->image + images[i]->span)
+	    z = images[i];
+    }
+    if (z == NULL)
+    {
+	/* not ours: put back whatever handled it before, and let the
+	   access fault again into that */
+	sigaction(SIGSEGV, &previous, NULL);
+	unlock();
+	errno = saved;
+	return;
+    }
+
+    b = (addr - z->image) / z->h.block_size;
+    if (!z->resident[b])
+	load(z, b);
+    else if (addr == last_fault)
+	fail(z, "is a compressed image, which the tools can only read; "
+	     "expand it with dos_zimg first");
+    /* otherwise another thread made it readable while this one waited */
+    last_fault = addr;
+    unlock();
+    errno = saved;
+}
+
+
+/* zimage_map maps the compressed image open on fd, named name for
+   messages, and sets *size to the size of the image inside it.  With
+   populate, as much of it as the cache holds is inflated up front.
+   fd has to stay open until zimage_unmap().  Returns NULL, with errno
+   set, if it can't. */
+uint8_t *zimage_map(int fd, const char *name, uint64_t *size, int populate)
+{
+    struct sigaction action;
+    struct zopen *z;
+    uint32_t b;
+
+    if (nimages == MAX_IMAGES)
+    {
+	errno = EMFILE;
+	return NULL;
+    }
+    z = calloc(1, sizeof(*z));
+    if (z == NULL)
+	return NULL;
+    if (zimage_read_index(fd, &z->h, &z->index) < 0)
+    {
+	free(z);
+	errno = EINVAL;
+	return NULL;
+    }
+    if (z->h.block_size < sysconf(_SC_PAGESIZE))
+    {
+	free(z->index);
+	free(z);
+	errno = EINVAL;
+	return NULL;
+    }
+
+    z->fd = fd;
+    z->span = (uint64_t)z->h.nblocks * z->h.block_size;
+    z->maxkept = ZIMAGE_CACHE / z->h.block_size;
+    if (z->maxkept < MIN_KEPT)
+	z->maxkept = MIN_KEPT;
+    if (z->maxkept > z->h.nblocks)
+	z->maxkept = z->h.nblocks;
+    snprintf(z->name, sizeof(z->name), "%s", name);
+    z->resident = calloc(z->h.nblocks, 1);
+    z->kept = malloc(z->maxkept * sizeof(uint32_t));
+    z->packed = malloc(z->h.block_size);
+    z->image = mmap(NULL, z->span, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    z->spare = mmap(NULL, z->h.block_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (z->resident == NULL || z->kept == NULL || z->packed == NULL
+	|| z->image == MAP_FAILED || z->spare == MAP_FAILED
+	|| inflateInit(&z->z) != Z_OK)
+    {
+	/* this early on, the tools just exit */
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    lock();
+    if (nimages == 0)
+    {
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = fault;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &previous);
+    }
+    images[nimages++] = z;
+    zimage_stats.images++;
+    if (populate)
+    {
+	for (b = 0; b < z->maxkept; b++)
+	    load(z, b);
+    }
+    unlock();
+
+    *size = z->h.image_size;
+    return z->image;
+}
+
+
+static struct zopen *find(const uint8_t *image)
+{
+    int i;
+
+    for (i = 0; i < nimages; i++)
+    {
+	if (images[i]->image == image)
+	    return images[i];
+    }
+    return NULL;
+}
+
+
+/* zimage_unmap lets go of an image zimage_map() returned.  It leaves
+   the file open. */
+void zimage_unmap(uint8_t *image)
+{
+    struct zopen *z;
+    int i;
+
+    lock();
+    z = find(image);
+    if (z == NULL)
+    {
+	unlock();
+	return;
+    }
+    for (i = 0; images[i] != z; i++)
+	;
+    images[i] = images[--nimages];
+    if (nimages == 0)
+	sigaction(SIGSEGV, &previous, NULL);
+    unlock();
+
+    munmap(z->image, z->span);
+    munmap(z->spare, z->h.block_size);
+    inflateEnd(&z->z);
+    free(z->resident);
+    free(z->kept);
+    free(z->packed);
+    free(z->index);
+    free(z);
+}
+
+
+/* zimage_mapped says whether image is one zimage_map() returned */
+int zimage_mapped(uint8_t *image)
+{
+    int found;
+
+    lock();
+    found = find(image) != NULL;
+    unlock();
+    return found;
+}
+
+
+/* zimage_touch reads a byte of each block of any compressed image that
+   the len bytes at p cover, so that they're readable.  That has to be
+   done before handing them to a system call: the kernel doesn't fault,
+   it fails with EFAULT.  len shouldn't be more than the cache holds. */
+void zimage_touch(const uint8_t *p, size_t len)
+{
+    const uint8_t *lo, *hi, *q;
+    struct zopen *z;
+    int i;
+
+    for (i = 0; i < nimages; i++)
+    {
+	z = images[i];
+	lo = p > z->image ? p : z->image;
+	hi = p + len < z->image + z->span ? p + len : z->image + z->span;
+	for (q = lo; q < hi;
+	     q = z->image + ((q - z->image) / z->h.block_size + 1) * z->h.block_size)
+	    (void)*(volatile const uint8_t *)q;
+    }
+}
+
+
+/* zimage_scan reads and checks every block that len bytes at offset in
+   a mapped image cover, without keeping them, and calls bad() with the
+   part of that range in each block that fails, and why.  Returns how
+   many blocks failed. */
+uint32_t zimage_scan(uint8_t *image, uint64_t offset, uint64_t len,
+		     void (*bad)(uint64_t, uint32_t, int, void *), void *arg)
+{
+    struct zopen *z;
+    uint64_t start, end;
+    uint32_t b, nbad = 0;
+    uint8_t *buf;
+    int error;
+
+    lock();
+    z = find(image);
+    unlock();
+    if (z == NULL || len == 0)
+	return 0;
+    if (offset + len > z->h.image_size)
+	len = z->h.image_size - offset;
+    buf = malloc(z->h.block_size);
+
+    for (b = offset / z->h.block_size; b * (uint64_t)z->h.block_size < offset + len; b++)
+    {
+	lock();
+	error = inflate_into(z, b, buf, TRUE);
+	unlock();
+	if (error == 0)
+	    continue;
+	start = (uint64_t)b * z->h.block_size;
+	end = start + block_bytes(&z->h, b);
+	if (start < offset)
+	    start = offset;
+	if (end > offset + len)
+	    end = offset + len;
+	bad(start, end - start, error, arg);
+	nbad++;
+    }
+    free(buf);
+    return nbad;
+}
@@ -0,0 +1,67 @@
+#ifndef __ZIMAGE_H__
+#define __ZIMAGE_H__
+
+/* A compressed image is a disk image cut into blocks of block_size
+   bytes, each compressed on its own with zlib, so that any block can be
+   read without the ones before it.  The file is
+
+       struct zimage_header
+       the stored blocks
+       struct zimage_block[nblocks], the index, at index_offset
+
+   A block whose index length is 0 is all zeros and isn't stored at all;
+   one whose length is its full size is stored as it is.  Blocks with
+   the same contents share one stored copy.  dos_zimg makes them and
+   turns them back into plain images.
+
+   zimage_map() hands the tools a compressed image as memory, the way
+   mmap_file() does a plain one.  None of it is read until it's touched:
+   the first access to a block faults, and the fault handler inflates
+   that block into place.  Only so many blocks are kept, the oldest
+   dropped first, so memory stays bounded however big the image is.
+   The memory is read-only; a tool that tries to change the image is
+   stopped with a message rather than a crash. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ZIMAGE_MAGIC "FATZIMG1"
+#define ZIMAGE_BLOCK (64 * 1024)	/* block size dos_zimg uses by default */
+#define ZIMAGE_MAXBLOCK (1024 * 1024)
+#ifndef ZIMAGE_CACHE
+#define ZIMAGE_CACHE (32 * 1024 * 1024)	/* inflated bytes kept per image */
+#endif
+
+struct zimage_header {
+    char magic[8];
+    uint32_t block_size;	/* a power of two, no smaller than a page */
+    uint32_t nblocks;
+    uint64_t image_size;
+    uint64_t index_offset;
+};
+
+struct zimage_block {
+    uint64_t offset;		/* where it's stored in the file */
+    uint32_t length;		/* bytes stored: 0 for all zeros */
+    uint32_t crc;		/* zlib crc32 of the block inflated */
+};
+
+/* counters for --stats, over every compressed image opened */
+struct zimage_stats {
+    uint32_t images;
+    uint64_t inflated;		/* blocks inflated on a fault */
+    uint64_t dropped;		/* blocks dropped to make room */
+};
+
+extern struct zimage_stats zimage_stats;
+
+int zimage_is(int);
+int zimage_read_index(int, struct zimage_header *, struct zimage_block **);
+uint8_t *zimage_map(int, const char *, uint64_t *, int);
+void zimage_unmap(uint8_t *);
+int zimage_mapped(uint8_t *);
+void zimage_touch(const uint8_t *, size_t);
+uint32_t zimage_scan(uint8_t *, uint64_t, uint64_t,
+		     void (*)(uint64_t, uint32_t, int, void *), void *);
+
+#endif // __ZIMAGE_H__